@@ -0,0 +1,292 @@
+#include "ApiRequest.h"
+
+#include <string.h>
+
+static const char *skipSpace(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+	return p;
+}
+
+static bool isDigit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+// A string starting at p's opening quote. s gets what's between the
+// quotes.
+static const char *readString(const char *p, const char *end, ApiString *s) {
+	if (p >= end || *p != '"')
+		return NULL;
+	const char *start = ++p;
+	while (p < end && *p != '"') {
+		if ((unsigned char) *p < 0x20)
+			return NULL;
+		if (*p == '\\') {
+			if (++p >= end)
+				return NULL;
+			if (*p == 'u') {
+				for (int i = 0; i < 4; i++) {
+					if (++p >= end || !(isDigit(*p) || (*p >= 'a' && *p <= 'f') || (*p >= 'A' && *p <= 'F')))
+						return NULL;
+				}
+			} else if (strchr("\"\\/bfnrt", *p) == NULL) {
+				return NULL;
+			}
+		}
+		p++;
+	}
+	if (p >= end)
+		return NULL;
+	s->ptr = start;
+	s->len = p - start;
+	return p + 1;
+}
+
+// Digits in [p, end) as a uint64_t; false if there are none, anything
+// else is there, or the value is out of range
+static bool readDigits(const char *p, const char *end, uint64_t *value) {
+	uint64_t v = 0;
+	if (p == end)
+		return false;
+	for (; p < end; p++) {
+		if (!isDigit(*p))
+			return false;
+		unsigned d = *p - '0';
+		if (v > (UINT64_MAX - d) / 10)
+			return false;
+		v = v * 10 + d;
+	}
+	*value = v;
+	return true;
+}
+
+// A number, checked against the JSON grammar but not converted
+static const char *skipNumber(const char *p, const char *end) {
+	if (p < end && *p == '-')
+		p++;
+	if (p >= end || !isDigit(*p))
+		return NULL;
+	if (*p == '0')
+		p++;
+	else
+		while (p < end && isDigit(*p))
+			p++;
+	if (p < end && *p == '.') {
+		if (++p >= end || !isDigit(*p))
+			return NULL;
+		while (p < end && isDigit(*p))
+			p++;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < end && (*p == '+' || *p == '-'))
+			p++;
+		if (p >= end || !isDigit(*p))
+			return NULL;
+		while (p < end && isDigit(*p))
+			p++;
+	}
+	return p;
+}
+
+// An ID or LSN: a non-negative integer, bare or quoted
+static const char *readId(const char *p, const char *end, uint64_t *value) {
+	if (p < end && *p == '"') {
+		ApiString s;
+		const char *next = readString(p, end, &s);
+		if (next == NULL || !readDigits(s.ptr, s.ptr + s.len, value))
+			return NULL;
+		return next;
+	}
+
+	const char *next = skipNumber(p, end);
+	if (next == NULL || !readDigits(p, next, value))
+		return NULL;
+	return next;
+}
+
+static const char *skipLiteral(const char *p, const char *end, const char *word) {
+	size_t n = strlen(word);
+	if ((size_t) (end - p) < n || memcmp(p, word, n) != 0)
+		return NULL;
+	return p + n;
+}
+
+// Any value, checked but not kept
+static const char *skipValue(const char *p, const char *end, int depth) {
+	ApiString s;
+
+	if (p >= end || depth > API_MAX_DEPTH)
+		return NULL;
+
+	switch (*p) {
+	case '"':
+		return readString(p, end, &s);
+	case 't':
+		return skipLiteral(p, end, "true");
+	case 'f':
+		return skipLiteral(p, end, "false");
+	case 'n':
+		return skipLiteral(p, end, "null");
+	case '[':
+	case '{': {
+		char close = *p == '[' ? ']' : '}';
+		p = skipSpace(p + 1, end);
+		if (p < end && *p == close)
+			return p + 1;
+		while (p != NULL) {
+			if (close == '}') {
+				p = readString(p, end, &s);
+				if (p == NULL)
+					return NULL;
+				p = skipSpace(p, end);
+				if (p >= end || *p != ':')
+					return NULL;
+				p = skipSpace(p + 1, end);
+			}
+			p = skipValue(p, end, depth + 1);
+			if (p == NULL)
+				return NULL;
+			p = skipSpace(p, end);
+			if (p >= end)
+				return NULL;
+			if (*p == close)
+				return p + 1;
+			if (*p != ',')
+				return NULL;
+			p = skipSpace(p + 1, end);
+		}
+		return NULL;
+	}
+	default:
+		return skipNumber(p, end);
+	}
+}
+
+bool ApiString::is(const char *s) const {
+	return (size_t) len == strlen(s) && memcmp(ptr, s, len) == 0;
+}
+
+const char *ApiRequest::parseObject(const char *p, const char *end) {
+	fields = 0;
+
+	if (p >= end || *p != '{')
+		return NULL;
+	p = skipSpace(p + 1, end);
+	if (p < end && *p == '}')
+		return p + 1;
+
+	for (;;) {
+		ApiString key;
+		p = readString(p, end, &key);
+		if (p == NULL)
+			return NULL;
+		p = skipSpace(p, end);
+		if (p >= end || *p != ':')
+			return NULL;
+		p = skipSpace(p + 1, end);
+
+		unsigned field = 0;
+		uint64_t *id = NULL;
+		ApiString *text = NULL;
+		if (key.is("node_id")) {
+			field = FIELD_NODE_ID;
+			id = &node_id;
+		} else if (key.is("node_a_id")) {
+			field = FIELD_NODE_A_ID;
+			id = &node_a_id;
+		} else if (key.is("node_b_id")) {
+			field = FIELD_NODE_B_ID;
+			id = &node_b_id;
+		} else if (key.is("min_lsn")) {
+			field = FIELD_MIN_LSN;
+			id = &min_lsn;
+		} else if (key.is("limit")) {
+			field = FIELD_LIMIT;
+			id = &limit;
+		} else if (key.is("mode")) {
+			field = FIELD_MODE;
+			text = &mode;
+		} else if (key.is("scope")) {
+			field = FIELD_SCOPE;
+			text = &scope;
+		} else if (key.is("op")) {
+			field = FIELD_OP;
+			text = &op;
+		} else if (key.is("cursor")) {
+			field = FIELD_CURSOR;
+			text = &cursor;
+		} else if (key.is("ops")) {
+			field = FIELD_OPS;
+		}
+
+		const char *start = p;
+		if (has(field)) {
+			p = skipValue(p, end, 1);
+		} else if (id != NULL) {
+			uint64_t value;
+			p = readId(p, end, &value);
+			if (p != NULL)
+				*id = value;
+		} else if (text != NULL) {
+			p = readString(p, end, text);
+		} else {
+			p = skipValue(p, end, 1);
+			if (p != NULL && field == FIELD_OPS) {
+				if (*start != '[')
+					return NULL;
+				ops.ptr = start;
+				ops.len = p - start;
+			}
+		}
+		if (p == NULL)
+			return NULL;
+		fields |= field;
+
+		p = skipSpace(p, end);
+		if (p >= end)
+			return NULL;
+		if (*p == '}')
+			return p + 1;
+		if (*p != ',')
+			return NULL;
+		p = skipSpace(p + 1, end);
+	}
+}
+
+bool ApiRequest::parse(const char *json, int len) {
+	const char *end = json + len;
+	const char *p = parseObject(skipSpace(json, end), end);
+	return p != NULL && skipSpace(p, end) == end;
+}
+
+ApiOpReader::ApiOpReader(const ApiString &ops)
+	: p(ops.ptr + 1), end(ops.ptr + ops.len - 1), first(true) {
+}
+
+int ApiOpReader::next(ApiRequest *op) {
+	p = skipSpace(p, end);
+	if (p >= end)
+		return 0;
+	if (!first) {
+		if (*p != ',')
+			return 0;
+		p = skipSpace(p + 1, end);
+	}
+	first = false;
+
+	const char *after = op->parseObject(p, end);
+	if (after != NULL) {
+		p = after;
+		return 1;
+	}
+
+	// The array was checked when the batch was parsed, so the element can
+	// be skipped even if it isn't an op
+	p = skipValue(p, end, 1);
+	if (p == NULL) {
+		p = end;
+		return 0;
+	}
+	return -1;
+}
@@ -0,0 +1,76 @@
+#ifndef API_REQUEST_H
+#define API_REQUEST_H
+
+#include <cstdint>
+
+// Keys of an /api/v1 request body, as bits of ApiRequest::fields
+#define FIELD_NODE_ID   (1 << 0)
+#define FIELD_NODE_A_ID (1 << 1)
+#define FIELD_NODE_B_ID (1 << 2)
+#define FIELD_MIN_LSN   (1 << 3)
+#define FIELD_MODE      (1 << 4)
+#define FIELD_SCOPE     (1 << 5)
+#define FIELD_OP        (1 << 6)
+#define FIELD_OPS       (1 << 7)
+#define FIELD_LIMIT     (1 << 8)
+#define FIELD_CURSOR    (1 << 9)
+
+// Deepest nesting of arrays and objects a request body may have
+#define API_MAX_DEPTH 16
+
+// A string value, pointing into the request body. Escapes are left as
+// they are; none of the values the API takes need them.
+struct ApiString {
+	const char *ptr;
+	int len;
+
+	bool is(const char *s) const;
+};
+
+// The fields of an /api/v1 request body, read in one pass over the body
+// with nothing allocated, so a handler can keep it on the stack. Keys the
+// API doesn't define are skipped. IDs, min_lsn and limit must be integers
+// from 0 to 2^64-1, written as numbers or as strings of digits; the other
+// fields are strings. If a key appears twice the first one counts.
+struct ApiRequest {
+	unsigned fields;
+	uint64_t node_id;
+	uint64_t node_a_id;
+	uint64_t node_b_id;
+	uint64_t min_lsn;
+	uint64_t limit;
+	ApiString mode;
+	ApiString scope;
+	ApiString op;
+	ApiString cursor;
+
+	// The ops array of a batch, brackets included, read with ApiOpReader
+	ApiString ops;
+
+	bool has(unsigned field) const { return (fields & field) != 0; }
+
+	// False unless json is a single JSON object whose known fields have
+	// the right types
+	bool parse(const char *json, int len);
+
+	// Reads one object starting at p, the first byte after it on success
+	// and NULL otherwise
+	const char *parseObject(const char *p, const char *end);
+};
+
+// Reads the ops of a batch, one at a time, into a caller's ApiRequest
+class ApiOpReader {
+public:
+	ApiOpReader(const ApiString &ops);
+
+	// 1 with the next op in op, 0 after the last, or -1 for an element
+	// that isn't a well-formed op object, which is then skipped
+	int next(ApiRequest *op);
+
+private:
+	const char *p;
+	const char *end;
+	bool first;
+};
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef BFS_H
+#define BFS_H
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+// Distance per dense node ID, stamped with the epoch of the search that
+// wrote it. Starting a new search bumps the epoch instead of clearing the
+// array, so a query only pays for the nodes it touches.
+class VisitMap {
+public:
+	VisitMap() : epoch(0) {}
+
+	void reset(size_t num_ids) {
+		if (slots.size() < num_ids) {
+			Slot empty = { 0, 0 };
+			slots.resize(num_ids, empty);
+		}
+		if (++epoch == 0) {
+			for (size_t i = 0; i < slots.size(); i++)
+				slots[i].epoch = 0;
+			epoch = 1;
+		}
+	}
+
+	bool visited(uint32_t u) const { return slots[u].epoch == epoch; }
+	uint32_t distance(uint32_t u) const { return slots[u].distance; }
+
+	void visit(uint32_t u, uint32_t distance) {
+		slots[u].epoch = epoch;
+		slots[u].distance = distance;
+	}
+
+private:
+	struct Slot {
+		uint32_t epoch;
+		uint32_t distance;
+	};
+
+	std::vector<Slot> slots;
+	uint32_t epoch;
+};
+
+// Epoch stamp per dense node ID that several threads can race to claim.
+// Used by level-synchronous searches, where the distance is the level.
+class AtomicVisitMap {
+public:
+	AtomicVisitMap() : capacity(0), epoch(0) {}
+
+	// Not thread-safe; call between searches
+	void reset(size_t num_ids) {
+		if (capacity < num_ids) {
+			capacity = num_ids * 2;
+			stamps.reset(new std::atomic<uint32_t>[capacity]);
+			for (size_t i = 0; i < capacity; i++)
+				stamps[i].store(0, std::memory_order_relaxed);
+			epoch = 0;
+		}
+		if (++epoch == 0) {
+			for (size_t i = 0; i < capacity; i++)
+				stamps[i].store(0, std::memory_order_relaxed);
+			epoch = 1;
+		}
+	}
+
+	// True for exactly one caller per node per search
+	bool claim(uint32_t u) {
+		uint32_t seen = stamps[u].load(std::memory_order_relaxed);
+		if (seen == epoch)
+			return false;
+		return stamps[u].compare_exchange_strong(seen, epoch, std::memory_order_relaxed);
+	}
+
+private:
+	std::unique_ptr<std::atomic<uint32_t>[]> stamps;
+	size_t capacity;
+	uint32_t epoch;
+};
+
+// One bit per dense node ID, cleared in bulk between levels.
+class Bitmap {
+public:
+	void reset(size_t num_ids) { words.assign((num_ids + 63) / 64, 0); }
+	void set(uint32_t u) { words[u >> 6] |= (uint64_t) 1 << (u & 63); }
+	bool test(uint32_t u) const { return (words[u >> 6] >> (u & 63)) & 1; }
+
+private:
+	std::vector<uint64_t> words;
+};
+
+// FIFO of dense node IDs over a power-of-two ring that only grows.
+class RingQueue {
+public:
+	RingQueue() : head(0), tail(0), mask(0) {}
+
+	void clear() { head = tail = 0; }
+	bool empty() const { return head == tail; }
+	size_t size() const { return tail - head; }
+
+	void push(uint32_t u) {
+		if (tail - head == ring.size())
+			grow();
+		ring[tail++ & mask] = u;
+	}
+
+	uint32_t pop() { return ring[head++ & mask]; }
+
+private:
+	std::vector<uint32_t> ring;
+	size_t head, tail, mask;
+
+	void grow() {
+		std::vector<uint32_t> bigger(ring.empty() ? 64 : ring.size() * 2);
+		for (size_t i = head; i < tail; i++)
+			bigger[i - head] = ring[i & mask];
+		tail -= head;
+		head = 0;
+		ring.swap(bigger);
+		mask = ring.size() - 1;
+	}
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "EdgeIntents.h"
+
+EdgeIntents::EdgeIntents() {
+	pthread_mutex_init(&lock, NULL);
+}
+
+EdgeIntents::~EdgeIntents() {
+	pthread_mutex_destroy(&lock);
+}
+
+EdgeIntents::Key EdgeIntents::key(uint64_t node_a_id, uint64_t node_b_id) {
+	if (node_a_id < node_b_id)
+		return std::make_pair(node_a_id, node_b_id);
+	else
+		return std::make_pair(node_b_id, node_a_id);
+}
+
+// Whether anything held is in r's way. Call with lock held.
+bool EdgeIntents::held(const Reservation &r) const {
+	if (r.node)
+		return per_node.count(r.key.first) != 0 || nodes.count(r.key.first) != 0;
+	return intents.count(r.key) != 0 || nodes.count(r.key.first) != 0 ||
+	       nodes.count(r.key.second) != 0;
+}
+
+// Whether r has to wait, given the nodes with reservations queued ahead
+// of it. Call with lock held.
+bool EdgeIntents::blocked(const Reservation &r, const std::unordered_map<uint64_t, unsigned> &ahead) const {
+	if (held(r))
+		return true;
+	if (r.node || r.next)
+		return false;
+	return ahead.count(r.key.first) != 0 || ahead.count(r.key.second) != 0;
+}
+
+void EdgeIntents::hold(const Reservation &r) {
+	if (r.node) {
+		nodes.insert(r.key.first);
+	} else {
+		intents.insert(r.key);
+		per_node[r.key.first]++;
+		per_node[r.key.second]++;
+	}
+}
+
+// Holds r at once if nothing is in its way, and otherwise queues it.
+// Call with lock held.
+bool EdgeIntents::take(const Reservation &r) {
+	if (blocked(r, queued)) {
+		waiting.push_back(r);
+		if (r.node)
+			queued[r.key.first]++;
+		return false;
+	}
+	hold(r);
+	return true;
+}
+
+// Holds every queued reservation, oldest first, that nothing held or
+// still queued ahead of it is in the way of. Call with lock held.
+void EdgeIntents::grant(std::vector<Reservation> &granted) {
+	std::unordered_map<uint64_t, unsigned> ahead;
+	std::list<Reservation>::iterator it = waiting.begin();
+	while (it != waiting.end()) {
+		if (blocked(*it, ahead)) {
+			if (it->node)
+				ahead[it->key.first]++;
+			++it;
+		} else {
+			if (it->node && --queued[it->key.first] == 0)
+				queued.erase(it->key.first);
+			hold(*it);
+			granted.push_back(*it);
+			it = waiting.erase(it);
+		}
+	}
+}
+
+// Tells the holders of newly granted reservations. Call without lock.
+void EdgeIntents::call(const std::vector<Reservation> &granted) {
+	for (size_t i = 0; i < granted.size(); i++)
+		granted[i].granted(granted[i].arg);
+}
+
+bool EdgeIntents::reserveEdge(uint64_t node_a_id, uint64_t node_b_id, bool next,
+                              Granted granted, void *arg) {
+	Reservation r;
+	r.key = key(node_a_id, node_b_id);
+	r.node = false;
+	r.next = next;
+	r.granted = granted;
+	r.arg = arg;
+
+	pthread_mutex_lock(&lock);
+	bool now = take(r);
+	pthread_mutex_unlock(&lock);
+	return now;
+}
+
+bool EdgeIntents::reserve(uint64_t node_a_id, uint64_t node_b_id, Granted granted, void *arg) {
+	return reserveEdge(node_a_id, node_b_id, false, granted, arg);
+}
+
+bool EdgeIntents::reserveNext(uint64_t node_a_id, uint64_t node_b_id, Granted granted, void *arg) {
+	return reserveEdge(node_a_id, node_b_id, true, granted, arg);
+}
+
+void EdgeIntents::release(uint64_t node_a_id, uint64_t node_b_id) {
+	Key k = key(node_a_id, node_b_id);
+	std::vector<Reservation> granted;
+
+	pthread_mutex_lock(&lock);
+	intents.erase(k);
+	if (--per_node[k.first] == 0)
+		per_node.erase(k.first);
+	if (--per_node[k.second] == 0)
+		per_node.erase(k.second);
+	grant(granted);
+	pthread_mutex_unlock(&lock);
+
+	call(granted);
+}
+
+bool EdgeIntents::reserveNode(uint64_t node_id, Granted granted, void *arg) {
+	Reservation r;
+	r.key = std::make_pair(node_id, node_id);
+	r.node = true;
+	r.next = false;
+	r.granted = granted;
+	r.arg = arg;
+
+	pthread_mutex_lock(&lock);
+	bool now = take(r);
+	pthread_mutex_unlock(&lock);
+	return now;
+}
+
+void EdgeIntents::releaseNode(uint64_t node_id) {
+	std::vector<Reservation> granted;
+
+	pthread_mutex_lock(&lock);
+	nodes.erase(node_id);
+	grant(granted);
+	pthread_mutex_unlock(&lock);
+
+	call(granted);
+}
+
+// A thread blocked in waitToReserveNode
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool granted;
+} Waiter;
+
+static void waiter_init(Waiter *w) {
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->granted = false;
+}
+
+static void wake_waiter(void *arg) {
+	Waiter *w = (Waiter *) arg;
+	pthread_mutex_lock(&w->lock);
+	w->granted = true;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// Blocks until w is granted, then frees its lock and condition
+static void waiter_wait(Waiter *w) {
+	pthread_mutex_lock(&w->lock);
+	while (!w->granted)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+}
+
+void EdgeIntents::waitToReserveNode(uint64_t node_id) {
+	Waiter w;
+	waiter_init(&w);
+	if (reserveNode(node_id, wake_waiter, &w))
+		w.granted = true;
+	waiter_wait(&w);
+}
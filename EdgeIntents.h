@@ -0,0 +1,84 @@
+#ifndef EDGE_INTENTS_H
+#define EDGE_INTENTS_H
+
+#include <pthread.h>
+
+#include <list>
+#include <set>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <unordered_map>
+
+// Cross-partition edge writes in flight on this partition. The lower
+// partition applies such a write in three steps: reserve an intent for the
+// edge, replicate it to the higher partition with no graph lock held, then
+// apply it locally and release the intent. While the intent is held, other
+// writes to the same edge and removal of either endpoint wait for it.
+//
+// Nothing waits by blocking. A reservation that conflicts with one held is
+// queued and granted once the conflict is released, by calling its
+// callback on the releasing thread with no lock held. Queued reservations
+// are granted in the order they were made, and once a node's reservation
+// is queued, later edge reservations on the node queue behind it, so a
+// steady stream of edge writes can't starve a removal. The one exception
+// is reserveNext, for a batch that reserves its edges in order while
+// holding the ones before: a removal queued behind one of those must not
+// in turn hold up the next.
+class EdgeIntents {
+public:
+	typedef void (*Granted)(void *arg);
+
+	EdgeIntents();
+	~EdgeIntents();
+
+	// Reserves an intent for the edge. Returns true if it is held on
+	// return; otherwise granted(arg) is called once it is.
+	bool reserve(uint64_t node_a_id, uint64_t node_b_id, Granted granted, void *arg);
+
+	// As reserve, for a caller already holding other intents. Waits only
+	// for held reservations, not for queued node reservations.
+	bool reserveNext(uint64_t node_a_id, uint64_t node_b_id, Granted granted, void *arg);
+	void release(uint64_t node_a_id, uint64_t node_b_id);
+
+	// Reserves node_id for its removal: held once no intent involves it,
+	// and no intent on it is granted until releaseNode. Returns true if
+	// held on return; otherwise granted(arg) is called once it is.
+	bool reserveNode(uint64_t node_id, Granted granted, void *arg);
+	void releaseNode(uint64_t node_id);
+
+	// Blocking form, only for threads that may sit out a replication RPC
+	void waitToReserveNode(uint64_t node_id);
+
+private:
+	typedef std::pair<uint64_t, uint64_t> Key;
+
+	// A reservation, of an edge or, with node set, of the node key.first.
+	// next is set for reserveNext.
+	struct Reservation {
+		Key key;
+		bool node;
+		bool next;
+		Granted granted;
+		void *arg;
+	};
+
+	pthread_mutex_t lock;
+	std::set<Key> intents;
+	std::unordered_map<uint64_t, unsigned> per_node;
+	std::set<uint64_t> nodes;
+	std::list<Reservation> waiting;
+	// Node reservations in waiting, by node
+	std::unordered_map<uint64_t, unsigned> queued;
+
+	static Key key(uint64_t node_a_id, uint64_t node_b_id);
+	bool held(const Reservation &r) const;
+	bool blocked(const Reservation &r, const std::unordered_map<uint64_t, unsigned> &ahead) const;
+	void hold(const Reservation &r);
+	bool take(const Reservation &r);
+	bool reserveEdge(uint64_t node_a_id, uint64_t node_b_id, bool next, Granted granted, void *arg);
+	void grant(std::vector<Reservation> &granted);
+	void call(const std::vector<Reservation> &granted);
+};
+
+#endif
@@ -1,34 +1,227 @@
+#include <algorithm>
+
 #include "Graph.h"
 
+// Compact once the deltas hold more than 1/COMPACT_RATIO of the base size
+#define COMPACT_RATIO 8
+#define COMPACT_MIN_ENTRIES 4096
+
+void Graph::NeighborIterator::skip() {
+	// Tombstones are a subset of the base row in the same order
+	while (base != base_end && tomb != tomb_end && *base == *tomb) {
+		++base;
+		++tomb;
+	}
+}
+
+void Graph::NeighborIterator::next() {
+	if (from_base()) {
+		++base;
+		skip();
+	} else {
+		++ins;
+	}
+}
+
+void Graph::NeighborIterator::seekPast(uint64_t id) {
+	// Tombstones follow the base row's order, so cut at the same ID they
+	// still pair up with the base entries left
+	base = upperBoundId(base, base_end, ids, id);
+	ins = upperBoundId(ins, ins_end, ids, id);
+	tomb = upperBoundId(tomb, tomb_end, ids, id);
+	skip();
+}
+
+Graph::Graph() : num_edges(0), delta_entries(0), compaction(NULL), pool(NULL), parallel(NULL) {
+	tuning.alpha = 14;
+	tuning.beta = 24;
+}
+
+Graph::~Graph() {
+	setSearchThreads(0);
+	delete compaction;
+}
+
+const uint32_t *Graph::lowerBound(const uint32_t *first, const uint32_t *last,
+                                  const uint64_t *ids, uint32_t v) {
+	size_t len = last - first;
+	while (len > 0) {
+		size_t half = len / 2;
+		if (precedes(ids, first[half], v)) {
+			first += half + 1;
+			len -= half + 1;
+		} else {
+			len = half;
+		}
+	}
+	return first;
+}
+
+// First entry in [first, last) whose external ID is above id
+const uint32_t *Graph::upperBoundId(const uint32_t *first, const uint32_t *last,
+                                    const uint64_t *ids, uint64_t id) {
+	size_t len = last - first;
+	while (len > 0) {
+		size_t half = len / 2;
+		if (ids[first[half]] <= id) {
+			first += half + 1;
+			len -= half + 1;
+		} else {
+			len = half;
+		}
+	}
+	return first;
+}
+
+Graph::NeighborIterator Graph::makeIterator(const Csr &csr, uint32_t u, const uint64_t *ids,
+                                            const std::vector<uint32_t> &delta_of,
+                                            const std::vector<DeltaBuffer> &deltas) {
+	NeighborIterator it;
+	it.ids = ids;
+	it.base = it.base_end = NULL;
+	it.ins = it.ins_end = NULL;
+	it.tomb = it.tomb_end = NULL;
+
+	if (u + 1 < csr.offsets.size()) {
+		it.base = csr.targets.data() + csr.offsets[u];
+		it.base_end = csr.targets.data() + csr.offsets[u + 1];
+	}
+
+	if (u < delta_of.size() && delta_of[u] != NodeIndex::NONE) {
+		const DeltaBuffer &d = deltas[delta_of[u]];
+		if (d.dropped)
+			it.base = it.base_end = NULL;
+		it.ins = d.inserts.data();
+		it.ins_end = it.ins + d.inserts.size();
+		it.tomb = d.tombstones.data();
+		it.tomb_end = it.tomb + d.tombstones.size();
+	}
+
+	it.skip();
+	return it;
+}
+
+Graph::NeighborIterator Graph::neighbors(uint32_t u) const {
+	return makeIterator(base, u, ids.data(), delta_of, deltas);
+}
+
+Graph::DeltaBuffer &Graph::delta(uint32_t u) {
+	if (delta_of[u] == NodeIndex::NONE) {
+		DeltaBuffer d;
+		d.owner = u;
+		d.dropped = false;
+		d.dirty = true;
+		delta_of[u] = deltas.size();
+		deltas.push_back(d);
+	}
+	return deltas[delta_of[u]];
+}
+
+bool Graph::hasNeighbor(uint32_t u, uint32_t v) const {
+	const uint64_t *id_data = ids.data();
+
+	if (delta_of[u] != NodeIndex::NONE) {
+		const DeltaBuffer &d = deltas[delta_of[u]];
+		const uint32_t *first = d.inserts.data();
+		const uint32_t *last = first + d.inserts.size();
+		const uint32_t *it = lowerBound(first, last, id_data, v);
+		if (it != last && *it == v)
+			return true;
+		if (d.dropped)
+			return false;
+
+		first = d.tombstones.data();
+		last = first + d.tombstones.size();
+		it = lowerBound(first, last, id_data, v);
+		if (it != last && *it == v)
+			return false;
+	}
+
+	if (u + 1 >= base.offsets.size())
+		return false;
+	const uint32_t *first = base.targets.data() + base.offsets[u];
+	const uint32_t *last = base.targets.data() + base.offsets[u + 1];
+	const uint32_t *it = lowerBound(first, last, id_data, v);
+	return it != last && *it == v;
+}
+
+uint64_t Graph::degree(uint32_t u) const {
+	uint64_t count = 0;
+	if (u + 1 < base.offsets.size())
+		count = base.offsets[u + 1] - base.offsets[u];
+
+	if (delta_of[u] != NodeIndex::NONE) {
+		const DeltaBuffer &d = deltas[delta_of[u]];
+		if (d.dropped)
+			count = 0;
+		else
+			count -= d.tombstones.size();
+		count += d.inserts.size();
+	}
+	return count;
+}
+
+size_t Graph::position(const std::vector<uint32_t> &list, uint32_t v) const {
+	return lowerBound(list.data(), list.data() + list.size(), ids.data(), v) - list.data();
+}
+
+// Records u -> v, which must not currently be an edge
+void Graph::insertDirected(uint32_t u, uint32_t v) {
+	DeltaBuffer &d = delta(u);
+	d.dirty = true;
+
+	size_t i = position(d.tombstones, v);
+	if (i < d.tombstones.size() && d.tombstones[i] == v) {
+		d.tombstones.erase(d.tombstones.begin() + i);
+		delta_entries--;
+	} else {
+		d.inserts.insert(d.inserts.begin() + position(d.inserts, v), v);
+		delta_entries++;
+	}
+}
+
+// Records the removal of u -> v, which must currently be an edge
+void Graph::eraseDirected(uint32_t u, uint32_t v) {
+	DeltaBuffer &d = delta(u);
+	d.dirty = true;
+
+	size_t i = position(d.inserts, v);
+	if (i < d.inserts.size() && d.inserts[i] == v) {
+		d.inserts.erase(d.inserts.begin() + i);
+		delta_entries--;
+	} else {
+		d.tombstones.insert(d.tombstones.begin() + position(d.tombstones, v), v);
+		delta_entries++;
+	}
+}
+
 uint64_t Graph::numNodes() {
-	return my_graph.size();
+	return index.size();
 }
 
+// Counts each undirected edge once per endpoint
 uint64_t Graph::numEdges() {
-	uint64_t numEdges = 0;
-	std::map<uint64_t, std::set<uint64_t> >::iterator it;
-	for (it = my_graph.begin(); it != my_graph.end(); ++it) {
-    	numEdges += (it->second).size();
-    }
-    return numEdges;
+	return num_edges;
 }
 
 std::vector<uint64_t> Graph::getNodes() {
 	std::vector<uint64_t> v;
-	std::map<uint64_t, std::set<uint64_t> >::iterator it;
-	for (it = my_graph.begin(); it != my_graph.end(); ++it) {
-		v.push_back(it->first);
+	v.reserve(index.size());
+	for (uint32_t u = 0; u < ids.size(); u++) {
+		if (live[u])
+			v.push_back(ids[u]);
 	}
 	return v;
 }
 
 std::vector<std::pair<uint64_t, uint64_t> > Graph::getEdges() {
 	std::vector<std::pair<uint64_t, uint64_t> > v;
-	std::map<uint64_t, std::set<uint64_t> >::iterator it;
-	std::set<uint64_t>::iterator i;
-	for (it = my_graph.begin(); it != my_graph.end(); ++it) {
-		for (i = my_graph[it->first].begin(); i != my_graph[it->first].end(); ++i) {
-			v.push_back(std::make_pair(it->first, *i));
+	v.reserve(num_edges);
+	for (uint32_t u = 0; u < ids.size(); u++) {
+		if (!live[u])
+			continue;
+		for (NeighborIterator it = neighbors(u); !it.done(); it.next()) {
+			v.push_back(std::make_pair(ids[u], ids[*it]));
 		}
 	}
 	return v;
@@ -36,126 +229,226 @@ std::vector<std::pair<uint64_t, uint64_t> > Graph::getEdges() {
 
 
 int Graph::addNode(uint64_t node_id) {
-	std::set<uint64_t> new_set;
-	if (my_graph.insert(make_pair(node_id, new_set)).second == false) 
-		return EXISTS;
+	uint32_t u;
+	if (free_ids.empty())
+		u = ids.size();
 	else
-		return SUCCESS;
-}
+		u = free_ids.back();
 
-int Graph::addEdge(uint64_t node_a_id, uint64_t node_b_id) {     
-	if (node_a_id == node_b_id || 
-		my_graph.find(node_a_id) == my_graph.end() || 
-		my_graph.find(node_b_id) == my_graph.end())         
-		return ERROR;     
-	else if (my_graph[node_a_id].find(node_b_id) != my_graph[node_a_id].end())
+	if (index.insert(node_id, u) == false)
 		return EXISTS;
-	else {
-		my_graph[node_a_id].insert(node_b_id);
-		my_graph[node_b_id].insert(node_a_id); 
-		return SUCCESS;
+
+	if (u == ids.size()) {
+		ids.push_back(node_id);
+		live.push_back(1);
+		delta_of.push_back(NodeIndex::NONE);
+	} else {
+		free_ids.pop_back();
+		ids[u] = node_id;
+		live[u] = 1;
 	}
+	return SUCCESS;
+}
+
+int Graph::addEdge(uint64_t node_a_id, uint64_t node_b_id) {
+	if (node_a_id == node_b_id)
+		return ERROR;
+
+	uint32_t a = index.find(node_a_id);
+	uint32_t b = index.find(node_b_id);
+	if (a == NodeIndex::NONE || b == NodeIndex::NONE)
+		return ERROR;
+	else if (hasNeighbor(a, b))
+		return EXISTS;
+
+	insertDirected(a, b);
+	insertDirected(b, a);
+	num_edges += 2;
+	return SUCCESS;
 }
 
+// Drops the node together with every edge incident to it. The dense ID is
+// only recycled after the next compaction, once no base row refers to it.
 int Graph::removeNode(uint64_t node_id) {
-	if (my_graph.erase(node_id) == 1)
-		return SUCCESS;
-	else
+	uint32_t u = index.find(node_id);
+	if (u == NodeIndex::NONE)
 		return ERROR;
+
+	std::vector<uint32_t> adjacent;
+	for (NeighborIterator it = neighbors(u); !it.done(); it.next()) {
+		adjacent.push_back(*it);
+	}
+	for (size_t i = 0; i < adjacent.size(); i++) {
+		eraseDirected(adjacent[i], u);
+	}
+	num_edges -= 2 * adjacent.size();
+
+	DeltaBuffer &d = delta(u);
+	delta_entries -= d.inserts.size() + d.tombstones.size();
+	std::vector<uint32_t>().swap(d.inserts);
+	std::vector<uint32_t>().swap(d.tombstones);
+	d.dropped = true;
+	d.dirty = true;
+
+	index.erase(node_id);
+	live[u] = 0;
+	retired.push_back(u);
+	return SUCCESS;
 }
 
 int Graph::removeEdge(uint64_t node_a_id, uint64_t node_b_id) {
-	if (node_a_id == node_b_id ||
-		my_graph.find(node_a_id) == my_graph.end() ||
-		my_graph.find(node_b_id) == my_graph.end() ||
-		my_graph[node_a_id].find(node_b_id) == my_graph[node_a_id].end() ||
-		my_graph[node_b_id].find(node_a_id) == my_graph[node_b_id].end())
+	if (node_a_id == node_b_id)
 		return ERROR;
-	else {
-		my_graph[node_a_id].erase(node_b_id);
-		my_graph[node_b_id].erase(node_a_id);
-		return SUCCESS;
-	}
+
+	uint32_t a = index.find(node_a_id);
+	uint32_t b = index.find(node_b_id);
+	if (a == NodeIndex::NONE || b == NodeIndex::NONE || !hasNeighbor(a, b))
+		return ERROR;
+
+	eraseDirected(a, b);
+	eraseDirected(b, a);
+	num_edges -= 2;
+	return SUCCESS;
 }
 
 std::pair<int, bool> Graph::getNode(uint64_t node_id) {
-	if (my_graph.find(node_id) == my_graph.end())
+	if (index.find(node_id) == NodeIndex::NONE)
 		return std::make_pair(SUCCESS, false);
 	else
 		return std::make_pair(SUCCESS, true);
 }
 
 std::pair<int, bool> Graph::getEdge(uint64_t node_a_id, uint64_t node_b_id) {
-	if (node_a_id == node_b_id ||
-		my_graph.find(node_a_id) == my_graph.end() ||
-		my_graph.find(node_b_id) == my_graph.end()) 
+	if (node_a_id == node_b_id)
+		return std::make_pair(ERROR, false);
+
+	uint32_t a = index.find(node_a_id);
+	uint32_t b = index.find(node_b_id);
+	if (a == NodeIndex::NONE || b == NodeIndex::NONE)
 		return std::make_pair(ERROR, false);
-	else if (my_graph[node_a_id].find(node_b_id) == my_graph[node_a_id].end() ||
-			 my_graph[node_b_id].find(node_a_id) == my_graph[node_b_id].end())
+	else if (!hasNeighbor(a, b))
 		return std::make_pair(SUCCESS, false);
 	else
 		return std::make_pair(SUCCESS, true);
 }
 
-std::pair<int, std::string> Graph::getNeighbors(uint64_t node_id) {
-	std::string return_string;
-	if (my_graph.find(node_id) == my_graph.end()) {
-		return std::make_pair(ERROR, return_string);
-	} 
-	else {
-		std::set<uint64_t>::iterator i;
-		for (i = my_graph[node_id].begin(); i != my_graph[node_id].end(); ++i) {
-			return_string.append(std::to_string(*i));
-			return_string.append(",");
-		}
-		if (!return_string.empty())
-			return_string.pop_back();
-		return std::make_pair(SUCCESS, return_string); 
+bool Graph::findNeighbors(uint64_t node_id, NeighborIterator *it) const {
+	uint32_t u = index.find(node_id);
+	if (u == NodeIndex::NONE)
+		return false;
+	*it = neighbors(u);
+	return true;
+}
+
+std::pair<int, std::vector<uint64_t> > Graph::getNeighborIds(uint64_t node_id) {
+	std::vector<uint64_t> result;
+	uint32_t u = index.find(node_id);
+	if (u == NodeIndex::NONE)
+		return std::make_pair(ERROR, result);
+
+	for (NeighborIterator it = neighbors(u); !it.done(); it.next())
+		result.push_back(ids[*it]);
+	return std::make_pair(SUCCESS, result);
+}
+
+bool Graph::needsCompaction() {
+	uint64_t threshold = base.targets.size() / COMPACT_RATIO;
+	if (threshold < COMPACT_MIN_ENTRIES)
+		threshold = COMPACT_MIN_ENTRIES;
+	return compaction == NULL && delta_entries > threshold;
+}
+
+// Snapshots everything the rebuild reads. Writes made after this point
+// mark their delta dirty and are carried over by finishCompaction.
+void Graph::beginCompaction() {
+	compaction = new Compaction();
+	for (size_t i = 0; i < deltas.size(); i++) {
+		deltas[i].dirty = false;
 	}
+	compaction->rows = ids.size();
+	compaction->delta_entries = delta_entries;
+	compaction->ids = ids;
+	compaction->delta_of = delta_of;
+	compaction->deltas = deltas;
+	compaction->retired.swap(retired);
 }
 
-std::pair<int, uint64_t> Graph::shortestPath(uint64_t node_a_id, uint64_t node_b_id) {
+void Graph::buildCompaction() {
+	Compaction *c = compaction;
+	Csr &out = c->result;
 
-	uint64_t distance = 0;
-    int size = my_graph.size();
+	out.offsets.resize(c->rows + 1);
+	out.offsets[0] = 0;
+	out.targets.reserve(base.targets.size() + c->delta_entries);
 
-    if (node_a_id == node_b_id ||
-    	my_graph.find(node_a_id) == my_graph.end() || 
-		my_graph.find(node_b_id) == my_graph.end())         
-		return std::make_pair(EXISTS, distance); 
+	for (uint32_t u = 0; u < c->rows; u++) {
+		NeighborIterator it = makeIterator(base, u, c->ids.data(), c->delta_of, c->deltas);
+		for (; !it.done(); it.next()) {
+			out.targets.push_back(*it);
+		}
+		out.offsets[u + 1] = out.targets.size();
+	}
+}
+
+// Swaps in the new base and rebases any delta written during the build
+// against it; deltas untouched since beginCompaction are fully folded.
+void Graph::finishCompaction() {
+	Compaction *c = compaction;
+
+	std::vector<std::pair<uint32_t, std::vector<uint32_t> > > changed;
+	for (size_t i = 0; i < deltas.size(); i++) {
+		if (!deltas[i].dirty)
+			continue;
+		uint32_t u = deltas[i].owner;
+		changed.push_back(std::make_pair(u, std::vector<uint32_t>()));
+		for (NeighborIterator it = neighbors(u); !it.done(); it.next()) {
+			changed.back().second.push_back(*it);
+		}
+	}
 
+	base.offsets.swap(c->result.offsets);
+	base.targets.swap(c->result.targets);
+	delta_of.assign(ids.size(), NodeIndex::NONE);
+	deltas.clear();
+	delta_entries = 0;
 
-    std::map<uint64_t, uint64_t> bfs_map;
-    std::map<uint64_t, std::set<uint64_t> >::iterator it;
+	for (size_t i = 0; i < changed.size(); i++) {
+		uint32_t u = changed[i].first;
+		const std::vector<uint32_t> &now = changed[i].second;
+		const uint32_t *row = NULL, *row_end = NULL;
+		if (u < c->rows) {
+			row = base.targets.data() + base.offsets[u];
+			row_end = base.targets.data() + base.offsets[u + 1];
+		}
 
-	for (it = my_graph.begin(); it != my_graph.end(); ++it) {
-    	bfs_map[it->first] = size + 1;
-    }
+		if (!live[u]) {
+			if (row != row_end)
+				delta(u).dropped = true;
+			continue;
+		}
 
-    std::list<uint64_t> queue;
-    std::set<uint64_t>::iterator i;
- 
-    bfs_map[node_a_id] = distance;
-    queue.push_back(node_a_id);
- 
-    while (!queue.empty()) {
-    	uint64_t current_node = queue.front();
-        distance = bfs_map[current_node];
-        distance++;
-        queue.pop_front();
- 
-        for (i = my_graph[current_node].begin(); i != my_graph[current_node].end(); ++i) {
-        	if (*i == node_b_id) {
-        		return std::make_pair(SUCCESS, distance);
-        	}
-            else if (distance < bfs_map[*i]) {
-                bfs_map[*i] = distance;
-                queue.push_back(*i);
-            }
+		std::vector<uint32_t> inserts, tombstones;
+		size_t k = 0;
+		while (k < now.size() || row != row_end) {
+			if (row == row_end || (k < now.size() && precedes(ids.data(), now[k], *row))) {
+				inserts.push_back(now[k++]);
+			} else if (k == now.size() || precedes(ids.data(), *row, now[k])) {
+				tombstones.push_back(*row++);
+			} else {
+				k++;
+				row++;
+			}
+		}
+		if (inserts.empty() && tombstones.empty())
+			continue;
 
-        }
-    }
+		delta_entries += inserts.size() + tombstones.size();
+		DeltaBuffer &d = delta(u);
+		d.inserts.swap(inserts);
+		d.tombstones.swap(tombstones);
+	}
 
-    return std::make_pair(ERROR, size + 1);
+	free_ids.insert(free_ids.end(), c->retired.begin(), c->retired.end());
+	delete c;
+	compaction = NULL;
 }
-
@@ -1,32 +1,189 @@
-#include <map>
-#include <set>
-#include <list>
+#ifndef GRAPH_H
+#define GRAPH_H
+
 #include <vector>
 #include <cstdint>
 #include <string>
+#include <functional>
+#include <unordered_map>
+
+#include "NodeIndex.h"
+
+class ThreadPool;
+struct ParallelSearch;
 
 #define SUCCESS 200
 #define EXISTS 204
-#define ERROR 400 
+#define ERROR 400
 
+// Strategy used by Graph::shortestPath
+enum SearchMode {
+	SEARCH_AUTO,
+	SEARCH_FORWARD,
+	SEARCH_BIDIRECTIONAL,
+	SEARCH_DIRECTION_OPTIMIZING,
+	SEARCH_PARALLEL
+};
+
+// Switching thresholds for SEARCH_DIRECTION_OPTIMIZING. A level runs
+// bottom-up once the frontier's edges exceed 1/alpha of the unexplored
+// edges, and returns to top-down once the frontier holds fewer than
+// 1/beta of the nodes.
+struct SearchTuning {
+	uint32_t alpha;
+	uint32_t beta;
+};
 
+// A node reached by a cross-partition search and its distance from the source
+typedef std::pair<uint64_t, uint64_t> Seed;
+
+// What the calling thread's most recent search did. levels has one entry
+// per expanded level: 'T' for top-down, 'B' for bottom-up, 'P' for a
+// top-down level split across the search thread pool.
+struct SearchStats {
+	uint64_t visited;
+	uint64_t edges_checked;
+	std::string levels;
+};
+
+
+// Nodes are addressed externally by uint64 ID and internally by a dense
+// uint32 ID handed out by NodeIndex. Adjacency lives in a read-optimized
+// compressed sparse row (CSR) base plus small per-node delta buffers that
+// absorb writes. Every neighbor list, base or delta, holds dense IDs sorted
+// by external ID. Compaction periodically folds the deltas into a new base.
 class Graph {
+public:
+	// A removed node's dense ID can linger in tombstoned entries after the
+	// same external ID is re-added, so ties are broken by dense ID.
+	static bool precedes(const uint64_t *ids, uint32_t x, uint32_t y) {
+		return ids[x] < ids[y] || (ids[x] == ids[y] && x < y);
+	}
+
+	// Walks one node's neighbors in external-ID order, merging the base row
+	// with the node's delta buffer on the fly.
+	class NeighborIterator {
+	public:
+		bool done() const { return base == base_end && ins == ins_end; }
+		uint32_t operator*() const { return from_base() ? *base : *ins; }
+		uint64_t id() const { return ids[**this]; }
+		void next();
+
+		// Skips ahead to the first neighbor with an external ID above id,
+		// by binary search of the base row and the delta buffer
+		void seekPast(uint64_t id);
+	private:
+		friend class Graph;
+		const uint32_t *base, *base_end;
+		const uint32_t *ins, *ins_end;
+		const uint32_t *tomb, *tomb_end;
+		const uint64_t *ids;
+
+		bool from_base() const {
+			return ins == ins_end || (base != base_end && precedes(ids, *base, *ins));
+		}
+		void skip();
+	};
+
 private:
-	std::map<uint64_t, std::set<uint64_t> > my_graph;
+	struct Csr {
+		std::vector<uint64_t> offsets;
+		std::vector<uint32_t> targets;
+	};
+
+	// Pending changes to one node's base row. Inserts never appear in the
+	// base row, tombstones always do. A dropped row ignores the base
+	// entirely (the node was removed).
+	struct DeltaBuffer {
+		uint32_t owner;
+		bool dropped;
+		bool dirty;
+		std::vector<uint32_t> inserts;
+		std::vector<uint32_t> tombstones;
+	};
+
+	struct Compaction {
+		uint32_t rows;
+		uint64_t delta_entries;
+		std::vector<uint64_t> ids;
+		std::vector<uint32_t> delta_of;
+		std::vector<DeltaBuffer> deltas;
+		std::vector<uint32_t> retired;
+		Csr result;
+	};
+
+	NodeIndex index;
+	std::vector<uint64_t> ids;
+	std::vector<uint8_t> live;
+	std::vector<uint32_t> free_ids;
+	std::vector<uint32_t> retired;
+	uint64_t num_edges;
+
+	Csr base;
+	std::vector<uint32_t> delta_of;
+	std::vector<DeltaBuffer> deltas;
+	uint64_t delta_entries;
+	Compaction *compaction;
+	SearchTuning tuning;
+	ThreadPool *pool;
+	ParallelSearch *parallel;
+
+	static const uint32_t *lowerBound(const uint32_t *first, const uint32_t *last,
+	                                  const uint64_t *ids, uint32_t v);
+	static const uint32_t *upperBoundId(const uint32_t *first, const uint32_t *last,
+	                                    const uint64_t *ids, uint64_t id);
+	static NeighborIterator makeIterator(const Csr &csr, uint32_t u, const uint64_t *ids,
+	                                     const std::vector<uint32_t> &delta_of,
+	                                     const std::vector<DeltaBuffer> &deltas);
+	NeighborIterator neighbors(uint32_t u) const;
+	size_t position(const std::vector<uint32_t> &list, uint32_t v) const;
+	DeltaBuffer &delta(uint32_t u);
+	bool hasNeighbor(uint32_t u, uint32_t v) const;
+	uint64_t degree(uint32_t u) const;
+	void insertDirected(uint32_t u, uint32_t v);
+	void eraseDirected(uint32_t u, uint32_t v);
+	uint32_t forwardSearch(uint32_t a, uint32_t b) const;
+	uint32_t bidirectionalSearch(uint32_t a, uint32_t b) const;
+	uint32_t directionOptimizingSearch(uint32_t a, uint32_t b) const;
+	uint32_t parallelSearch(uint32_t a, uint32_t b) const;
 public:
+	Graph();
+	~Graph();
 	uint64_t numNodes();
 	uint64_t numEdges();
 	std::vector<uint64_t> getNodes();
 	std::vector<std::pair<uint64_t, uint64_t> > getEdges();
-	int addNode(uint64_t node_id); 
+	int addNode(uint64_t node_id);
 	int addEdge(uint64_t node_a_id, uint64_t node_b_id);
 	int removeNode(uint64_t node_id);
 	int removeEdge(uint64_t node_a_id, uint64_t node_b_id);
 	std::pair<int, bool> getNode(uint64_t node_id);
 	std::pair<int, bool> getEdge(uint64_t node_a_id, uint64_t node_b_id);
-	std::pair<int, std::string> getNeighbors(uint64_t node_id);
-	std::pair<int, uint64_t> shortestPath(uint64_t node_a_id, uint64_t node_b_id);     
-};
+	std::pair<int, std::vector<uint64_t> > getNeighborIds(uint64_t node_id);
 
+	// Sets it to walk node_id's neighbors, for callers that write them out
+	// as they go rather than collect them. id() is each neighbor's external
+	// ID. Only valid while the graph lock is held. False if the node isn't
+	// in the graph.
+	bool findNeighbors(uint64_t node_id, NeighborIterator *it) const;
+	std::pair<int, uint64_t> shortestPath(uint64_t node_a_id, uint64_t node_b_id,
+	                                      SearchMode mode = SEARCH_AUTO);
+	uint64_t expandFrontier(std::vector<Seed> seeds, uint64_t target, uint64_t bound,
+	                        const std::function<bool(uint64_t)> &owned,
+	                        std::unordered_map<uint64_t, uint64_t> &known,
+	                        std::vector<Seed> &boundary) const;
+	void setSearchTuning(const SearchTuning &t);
+	void setSearchThreads(unsigned num_threads);
+	static const SearchStats &lastSearchStats();
 
+	// Compaction runs in three steps so the expensive rebuild can happen
+	// without blocking requests. begin and finish must be called with the
+	// graph lock held exclusively; build only reads state captured by begin
+	// and must not overlap with another compaction.
+	bool needsCompaction();
+	void beginCompaction();
+	void buildCompaction();
+	void finishCompaction();
+};
 
+#endif
@@ -0,0 +1,608 @@
+#include "GraphClient.h"
+#include "Graph.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define CLIENT_CONNECTIONS 4
+#define CLIENT_PIPELINE_DEPTH 32
+#define CLIENT_ATTEMPTS 3
+#define CLIENT_BACKOFF_MS 50
+#define CLIENT_TIMEOUT_MS 10000
+#define CLIENT_POLL_MS 100
+
+static uint64_t monotonic_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Only the get_ calls leave the graph as it was
+static bool is_write(const char *uri) {
+	return strncmp(uri, "/api/v1/get_", strlen("/api/v1/get_")) != 0;
+}
+
+static std::string make_request(const std::string &host, const char *uri, const char *body) {
+	char head[256];
+	snprintf(head, sizeof(head), "POST %s HTTP/1.1\r\n"
+	                             "Host: %s\r\n"
+	                             "Content-Type: application/json\r\n"
+	                             "Content-Length: %zu\r\n"
+	                             "\r\n", uri, host.c_str(), strlen(body));
+	return std::string(head) + body;
+}
+
+// Finds header name (with its colon) in head and returns a pointer to its
+// value, or NULL
+static const char *find_header(const std::string &head, const char *name) {
+	size_t len = strlen(name);
+	for (size_t line = head.find("\r\n"); line != std::string::npos; line = head.find("\r\n", line + 2)) {
+		if (line + 2 + len <= head.size() && strncasecmp(head.c_str() + line + 2, name, len) == 0)
+			return head.c_str() + line + 2 + len;
+	}
+	return NULL;
+}
+
+// Length of the chunked body starting at in[start], through the blank
+// line after its last chunk, or 0 if it hasn't all arrived
+static size_t chunked_length(const std::string &in, size_t start) {
+	size_t p = start;
+	for (;;) {
+		size_t eol = in.find("\r\n", p);
+		if (eol == std::string::npos)
+			return 0;
+		size_t len = strtoull(in.c_str() + p, NULL, 16);
+		if (len == 0) {
+			size_t end = in.find("\r\n\r\n", eol);
+			return end != std::string::npos ? end + 4 - start : 0;
+		}
+		p = eol + 2 + len + 2;
+		if (p > in.size())
+			return 0;
+	}
+}
+
+// Appends the data of the complete chunked body at in[start] to body
+static void unchunk(const std::string &in, size_t start, std::string *body) {
+	body->clear();
+	size_t p = start;
+	for (;;) {
+		size_t eol = in.find("\r\n", p);
+		size_t len = strtoull(in.c_str() + p, NULL, 16);
+		if (len == 0)
+			return;
+		body->append(in, eol + 2, len);
+		p = eol + 2 + len + 2;
+	}
+}
+
+// Takes one reply off the front of in. Long get_neighbors replies come
+// chunked. Replies with neither a Content-Length nor chunks, including
+// the bare status lines older servers send for errors, run until the
+// server closes the connection, so they are only complete at eof.
+static bool parse_reply(std::string &in, bool eof, int *status, std::string *body, bool *close_after) {
+	size_t end = in.find("\r\n\r\n");
+	size_t head_len;
+	if (end != std::string::npos)
+		head_len = end + 4;
+	else if (eof && !in.empty())
+		head_len = in.size();
+	else
+		return false;
+
+	std::string head = in.substr(0, head_len);
+	if (head.compare(0, 5, "HTTP/") == 0) {
+		const char *space = strchr(head.c_str(), ' ');
+		*status = space != NULL ? atoi(space + 1) : ERROR;
+	} else {
+		// Handlers answer malformed requests with plain text
+		*status = ERROR;
+	}
+
+	const char *length = find_header(head, "Content-Length:");
+	const char *encoding = find_header(head, "Transfer-Encoding:");
+	bool chunked = encoding != NULL && strncasecmp(encoding + strspn(encoding, " "), "chunked", 7) == 0;
+	size_t total;
+	if (chunked) {
+		size_t body_len = chunked_length(in, head_len);
+		if (body_len == 0)
+			return false;
+		total = head_len + body_len;
+	} else if (length != NULL) {
+		total = head_len + strtoull(length, NULL, 10);
+	} else if (*status == EXISTS) {
+		total = head_len;
+	} else if (eof) {
+		total = in.size();
+	} else {
+		return false;
+	}
+	if (in.size() < total)
+		return false;
+
+	const char *connection = find_header(head, "Connection:");
+	*close_after = connection != NULL && strncasecmp(connection + strspn(connection, " "), "close", 5) == 0;
+
+	if (chunked)
+		unchunk(in, head_len, body);
+	else
+		body->assign(in, head_len, total - head_len);
+	in.erase(0, total);
+	return true;
+}
+
+static bool in_graph(const std::string &body) {
+	return body.find("true") != std::string::npos;
+}
+
+static std::vector<uint64_t> neighbor_ids(const std::string &body) {
+	std::vector<uint64_t> ids;
+	size_t key = body.find("\"neighbors\"");
+	if (key == std::string::npos)
+		return ids;
+	size_t open = body.find('[', key);
+	if (open == std::string::npos)
+		return ids;
+
+	const char *p = body.c_str() + open + 1;
+	while (*p != '\0' && *p != ']') {
+		char *end;
+		uint64_t id = strtoull(p, &end, 10);
+		if (end == p) {
+			p++;
+			continue;
+		}
+		ids.push_back(id);
+		p = end;
+	}
+	return ids;
+}
+
+GraphClient::GraphClient(const std::vector<std::string> &http_hosts, const char *config)
+	: per_partition(CLIENT_CONNECTIONS), depth(CLIENT_PIPELINE_DEPTH), valid(true) {
+	pools.resize(http_hosts.size());
+	for (size_t p = 0; p < http_hosts.size(); p++) {
+		pools[p].host = http_hosts[p];
+		pools[p].persistent = PERSIST_UNKNOWN;
+		pools[p].failures = 0;
+		pools[p].retry_ms = 0;
+	}
+	setConnections(per_partition);
+
+	if (config == NULL) {
+		partitioner.setHosts(http_hosts);
+	} else if (partitioner.load(config) != SUCCESS || partitioner.size() != http_hosts.size()) {
+		fprintf(stderr, "GraphClient: %s doesn't describe %lu partitions \n", config, http_hosts.size());
+		partitioner.setHosts(http_hosts);
+		valid = false;
+	}
+}
+
+GraphClient::~GraphClient() {
+	for (size_t p = 0; p < pools.size(); p++)
+		for (size_t i = 0; i < pools[p].connections.size(); i++)
+			close(pools[p].connections[i]);
+}
+
+void GraphClient::setConnections(unsigned n) {
+	per_partition = n > 0 ? n : 1;
+	for (size_t p = 0; p < pools.size(); p++) {
+		std::vector<Connection> &cs = pools[p].connections;
+		for (size_t i = per_partition; i < cs.size(); i++)
+			close(cs[i]);
+		size_t had = cs.size();
+		cs.resize(per_partition);
+		for (size_t i = had; i < cs.size(); i++) {
+			cs[i].fd = -1;
+			cs[i].sent = 0;
+			cs[i].answered = 0;
+			cs[i].active_ms = 0;
+		}
+	}
+}
+
+void GraphClient::setPipelineDepth(unsigned d) {
+	depth = d > 0 ? d : 1;
+}
+
+void GraphClient::nodeRequests(const char *uri, const std::vector<uint64_t> &node_ids,
+                               std::vector<Request> &requests) {
+	requests.resize(node_ids.size());
+	for (size_t i = 0; i < node_ids.size(); i++) {
+		char body[64];
+		snprintf(body, sizeof(body), "{\"node_id\": %lu}", node_ids[i]);
+		Request &r = requests[i];
+		r.partition = partitioner.owner(node_ids[i]);
+		r.text = make_request(pools[r.partition].host, uri, body);
+		r.write = is_write(uri);
+		r.attempts = 0;
+		r.status = UNREACHABLE;
+	}
+}
+
+// An edge is owned by the partition of its lower node, as on the server
+void GraphClient::edgeRequests(const char *uri, const std::vector<Edge> &edges,
+                               std::vector<Request> &requests) {
+	const PartitionMap *map = partitioner.current();
+	requests.resize(edges.size());
+	for (size_t i = 0; i < edges.size(); i++) {
+		char body[96];
+		snprintf(body, sizeof(body), "{\"node_a_id\": %lu, \"node_b_id\": %lu}",
+			edges[i].first, edges[i].second);
+		Request &r = requests[i];
+		r.partition = map->owner(map->lowerNode(edges[i].first, edges[i].second));
+		r.text = make_request(pools[r.partition].host, uri, body);
+		r.write = is_write(uri);
+		r.attempts = 0;
+		r.status = UNREACHABLE;
+	}
+}
+
+bool GraphClient::connect(Pool &pool, Connection &c) {
+	std::string host = pool.host;
+	std::string port = "80";
+	size_t colon = host.rfind(':');
+	if (colon != std::string::npos) {
+		port = host.substr(colon + 1);
+		host.erase(colon);
+	}
+
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) {
+		fprintf(stderr, "GraphClient: can't resolve %s \n", pool.host.c_str());
+		return false;
+	}
+
+	// Connects without blocking; a refused connection shows up in poll
+	int fd = socket(res->ai_family, SOCK_STREAM, 0);
+	if (fd >= 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if (::connect(fd, res->ai_addr, res->ai_addrlen) != 0 && errno != EINPROGRESS) {
+			::close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+
+	c.fd = fd;
+	c.answered = 0;
+	return fd >= 0;
+}
+
+void GraphClient::close(Connection &c) {
+	if (c.fd >= 0)
+		::close(c.fd);
+	c.fd = -1;
+	c.out.clear();
+	c.sent = 0;
+	c.in.clear();
+	c.answered = 0;
+}
+
+// Holds off pool's next connection for CLIENT_BACKOFF_MS, doubled for
+// each earlier failure in a row. Connections that fail together, while
+// the pool is already backing off, count as one failure.
+void GraphClient::backOff(Pool &pool) {
+	uint64_t now = monotonic_ms();
+	if (now < pool.retry_ms)
+		return;
+
+	pool.retry_ms = now + ((uint64_t) CLIENT_BACKOFF_MS << pool.failures);
+	pool.failures++;
+}
+
+// How long run may poll before a backing-off partition can connect again
+int GraphClient::pollTimeout(uint64_t now) const {
+	uint64_t timeout = CLIENT_POLL_MS;
+	for (size_t p = 0; p < pools.size(); p++) {
+		if (pools[p].queued.empty() || pools[p].retry_ms <= now)
+			continue;
+		if (pools[p].retry_ms - now < timeout)
+			timeout = pools[p].retry_ms - now;
+	}
+	return (int) timeout;
+}
+
+// Closes c and puts its unanswered requests back at the front of the
+// queue, backing off if any were lost. A write goes back only if none of
+// it had been written: c.out still holds all of the last requests' bytes
+// that weren't. Returns how many gave up instead.
+size_t GraphClient::drop(Pool &pool, Connection &c, std::vector<Request> &requests) {
+	if (pool.persistent == PERSIST_UNKNOWN && c.answered > 0)
+		pool.persistent = PERSIST_NO;
+	if (!c.in_flight.empty())
+		backOff(pool);
+	size_t unsent = c.out.size() - c.sent;
+	close(c);
+
+	size_t failed = 0;
+	while (!c.in_flight.empty()) {
+		size_t i = c.in_flight.back();
+		c.in_flight.pop_back();
+
+		bool written = unsent < requests[i].text.size();
+		unsent = written ? 0 : unsent - requests[i].text.size();
+
+		if ((written && requests[i].write) || ++requests[i].attempts >= CLIENT_ATTEMPTS) {
+			requests[i].status = UNREACHABLE;
+			failed++;
+		} else {
+			pool.queued.push_front(i);
+		}
+	}
+	return failed;
+}
+
+// Hands queued requests to connections with room for them. Until a
+// partition's connections have shown they stay open, each carries one
+// request at a time. A partition backing off gets no new connection.
+// Returns how many requests gave up.
+size_t GraphClient::fill(std::vector<Request> &requests) {
+	size_t failed = 0;
+	uint64_t now = monotonic_ms();
+
+	for (size_t p = 0; p < pools.size(); p++) {
+		Pool &pool = pools[p];
+		size_t limit = pool.persistent == PERSIST_YES ? depth : 1;
+
+		for (size_t i = 0; i < pool.connections.size() && !pool.queued.empty(); i++) {
+			Connection &c = pool.connections[i];
+			if (c.in_flight.size() >= limit)
+				continue;
+			if (c.fd < 0 && pool.failures >= CLIENT_ATTEMPTS) {
+				// Unreachable: what hasn't been sent gives up
+				for (size_t k = 0; k < pool.queued.size(); k++)
+					requests[pool.queued[k]].status = UNREACHABLE;
+				failed += pool.queued.size();
+				pool.queued.clear();
+				break;
+			}
+			if (c.fd < 0 && now < pool.retry_ms)
+				continue;
+
+			if (c.fd < 0 && !connect(pool, c)) {
+				backOff(pool);
+				continue;
+			}
+
+			if (c.in_flight.empty())
+				c.active_ms = now;
+			while (c.in_flight.size() < limit && !pool.queued.empty()) {
+				size_t r = pool.queued.front();
+				pool.queued.pop_front();
+				c.out += requests[r].text;
+				c.in_flight.push_back(r);
+			}
+		}
+	}
+	return failed;
+}
+
+// Reads what has arrived on c and matches complete replies to its
+// requests in order. Returns how many requests finished.
+size_t GraphClient::receive(Pool &pool, Connection &c, std::vector<Request> &requests) {
+	char buf[65536];
+	ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+
+	bool eof = n <= 0;
+	if (!eof) {
+		c.in.append(buf, n);
+		c.active_ms = monotonic_ms();
+	}
+
+	size_t done = 0;
+	bool close_after = false;
+	while (!c.in_flight.empty() && !close_after) {
+		Request &r = requests[c.in_flight.front()];
+		if (!parse_reply(c.in, eof, &r.status, &r.body, &close_after))
+			break;
+		c.in_flight.pop_front();
+		done++;
+		pool.failures = 0;
+
+		if (++c.answered >= 2 && pool.persistent == PERSIST_UNKNOWN)
+			pool.persistent = PERSIST_YES;
+	}
+
+	if (eof || close_after)
+		done += drop(pool, c, requests);
+	return done;
+}
+
+void GraphClient::run(std::vector<Request> &requests) {
+	for (size_t i = 0; i < requests.size(); i++)
+		pools[requests[i].partition].queued.push_back(i);
+
+	// Each call gives every partition its attempts afresh
+	for (size_t p = 0; p < pools.size(); p++) {
+		pools[p].failures = 0;
+		pools[p].retry_ms = 0;
+	}
+
+	size_t left = requests.size();
+	std::vector<struct pollfd> fds;
+	std::vector<std::pair<size_t, size_t> > polled;
+
+	while (left > 0) {
+		left -= fill(requests);
+
+		fds.clear();
+		polled.clear();
+		for (size_t p = 0; p < pools.size(); p++) {
+			for (size_t i = 0; i < pools[p].connections.size(); i++) {
+				Connection &c = pools[p].connections[i];
+				if (c.fd < 0 || c.in_flight.empty())
+					continue;
+				struct pollfd pfd;
+				pfd.fd = c.fd;
+				pfd.events = POLLIN;
+				if (c.sent < c.out.size())
+					pfd.events |= POLLOUT;
+				pfd.revents = 0;
+				fds.push_back(pfd);
+				polled.push_back(std::make_pair(p, i));
+			}
+		}
+		// With nothing to poll, every partition left is backing off
+		int timeout = pollTimeout(monotonic_ms());
+		if (fds.empty()) {
+			poll(NULL, 0, timeout);
+			continue;
+		}
+
+		if (poll(&fds[0], fds.size(), timeout) < 0 && errno != EINTR) {
+			perror("GraphClient: poll");
+			for (size_t p = 0; p < pools.size(); p++) {
+				pools[p].queued.clear();
+				for (size_t i = 0; i < pools[p].connections.size(); i++) {
+					pools[p].connections[i].in_flight.clear();
+					close(pools[p].connections[i]);
+				}
+			}
+			return;
+		}
+
+		uint64_t now = monotonic_ms();
+		for (size_t k = 0; k < fds.size(); k++) {
+			Pool &pool = pools[polled[k].first];
+			Connection &c = pool.connections[polled[k].second];
+
+			if (fds[k].revents & POLLOUT) {
+				ssize_t n = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+				if (n > 0) {
+					c.sent += n;
+					c.active_ms = now;
+					if (c.sent == c.out.size()) {
+						c.out.clear();
+						c.sent = 0;
+					}
+				} else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+					left -= drop(pool, c, requests);
+					continue;
+				}
+			}
+
+			if (fds[k].revents & (POLLIN | POLLHUP | POLLERR))
+				left -= receive(pool, c, requests);
+			else if (now - c.active_ms > CLIENT_TIMEOUT_MS)
+				left -= drop(pool, c, requests);
+		}
+	}
+}
+
+std::vector<int> GraphClient::addNodes(const std::vector<uint64_t> &node_ids) {
+	std::vector<Request> requests;
+	nodeRequests("/api/v1/add_node", node_ids, requests);
+	run(requests);
+	std::vector<int> statuses(requests.size());
+	for (size_t i = 0; i < requests.size(); i++)
+		statuses[i] = requests[i].status;
+	return statuses;
+}
+
+std::vector<int> GraphClient::removeNodes(const std::vector<uint64_t> &node_ids) {
+	std::vector<Request> requests;
+	nodeRequests("/api/v1/remove_node", node_ids, requests);
+	run(requests);
+	std::vector<int> statuses(requests.size());
+	for (size_t i = 0; i < requests.size(); i++)
+		statuses[i] = requests[i].status;
+	return statuses;
+}
+
+std::vector<int> GraphClient::addEdges(const std::vector<Edge> &edges) {
+	std::vector<Request> requests;
+	edgeRequests("/api/v1/add_edge", edges, requests);
+	run(requests);
+	std::vector<int> statuses(requests.size());
+	for (size_t i = 0; i < requests.size(); i++)
+		statuses[i] = requests[i].status;
+	return statuses;
+}
+
+std::vector<int> GraphClient::removeEdges(const std::vector<Edge> &edges) {
+	std::vector<Request> requests;
+	edgeRequests("/api/v1/remove_edge", edges, requests);
+	run(requests);
+	std::vector<int> statuses(requests.size());
+	for (size_t i = 0; i < requests.size(); i++)
+		statuses[i] = requests[i].status;
+	return statuses;
+}
+
+std::vector<GraphClient::Lookup> GraphClient::getNodes(const std::vector<uint64_t> &node_ids) {
+	std::vector<Request> requests;
+	nodeRequests("/api/v1/get_node", node_ids, requests);
+	run(requests);
+	std::vector<Lookup> lookups(requests.size());
+	for (size_t i = 0; i < requests.size(); i++)
+		lookups[i] = Lookup(requests[i].status, requests[i].status == SUCCESS && in_graph(requests[i].body));
+	return lookups;
+}
+
+std::vector<GraphClient::Lookup> GraphClient::getEdges(const std::vector<Edge> &edges) {
+	std::vector<Request> requests;
+	edgeRequests("/api/v1/get_edge", edges, requests);
+	run(requests);
+	std::vector<Lookup> lookups(requests.size());
+	for (size_t i = 0; i < requests.size(); i++)
+		lookups[i] = Lookup(requests[i].status, requests[i].status == SUCCESS && in_graph(requests[i].body));
+	return lookups;
+}
+
+std::vector<GraphClient::Neighbors> GraphClient::getNeighbors(const std::vector<uint64_t> &node_ids) {
+	std::vector<Request> requests;
+	nodeRequests("/api/v1/get_neighbors", node_ids, requests);
+	run(requests);
+	std::vector<Neighbors> neighbors(requests.size());
+	for (size_t i = 0; i < requests.size(); i++) {
+		neighbors[i].first = requests[i].status;
+		if (requests[i].status == SUCCESS)
+			neighbors[i].second = neighbor_ids(requests[i].body);
+	}
+	return neighbors;
+}
+
+int GraphClient::addNode(uint64_t node_id) {
+	return addNodes(std::vector<uint64_t>(1, node_id))[0];
+}
+
+int GraphClient::removeNode(uint64_t node_id) {
+	return removeNodes(std::vector<uint64_t>(1, node_id))[0];
+}
+
+int GraphClient::addEdge(uint64_t node_a_id, uint64_t node_b_id) {
+	return addEdges(std::vector<Edge>(1, Edge(node_a_id, node_b_id)))[0];
+}
+
+int GraphClient::removeEdge(uint64_t node_a_id, uint64_t node_b_id) {
+	return removeEdges(std::vector<Edge>(1, Edge(node_a_id, node_b_id)))[0];
+}
+
+GraphClient::Lookup GraphClient::getNode(uint64_t node_id) {
+	return getNodes(std::vector<uint64_t>(1, node_id))[0];
+}
+
+GraphClient::Lookup GraphClient::getEdge(uint64_t node_a_id, uint64_t node_b_id) {
+	return getEdges(std::vector<Edge>(1, Edge(node_a_id, node_b_id)))[0];
+}
+
+GraphClient::Neighbors GraphClient::getNeighbors(uint64_t node_id) {
+	return getNeighbors(std::vector<uint64_t>(1, node_id))[0];
+}
@@ -0,0 +1,132 @@
+#ifndef GRAPH_CLIENT_H
+#define GRAPH_CLIENT_H
+
+#include <poll.h>
+#include <time.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "Partitioner.h"
+
+// Status returned for a request that never got an answer from its server
+#define UNREACHABLE 0
+
+// Client for the /api/v1 HTTP API of a partitioned graph. Requests go
+// straight to the head of the partition that owns them (for an edge, the
+// partition of its lower node), so they aren't relayed by the server.
+//
+// Each partition gets a small pool of connections that are kept open
+// between calls. Once a connection has shown it stays open after a reply,
+// up to a pipeline depth of requests are written to it back to back and
+// the replies read in order; a server that closes after every reply gets
+// one request per connection instead. The batch calls spread their
+// requests over every partition's pool at once and return when all have
+// been answered, statuses in the order the requests were given.
+//
+// A read still unanswered when its connection drops is sent again on a
+// new one, up to CLIENT_ATTEMPTS times. A write is only sent again if none
+// of it had been written to the connection: one whose reply was lost may
+// have been applied, so it comes back UNREACHABLE instead. After a failed
+// connection, or one dropped with requests on it, a partition gets no new
+// one until a backoff, doubling with each failure in a row, has passed;
+// after CLIENT_ATTEMPTS failures in a row its requests give up.
+//
+// Not thread-safe; give each thread its own client.
+class GraphClient {
+public:
+	typedef std::pair<uint64_t, uint64_t> Edge;
+	typedef std::pair<int, bool> Lookup;
+	typedef std::pair<int, std::vector<uint64_t> > Neighbors;
+
+	// http_hosts[p] is the "host:port" of partition p's head HTTP server.
+	// config, if given, is the servers' partition config and decides which
+	// partition owns a node; without it nodes are assigned modulo the
+	// number of hosts.
+	GraphClient(const std::vector<std::string> &http_hosts, const char *config = NULL);
+	~GraphClient();
+
+	// False if config was given but couldn't be read or lists a different
+	// number of partitions than http_hosts
+	bool ok() const { return valid; }
+
+	void setConnections(unsigned per_partition);
+	void setPipelineDepth(unsigned depth);
+
+	int addNode(uint64_t node_id);
+	int removeNode(uint64_t node_id);
+	int addEdge(uint64_t node_a_id, uint64_t node_b_id);
+	int removeEdge(uint64_t node_a_id, uint64_t node_b_id);
+	Lookup getNode(uint64_t node_id);
+	Lookup getEdge(uint64_t node_a_id, uint64_t node_b_id);
+	Neighbors getNeighbors(uint64_t node_id);
+
+	std::vector<int> addNodes(const std::vector<uint64_t> &node_ids);
+	std::vector<int> removeNodes(const std::vector<uint64_t> &node_ids);
+	std::vector<int> addEdges(const std::vector<Edge> &edges);
+	std::vector<int> removeEdges(const std::vector<Edge> &edges);
+	std::vector<Lookup> getNodes(const std::vector<uint64_t> &node_ids);
+	std::vector<Lookup> getEdges(const std::vector<Edge> &edges);
+	std::vector<Neighbors> getNeighbors(const std::vector<uint64_t> &node_ids);
+
+private:
+	struct Request {
+		unsigned partition;
+		std::string text;
+		bool write;
+		unsigned attempts;
+		int status;
+		std::string body;
+	};
+
+	struct Connection {
+		int fd;
+		std::string out;
+		size_t sent;
+		std::string in;
+		std::deque<size_t> in_flight;
+		unsigned answered;
+		uint64_t active_ms;
+	};
+
+	// Whether a partition's server keeps connections open after a reply
+	enum Persistence {
+		PERSIST_UNKNOWN,
+		PERSIST_YES,
+		PERSIST_NO
+	};
+
+	struct Pool {
+		std::string host;
+		std::vector<Connection> connections;
+		std::deque<size_t> queued;
+		Persistence persistent;
+
+		// Failed connections in a row, and when the next may be made
+		unsigned failures;
+		uint64_t retry_ms;
+	};
+
+	std::vector<Pool> pools;
+	Partitioner partitioner;
+	unsigned per_partition;
+	unsigned depth;
+	bool valid;
+
+	void nodeRequests(const char *uri, const std::vector<uint64_t> &node_ids,
+	                  std::vector<Request> &requests);
+	void edgeRequests(const char *uri, const std::vector<Edge> &edges,
+	                  std::vector<Request> &requests);
+	void run(std::vector<Request> &requests);
+	size_t fill(std::vector<Request> &requests);
+	size_t receive(Pool &pool, Connection &c, std::vector<Request> &requests);
+	size_t drop(Pool &pool, Connection &c, std::vector<Request> &requests);
+	bool connect(Pool &pool, Connection &c);
+	void close(Connection &c);
+	void backOff(Pool &pool);
+	int pollTimeout(uint64_t now) const;
+};
+
+#endif
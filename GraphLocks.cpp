@@ -0,0 +1,17 @@
+#include "GraphLocks.h"
+
+GraphLocks::GraphLocks() {
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	// glibc prefers readers by default, which lets a steady stream of
+	// lookups starve replication writes
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&graph, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+GraphLocks::~GraphLocks() {
+	pthread_rwlock_destroy(&graph);
+}
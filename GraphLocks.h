@@ -0,0 +1,27 @@
+#ifndef GRAPH_LOCKS_H
+#define GRAPH_LOCKS_H
+
+#include <pthread.h>
+
+// Concurrency control for a Graph shared by the HTTP and RPC threads.
+//
+// The graph is guarded by a single reader-writer lock: lookups and
+// searches hold it shared, and a write holds it exclusive from its checks
+// through the mutation, so reads scale across threads while writes are
+// serialized. Graph keeps no per-node state a writer could update under a
+// shared lock, so finer write locking would only add overhead. The lock is
+// never held across RPCs; see EdgeIntents.
+class GraphLocks {
+public:
+	GraphLocks();
+	~GraphLocks();
+
+	void readLock() { pthread_rwlock_rdlock(&graph); }
+	void writeLock() { pthread_rwlock_wrlock(&graph); }
+	void unlock() { pthread_rwlock_unlock(&graph); }
+
+private:
+	pthread_rwlock_t graph;
+};
+
+#endif
@@ -0,0 +1,407 @@
+#include <algorithm>
+
+#include "Graph.h"
+#include "Bfs.h"
+#include "ThreadPool.h"
+
+// Below this many nodes SEARCH_AUTO skips the bidirectional bookkeeping
+#define BIDIRECTIONAL_MIN_NODES 1024
+
+// Frontier nodes per SEARCH_PARALLEL task
+#define PARALLEL_GRAIN 256
+
+#define UNREACHABLE UINT32_MAX
+
+// Scratch state reused by every search on the calling thread. The forward
+// pair is also what single-ended searches use.
+struct SearchScratch {
+	VisitMap visits;
+	RingQueue queue;
+	VisitMap back_visits;
+	RingQueue back_queue;
+	std::vector<uint32_t> frontier;
+	std::vector<uint32_t> next;
+	Bitmap in_frontier;
+	SearchStats stats;
+};
+
+static thread_local SearchScratch scratch;
+
+// One worker's share of a parallel level, padded so neighboring workers'
+// counters do not share a cache line
+struct ParallelWorker {
+	std::vector<uint32_t> next;
+	uint64_t edges_checked;
+	uint64_t visited;
+	char pad[64];
+};
+
+// Shared by all SEARCH_PARALLEL queries on a graph; lock serializes them
+struct ParallelSearch {
+	pthread_mutex_t lock;
+	AtomicVisitMap visits;
+	std::vector<uint32_t> frontier;
+	std::vector<ParallelWorker> workers;
+};
+
+const SearchStats &Graph::lastSearchStats() {
+	return scratch.stats;
+}
+
+void Graph::setSearchTuning(const SearchTuning &t) {
+	tuning = t;
+	if (tuning.alpha == 0)
+		tuning.alpha = 1;
+	if (tuning.beta == 0)
+		tuning.beta = 1;
+}
+
+uint32_t Graph::forwardSearch(uint32_t a, uint32_t b) const {
+	SearchStats &stats = scratch.stats;
+	VisitMap &visits = scratch.visits;
+	RingQueue &queue = scratch.queue;
+	visits.reset(ids.size());
+	queue.clear();
+
+	visits.visit(a, 0);
+	queue.push(a);
+
+	while (!queue.empty()) {
+		uint32_t current_node = queue.pop();
+		uint32_t distance = visits.distance(current_node) + 1;
+		if (distance > stats.levels.size())
+			stats.levels.push_back('T');
+
+		for (NeighborIterator it = neighbors(current_node); !it.done(); it.next()) {
+			uint32_t v = *it;
+			stats.edges_checked++;
+			if (v == b)
+				return distance;
+			if (!visits.visited(v)) {
+				visits.visit(v, distance);
+				queue.push(v);
+				stats.visited++;
+			}
+		}
+	}
+
+	return UNREACHABLE;
+}
+
+// Grows one BFS tree from each endpoint, always expanding a full level of
+// whichever frontier is smaller. The first level in which the trees touch
+// holds the shortest path, so the search stops once that level is done.
+uint32_t Graph::bidirectionalSearch(uint32_t a, uint32_t b) const {
+	SearchStats &stats = scratch.stats;
+	VisitMap *visits[2] = { &scratch.visits, &scratch.back_visits };
+	RingQueue *queues[2] = { &scratch.queue, &scratch.back_queue };
+	uint32_t roots[2] = { a, b };
+
+	for (int side = 0; side < 2; side++) {
+		visits[side]->reset(ids.size());
+		queues[side]->clear();
+		visits[side]->visit(roots[side], 0);
+		queues[side]->push(roots[side]);
+	}
+
+	uint32_t best = UNREACHABLE;
+	while (!queues[0]->empty() && !queues[1]->empty()) {
+		int side = queues[0]->size() <= queues[1]->size() ? 0 : 1;
+		VisitMap &mine = *visits[side];
+		VisitMap &other = *visits[1 - side];
+		RingQueue &queue = *queues[side];
+		stats.levels.push_back('T');
+
+		for (size_t n = queue.size(); n > 0; n--) {
+			uint32_t current_node = queue.pop();
+			uint32_t distance = mine.distance(current_node) + 1;
+
+			for (NeighborIterator it = neighbors(current_node); !it.done(); it.next()) {
+				uint32_t v = *it;
+				stats.edges_checked++;
+				if (other.visited(v) && distance + other.distance(v) < best)
+					best = distance + other.distance(v);
+				if (!mine.visited(v)) {
+					mine.visit(v, distance);
+					queue.push(v);
+					stats.visited++;
+				}
+			}
+		}
+
+		if (best != UNREACHABLE)
+			return best;
+	}
+
+	return UNREACHABLE;
+}
+
+// Beamer-style BFS. Top-down levels expand each frontier node's edges;
+// bottom-up levels have every unvisited node look for a parent in the
+// frontier bitmap and stop at the first hit, which wins once the frontier
+// covers a large share of the graph.
+uint32_t Graph::directionOptimizingSearch(uint32_t a, uint32_t b) const {
+	SearchStats &stats = scratch.stats;
+	VisitMap &visits = scratch.visits;
+	std::vector<uint32_t> &frontier = scratch.frontier;
+	std::vector<uint32_t> &next = scratch.next;
+	Bitmap &in_frontier = scratch.in_frontier;
+	uint32_t num_ids = ids.size();
+
+	visits.reset(num_ids);
+	frontier.clear();
+	visits.visit(a, 0);
+	frontier.push_back(a);
+
+	uint64_t frontier_edges = degree(a);
+	uint64_t unexplored_edges = num_edges - frontier_edges;
+	bool bottom_up = false;
+
+	for (uint32_t level = 1; !frontier.empty(); level++) {
+		if (!bottom_up && frontier_edges > unexplored_edges / tuning.alpha)
+			bottom_up = true;
+		else if (bottom_up && frontier.size() < num_ids / tuning.beta)
+			bottom_up = false;
+
+		next.clear();
+		uint64_t next_edges = 0;
+
+		if (bottom_up) {
+			stats.levels.push_back('B');
+			in_frontier.reset(num_ids);
+			for (size_t i = 0; i < frontier.size(); i++)
+				in_frontier.set(frontier[i]);
+
+			for (uint32_t u = 0; u < num_ids; u++) {
+				if (visits.visited(u))
+					continue;
+				for (NeighborIterator it = neighbors(u); !it.done(); it.next()) {
+					stats.edges_checked++;
+					if (in_frontier.test(*it)) {
+						if (u == b)
+							return level;
+						visits.visit(u, level);
+						next.push_back(u);
+						next_edges += degree(u);
+						stats.visited++;
+						break;
+					}
+				}
+			}
+		} else {
+			stats.levels.push_back('T');
+			for (size_t i = 0; i < frontier.size(); i++) {
+				for (NeighborIterator it = neighbors(frontier[i]); !it.done(); it.next()) {
+					uint32_t v = *it;
+					stats.edges_checked++;
+					if (v == b)
+						return level;
+					if (!visits.visited(v)) {
+						visits.visit(v, level);
+						next.push_back(v);
+						next_edges += degree(v);
+						stats.visited++;
+					}
+				}
+			}
+		}
+
+		unexplored_edges = next_edges < unexplored_edges ? unexplored_edges - next_edges : 0;
+		frontier.swap(next);
+		frontier_edges = next_edges;
+	}
+
+	return UNREACHABLE;
+}
+
+void Graph::setSearchThreads(unsigned num_threads) {
+	if (parallel != NULL) {
+		pthread_mutex_destroy(&parallel->lock);
+		delete parallel;
+		parallel = NULL;
+	}
+	delete pool;
+	pool = NULL;
+
+	if (num_threads <= 1)
+		return;
+
+	pool = new ThreadPool(num_threads);
+	parallel = new ParallelSearch();
+	pthread_mutex_init(&parallel->lock, NULL);
+	parallel->workers.resize(num_threads);
+}
+
+// Level-synchronous BFS with each frontier split across the thread pool.
+// Workers claim nodes with a compare-and-swap on the shared visit map and
+// collect their discoveries in private next-frontier buffers.
+uint32_t Graph::parallelSearch(uint32_t a, uint32_t b) const {
+	if (pool == NULL)
+		return forwardSearch(a, b);
+
+	SearchStats &stats = scratch.stats;
+	ParallelSearch &ps = *parallel;
+	std::atomic<bool> found(false);
+	uint32_t distance = UNREACHABLE;
+
+	pthread_mutex_lock(&ps.lock);
+	ps.visits.reset(ids.size());
+	ps.frontier.clear();
+	ps.visits.claim(a);
+	ps.frontier.push_back(a);
+
+	for (uint32_t level = 1; !ps.frontier.empty(); level++) {
+		stats.levels.push_back('P');
+		for (size_t w = 0; w < ps.workers.size(); w++) {
+			ps.workers[w].next.clear();
+			ps.workers[w].edges_checked = 0;
+			ps.workers[w].visited = 0;
+		}
+
+		pool->parallelFor(ps.frontier.size(), PARALLEL_GRAIN,
+			[&](unsigned w, size_t lo, size_t hi) {
+				ParallelWorker &out = ps.workers[w];
+				if (found.load(std::memory_order_relaxed))
+					return;
+				for (size_t i = lo; i < hi; i++) {
+					for (NeighborIterator it = neighbors(ps.frontier[i]); !it.done(); it.next()) {
+						uint32_t v = *it;
+						out.edges_checked++;
+						if (v == b) {
+							found.store(true, std::memory_order_relaxed);
+							return;
+						}
+						if (ps.visits.claim(v)) {
+							out.next.push_back(v);
+							out.visited++;
+						}
+					}
+				}
+			});
+
+		ps.frontier.clear();
+		for (size_t w = 0; w < ps.workers.size(); w++) {
+			ParallelWorker &out = ps.workers[w];
+			stats.edges_checked += out.edges_checked;
+			stats.visited += out.visited;
+			ps.frontier.insert(ps.frontier.end(), out.next.begin(), out.next.end());
+		}
+
+		if (found.load()) {
+			distance = level;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&ps.lock);
+	return distance;
+}
+
+static bool closer(const Seed &x, const Seed &y) {
+	return x.second < y.second;
+}
+
+// One partition's share of a cross-partition search: a multi-source BFS
+// that starts from seeds (owned nodes with their distance from the source)
+// and never steps past a node it does not own. Such nodes are appended to
+// boundary for their owners to continue from. known holds the best
+// distance per node across supersteps, so only improvements are expanded
+// or reported. Returns the best distance to target seen, or UINT64_MAX.
+uint64_t Graph::expandFrontier(std::vector<Seed> seeds, uint64_t target, uint64_t bound,
+                               const std::function<bool(uint64_t)> &owned,
+                               std::unordered_map<uint64_t, uint64_t> &known,
+                               std::vector<Seed> &boundary) const {
+	uint64_t reached = UINT64_MAX;
+	if (bound == 0)
+		bound = UINT64_MAX;
+
+	// Seeds are merged into the FIFO in distance order, which keeps pops
+	// nondecreasing just like a single-source BFS
+	std::sort(seeds.begin(), seeds.end(), closer);
+	std::vector<std::pair<uint32_t, uint64_t> > queue;
+	size_t head = 0;
+	size_t next_seed = 0;
+
+	for (;;) {
+		uint32_t u;
+		uint64_t distance;
+
+		if (head < queue.size() &&
+			(next_seed == seeds.size() || queue[head].second <= seeds[next_seed].second)) {
+			u = queue[head].first;
+			distance = queue[head].second;
+			head++;
+			if (known[ids[u]] != distance)
+				continue;
+		} else if (next_seed < seeds.size()) {
+			const Seed &seed = seeds[next_seed++];
+			u = index.find(seed.first);
+			distance = seed.second;
+			if (u == NodeIndex::NONE || !owned(seed.first))
+				continue;
+			std::unordered_map<uint64_t, uint64_t>::iterator k = known.find(seed.first);
+			if (k != known.end() && k->second <= distance)
+				continue;
+			known[seed.first] = distance;
+		} else {
+			break;
+		}
+
+		uint64_t limit = reached < bound ? reached : bound;
+		if (distance + 1 >= limit)
+			continue;
+
+		for (NeighborIterator it = neighbors(u); !it.done(); it.next()) {
+			uint64_t v = ids[*it];
+			if (v == target) {
+				if (distance + 1 < reached)
+					reached = distance + 1;
+				continue;
+			}
+
+			std::unordered_map<uint64_t, uint64_t>::iterator k = known.find(v);
+			if (k != known.end() && k->second <= distance + 1)
+				continue;
+			known[v] = distance + 1;
+
+			if (owned(v))
+				queue.push_back(std::make_pair(*it, distance + 1));
+			else
+				boundary.push_back(std::make_pair(v, distance + 1));
+		}
+	}
+
+	return reached;
+}
+
+std::pair<int, uint64_t> Graph::shortestPath(uint64_t node_a_id, uint64_t node_b_id, SearchMode mode) {
+
+	uint64_t size = index.size();
+	uint32_t a = index.find(node_a_id);
+	uint32_t b = index.find(node_b_id);
+
+	SearchStats &stats = scratch.stats;
+	stats.visited = 0;
+	stats.edges_checked = 0;
+	stats.levels.clear();
+
+	if (node_a_id == node_b_id || a == NodeIndex::NONE || b == NodeIndex::NONE)
+		return std::make_pair(EXISTS, (uint64_t) 0);
+
+	if (mode == SEARCH_AUTO)
+		mode = size < BIDIRECTIONAL_MIN_NODES ? SEARCH_FORWARD : SEARCH_BIDIRECTIONAL;
+
+	uint32_t distance;
+	if (mode == SEARCH_BIDIRECTIONAL)
+		distance = bidirectionalSearch(a, b);
+	else if (mode == SEARCH_DIRECTION_OPTIMIZING)
+		distance = directionOptimizingSearch(a, b);
+	else if (mode == SEARCH_PARALLEL)
+		distance = parallelSearch(a, b);
+	else
+		distance = forwardSearch(a, b);
+
+	if (distance == UNREACHABLE)
+		return std::make_pair(ERROR, size + 1);
+	return std::make_pair(SUCCESS, (uint64_t) distance);
+}
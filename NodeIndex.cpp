@@ -0,0 +1,91 @@
+#include "NodeIndex.h"
+
+#define INITIAL_SLOTS 16
+
+const uint32_t NodeIndex::NONE;
+
+NodeIndex::NodeIndex() : mask(INITIAL_SLOTS - 1), count(0) {
+	Slot empty = { 0, NONE };
+	slots.assign(INITIAL_SLOTS, empty);
+}
+
+// splitmix64 finalizer, spreads sequential IDs across the table
+uint64_t NodeIndex::hash(uint64_t key) {
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key;
+}
+
+uint32_t NodeIndex::find(uint64_t key) const {
+	for (uint64_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+		if (slots[i].value == NONE)
+			return NONE;
+		if (slots[i].key == key)
+			return slots[i].value;
+	}
+}
+
+bool NodeIndex::insert(uint64_t key, uint32_t value) {
+	// Keep load factor at or below 1/2
+	if ((count + 1) * 2 > slots.size())
+		grow();
+
+	uint64_t i = hash(key) & mask;
+	while (slots[i].value != NONE) {
+		if (slots[i].key == key)
+			return false;
+		i = (i + 1) & mask;
+	}
+	slots[i].key = key;
+	slots[i].value = value;
+	count++;
+	return true;
+}
+
+bool NodeIndex::erase(uint64_t key) {
+	uint64_t i = hash(key) & mask;
+	for (;;) {
+		if (slots[i].value == NONE)
+			return false;
+		if (slots[i].key == key)
+			break;
+		i = (i + 1) & mask;
+	}
+
+	// Backward shift: pull later entries of the probe run into the hole
+	uint64_t j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (slots[j].value == NONE)
+			break;
+		uint64_t home = hash(slots[j].key) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+	slots[i].value = NONE;
+	count--;
+	return true;
+}
+
+void NodeIndex::grow() {
+	std::vector<Slot> old;
+	old.swap(slots);
+
+	Slot empty = { 0, NONE };
+	slots.assign(old.size() * 2, empty);
+	mask = slots.size() - 1;
+
+	for (uint64_t k = 0; k < old.size(); k++) {
+		if (old[k].value == NONE)
+			continue;
+		uint64_t i = hash(old[k].key) & mask;
+		while (slots[i].value != NONE)
+			i = (i + 1) & mask;
+		slots[i] = old[k];
+	}
+}
@@ -0,0 +1,34 @@
+#ifndef NODE_INDEX_H
+#define NODE_INDEX_H
+
+#include <vector>
+#include <cstdint>
+
+// Open-addressing hash table mapping external node IDs to dense internal IDs.
+// Linear probing over a power-of-two table; erase uses backward shift so no
+// tombstones accumulate.
+class NodeIndex {
+public:
+	static const uint32_t NONE = UINT32_MAX;
+
+	NodeIndex();
+	uint32_t find(uint64_t key) const;
+	bool insert(uint64_t key, uint32_t value);
+	bool erase(uint64_t key);
+	uint64_t size() const { return count; }
+
+private:
+	struct Slot {
+		uint64_t key;
+		uint32_t value;
+	};
+
+	std::vector<Slot> slots;
+	uint64_t mask;
+	uint64_t count;
+
+	static uint64_t hash(uint64_t key);
+	void grow();
+};
+
+#endif
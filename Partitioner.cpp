@@ -0,0 +1,126 @@
+#include "Partitioner.h"
+#include "Graph.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#define DEFAULT_VNODES 256
+
+// splitmix64 finalizer; spreads sequential IDs over the whole ring
+static uint64_t mix(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+void PartitionMap::buildRing(unsigned vnodes) {
+	ring.clear();
+	for (uint32_t p = 0; p < hosts.size(); p++) {
+		for (uint32_t v = 0; v < vnodes; v++) {
+			Point point;
+			point.hash = mix(((uint64_t) (p + 1) << 32) ^ mix(v));
+			point.partition = p;
+			ring.push_back(point);
+		}
+	}
+	std::sort(ring.begin(), ring.end());
+}
+
+unsigned PartitionMap::ringOwner(uint64_t node_id) const {
+	Point key;
+	key.hash = mix(node_id);
+	std::vector<Point>::const_iterator it = std::lower_bound(ring.begin(), ring.end(), key);
+	if (it == ring.end())
+		it = ring.begin();
+	return it->partition;
+}
+
+Partitioner::Partitioner() : map(new PartitionMap()) {
+}
+
+PartitionMap *Partitioner::read(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Partitioner: can't open %s \n", path);
+		return NULL;
+	}
+
+	std::vector<std::vector<std::string> > listed;
+	long count = -1;
+	long vnodes = DEFAULT_VNODES;
+	PartitionScheme scheme = SCHEME_MODULO;
+	char line[512];
+	int line_no = 0;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line_no++;
+		char *comment = strchr(line, '#');
+		if (comment != NULL)
+			*comment = '\0';
+
+		char key[32], value[480];
+		int fields = sscanf(line, "%31s %479s", key, value);
+		if (fields <= 0)
+			continue;
+
+		if (fields == 2 && strcmp(key, "partitions") == 0) {
+			count = strtol(value, NULL, 10);
+		} else if (fields == 2 && strcmp(key, "host") == 0) {
+			std::vector<std::string> chain;
+			char *save = NULL;
+			strtok_r(line, " \t\r\n", &save);
+			for (char *addr = strtok_r(NULL, " \t\r\n", &save); addr != NULL;
+			     addr = strtok_r(NULL, " \t\r\n", &save))
+				chain.push_back(addr);
+			listed.push_back(chain);
+		} else if (fields == 2 && strcmp(key, "scheme") == 0 && strcmp(value, "modulo") == 0) {
+			scheme = SCHEME_MODULO;
+		} else if (fields == 2 && strcmp(key, "scheme") == 0 && strcmp(value, "ring") == 0) {
+			scheme = SCHEME_RING;
+		} else if (fields == 2 && strcmp(key, "vnodes") == 0 && strtol(value, NULL, 10) > 0) {
+			vnodes = strtol(value, NULL, 10);
+		} else {
+			fprintf(stderr, "Partitioner: %s:%d: bad line \n", path, line_no);
+			fclose(f);
+			return NULL;
+		}
+	}
+	fclose(f);
+
+	if (listed.empty() || (count != -1 && count != (long) listed.size())) {
+		fprintf(stderr, "Partitioner: %s lists %lu hosts for %ld partitions \n",
+			path, listed.size(), count);
+		return NULL;
+	}
+
+	PartitionMap *m = new PartitionMap();
+	m->chains.swap(listed);
+	for (size_t p = 0; p < m->chains.size(); p++)
+		m->hosts.push_back(m->chains[p][0]);
+	m->scheme = scheme;
+	if (scheme == SCHEME_RING)
+		m->buildRing(vnodes);
+	return m;
+}
+
+int Partitioner::load(const char *path) {
+	PartitionMap *m = read(path);
+	if (m == NULL)
+		return ERROR;
+	publish(m);
+	return SUCCESS;
+}
+
+void Partitioner::setHosts(const std::vector<std::string> &h) {
+	PartitionMap *m = new PartitionMap();
+	m->hosts = h;
+	for (size_t p = 0; p < h.size(); p++)
+		m->chains.push_back(std::vector<std::string>(1, h[p]));
+	publish(m);
+}
@@ -0,0 +1,113 @@
+#ifndef PARTITIONER_H
+#define PARTITIONER_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+// How node IDs are spread over the partitions
+enum PartitionScheme {
+	SCHEME_MODULO,
+	SCHEME_RING
+};
+
+// One assignment of node IDs to partitions and partitions to RPC
+// addresses. Partitions are numbered from 0 here; the -p flag and `part`
+// count from 1.
+//
+// Under SCHEME_RING every partition places vnodes points on a 64-bit hash
+// ring and a node belongs to the partition with the first point at or
+// after the node's hash. A partition's points depend only on its position
+// in the host list, so appending one host to N moves about 1/(N+1) of the
+// nodes, all of them to the new partition. SCHEME_MODULO reshuffles
+// nearly every node whenever the count changes.
+class PartitionMap {
+public:
+	PartitionMap() : scheme(SCHEME_MODULO) {}
+
+	unsigned size() const { return hosts.size(); }
+	const char *host(unsigned p) const { return hosts[p].c_str(); }
+
+	// Each partition is a chain of replicas. Replica 0 is the head,
+	// which takes writes and is what host returns; the last is the tail.
+	unsigned replicas(unsigned p) const { return chains[p].size(); }
+	const char *replica(unsigned p, unsigned r) const { return chains[p][r].c_str(); }
+
+	unsigned owner(uint64_t node_id) const {
+		if (scheme == SCHEME_MODULO)
+			return node_id % hosts.size();
+		return ringOwner(node_id);
+	}
+
+	// An edge between two partitions is written through the lower one,
+	// which replicates it to the higher one
+	uint64_t lowerNode(uint64_t node_a_id, uint64_t node_b_id) const {
+		return owner(node_a_id) <= owner(node_b_id) ? node_a_id : node_b_id;
+	}
+	uint64_t higherNode(uint64_t node_a_id, uint64_t node_b_id) const {
+		return owner(node_a_id) <= owner(node_b_id) ? node_b_id : node_a_id;
+	}
+
+private:
+	friend class Partitioner;
+
+	struct Point {
+		uint64_t hash;
+		uint32_t partition;
+		bool operator<(const Point &o) const { return hash < o.hash; }
+	};
+
+	std::vector<std::string> hosts;
+	std::vector<std::vector<std::string> > chains;
+	PartitionScheme scheme;
+	std::vector<Point> ring;
+
+	void buildRing(unsigned vnodes);
+	unsigned ringOwner(uint64_t node_id) const;
+};
+
+// The partition map in effect. The config file has one directive per
+// line, '#' starts a comment:
+//
+//   partitions 8
+//   scheme ring
+//   vnodes 256
+//   host 10.0.0.1:50051 10.0.0.5:50051
+//   host 10.0.0.2:50051 10.0.0.6:50051
+//   ...
+//
+// Hosts are listed in partition order. A host line may list several
+// addresses: the partition's chain of replicas, head first, each of which
+// is started with its own -n. Read replicas aren't listed; one is started
+// with -f and the number of the replica it follows. The partitions line
+// is optional and, if present, must match the number of hosts. scheme is
+// modulo (the default) or ring; vnodes only applies to ring.
+//
+// A running server can switch to a new map with publish. Maps are never
+// freed, so a caller holding one from current() can keep using it. A
+// decision that looks up more than one node, such as routing an edge,
+// should take one map from current() and ask it everything, so a publish
+// in between can't split the answer across two maps.
+class Partitioner {
+public:
+	Partitioner();
+
+	// Parses a config file into a new map; NULL if it is malformed
+	static PartitionMap *read(const char *path);
+
+	int load(const char *path);
+	void setHosts(const std::vector<std::string> &hosts);
+	void publish(const PartitionMap *m) { map.store(m); }
+
+	const PartitionMap *current() const { return map.load(); }
+
+	unsigned size() const { return current()->size(); }
+	const char *host(unsigned p) const { return current()->host(p); }
+	unsigned owner(uint64_t node_id) const { return current()->owner(node_id); }
+
+private:
+	std::atomic<const PartitionMap *> map;
+};
+
+#endif
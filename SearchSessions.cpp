@@ -0,0 +1,46 @@
+#include "SearchSessions.h"
+#include "headers.h"
+
+#define SESSION_TIMEOUT 60
+
+SearchSessions::SearchSessions() {
+	pthread_mutex_init(&lock, NULL);
+}
+
+SearchSessions::~SearchSessions() {
+	pthread_mutex_destroy(&lock);
+}
+
+static bool owned_here(uint64_t node_id) {
+	return partitioner.owner(node_id) == (unsigned) (part - 1);
+}
+
+uint64_t SearchSessions::expand(Graph *graph, uint64_t search_id, uint64_t target, uint64_t bound,
+                                const std::vector<Seed> &seeds, std::vector<Seed> &boundary) {
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&lock);
+	expire(now);
+	Session &session = sessions[search_id];
+	session.touched = now;
+	pthread_mutex_unlock(&lock);
+
+	// A session is only ever driven by one coordinator, one superstep at a time
+	return graph->expandFrontier(seeds, target, bound, owned_here, session.known, boundary);
+}
+
+void SearchSessions::end(uint64_t search_id) {
+	pthread_mutex_lock(&lock);
+	sessions.erase(search_id);
+	pthread_mutex_unlock(&lock);
+}
+
+void SearchSessions::expire(time_t now) {
+	std::map<uint64_t, Session>::iterator it = sessions.begin();
+	while (it != sessions.end()) {
+		if (now - it->second.touched > SESSION_TIMEOUT)
+			sessions.erase(it++);
+		else
+			++it;
+	}
+}
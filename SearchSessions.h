@@ -0,0 +1,40 @@
+#ifndef SEARCH_SESSIONS_H
+#define SEARCH_SESSIONS_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+#include "Graph.h"
+
+// Per-search state this partition keeps between the supersteps of
+// cross-partition shortest path searches. Sessions left behind by a
+// coordinator that went away are dropped after SESSION_TIMEOUT seconds.
+class SearchSessions {
+public:
+	SearchSessions();
+	~SearchSessions();
+
+	// Runs one superstep of search_id over this partition's nodes.
+	// Caller holds the graph lock, shared is enough.
+	uint64_t expand(Graph *graph, uint64_t search_id, uint64_t target, uint64_t bound,
+	                const std::vector<Seed> &seeds, std::vector<Seed> &boundary);
+	void end(uint64_t search_id);
+
+private:
+	struct Session {
+		std::unordered_map<uint64_t, uint64_t> known;
+		time_t touched;
+	};
+
+	pthread_mutex_t lock;
+	std::map<uint64_t, Session> sessions;
+
+	void expire(time_t now);
+};
+
+#endif
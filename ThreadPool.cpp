@@ -0,0 +1,154 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned num_threads)
+	: generation(0), remaining(0), active(0), stopping(false) {
+	if (num_threads == 0)
+		num_threads = 1;
+
+	pthread_mutex_init(&job_lock, NULL);
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&wake, NULL);
+	pthread_cond_init(&done, NULL);
+
+	for (unsigned i = 0; i < num_threads; i++) {
+		Worker *w = new Worker();
+		w->pool = this;
+		w->id = i;
+		pthread_mutex_init(&w->lock, NULL);
+		workers.push_back(w);
+	}
+
+	// Worker 0 is whichever thread calls parallelFor
+	for (unsigned i = 1; i < num_threads; i++) {
+		pthread_create(&workers[i]->thread, NULL, run, workers[i]);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	for (unsigned i = 1; i < workers.size(); i++) {
+		pthread_join(workers[i]->thread, NULL);
+	}
+	for (unsigned i = 0; i < workers.size(); i++) {
+		pthread_mutex_destroy(&workers[i]->lock);
+		delete workers[i];
+	}
+
+	pthread_cond_destroy(&done);
+	pthread_cond_destroy(&wake);
+	pthread_mutex_destroy(&lock);
+	pthread_mutex_destroy(&job_lock);
+}
+
+void *ThreadPool::run(void *v) {
+	Worker *self = (Worker *) v;
+	ThreadPool *pool = self->pool;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stopping && pool->generation == seen)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->stopping)
+			break;
+		seen = pool->generation;
+		pool->active++;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool->work(self->id);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->active == 0)
+			pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// Own deque from the back first, then steal from the front of the others
+bool ThreadPool::take(unsigned id, Range &r) {
+	Worker *self = workers[id];
+	pthread_mutex_lock(&self->lock);
+	if (!self->ranges.empty()) {
+		r = self->ranges.back();
+		self->ranges.pop_back();
+		pthread_mutex_unlock(&self->lock);
+		return true;
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	for (unsigned k = 1; k < workers.size(); k++) {
+		Worker *victim = workers[(id + k) % workers.size()];
+		pthread_mutex_lock(&victim->lock);
+		if (!victim->ranges.empty()) {
+			r = victim->ranges.front();
+			victim->ranges.pop_front();
+			pthread_mutex_unlock(&victim->lock);
+			return true;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return false;
+}
+
+void ThreadPool::work(unsigned id) {
+	Range r;
+	while (take(id, r)) {
+		task(id, r.lo, r.hi);
+
+		pthread_mutex_lock(&lock);
+		if (--remaining == 0)
+			pthread_cond_broadcast(&done);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void ThreadPool::parallelFor(size_t n, size_t grain, const Task &t) {
+	if (grain == 0)
+		grain = 1;
+	size_t chunks = (n + grain - 1) / grain;
+	if (chunks == 0)
+		return;
+	if (chunks == 1 || workers.size() == 1) {
+		t(0, 0, n);
+		return;
+	}
+
+	pthread_mutex_lock(&job_lock);
+	pthread_mutex_lock(&lock);
+
+	// Stragglers from the previous job may still be scanning empty deques
+	while (active > 0)
+		pthread_cond_wait(&done, &lock);
+
+	task = t;
+	unsigned num_workers = workers.size();
+	for (unsigned w = 0; w < num_workers; w++) {
+		size_t first = chunks * w / num_workers;
+		size_t last = chunks * (w + 1) / num_workers;
+		pthread_mutex_lock(&workers[w]->lock);
+		for (size_t c = first; c < last; c++) {
+			Range r;
+			r.lo = c * grain;
+			r.hi = r.lo + grain < n ? r.lo + grain : n;
+			workers[w]->ranges.push_back(r);
+		}
+		pthread_mutex_unlock(&workers[w]->lock);
+	}
+	remaining = chunks;
+	generation++;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	work(0);
+
+	pthread_mutex_lock(&lock);
+	while (remaining > 0)
+		pthread_cond_wait(&done, &lock);
+	pthread_mutex_unlock(&lock);
+	pthread_mutex_unlock(&job_lock);
+}
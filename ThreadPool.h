@@ -0,0 +1,58 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <cstddef>
+
+// Fixed set of workers for data-parallel loops. parallelFor splits a range
+// into chunks and deals contiguous runs of them to per-worker deques; a
+// worker drains its own deque from the back and, once empty, steals from
+// the front of the others. The calling thread takes part as worker 0.
+class ThreadPool {
+public:
+	typedef std::function<void(unsigned worker, size_t lo, size_t hi)> Task;
+
+	explicit ThreadPool(unsigned num_threads);
+	~ThreadPool();
+
+	unsigned size() const { return workers.size(); }
+
+	// Runs task over [0, n) in chunks of at most grain items and returns
+	// once every chunk is done. Calls from different threads are serialized.
+	void parallelFor(size_t n, size_t grain, const Task &task);
+
+private:
+	struct Range {
+		size_t lo;
+		size_t hi;
+	};
+
+	struct Worker {
+		ThreadPool *pool;
+		unsigned id;
+		pthread_t thread;
+		pthread_mutex_t lock;
+		std::deque<Range> ranges;
+	};
+
+	std::vector<Worker *> workers;
+	pthread_mutex_t job_lock;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	Task task;
+	unsigned long generation;
+	size_t remaining;
+	unsigned active;
+	bool stopping;
+
+	static void *run(void *v);
+	bool take(unsigned id, Range &r);
+	void work(unsigned id);
+};
+
+#endif
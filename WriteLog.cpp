@@ -0,0 +1,89 @@
+#include "WriteLog.h"
+#include "Graph.h"
+
+#include <time.h>
+
+WriteLog::WriteLog() : last(0) {
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&appended, NULL);
+}
+
+WriteLog::~WriteLog() {
+	pthread_cond_destroy(&appended);
+	pthread_mutex_destroy(&lock);
+}
+
+// Caller holds lock
+void WriteLog::push(const Entry &e) {
+	if (e.lsn != last + 1)
+		entries.clear();
+	entries.push_back(e);
+	if (entries.size() > WRITE_LOG_ENTRIES)
+		entries.pop_front();
+	last = e.lsn;
+	pthread_cond_broadcast(&appended);
+}
+
+uint64_t WriteLog::append(int op, uint64_t node_a_id, uint64_t node_b_id) {
+	pthread_mutex_lock(&lock);
+	Entry e = { last + 1, op, node_a_id, node_b_id };
+	push(e);
+	pthread_mutex_unlock(&lock);
+	return e.lsn;
+}
+
+void WriteLog::record(uint64_t lsn, int op, uint64_t node_a_id, uint64_t node_b_id) {
+	pthread_mutex_lock(&lock);
+	Entry e = { lsn, op, node_a_id, node_b_id };
+	push(e);
+	pthread_mutex_unlock(&lock);
+}
+
+void WriteLog::reset(uint64_t lsn) {
+	pthread_mutex_lock(&lock);
+	entries.clear();
+	last = lsn;
+	pthread_mutex_unlock(&lock);
+}
+
+uint64_t WriteLog::lsn() {
+	pthread_mutex_lock(&lock);
+	uint64_t lsn = last;
+	pthread_mutex_unlock(&lock);
+	return lsn;
+}
+
+int WriteLog::read(uint64_t after, std::vector<Entry> &out, size_t max, int timeout_ms) {
+	out.clear();
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&lock);
+	while (last == after) {
+		if (pthread_cond_timedwait(&appended, &lock, &deadline) != 0)
+			break;
+	}
+
+	int status = SUCCESS;
+	if (last > after) {
+		// Entries are contiguous, so the one after `after` is found by offset
+		if (entries.empty() || entries.front().lsn > after + 1) {
+			status = ERROR;
+		} else {
+			size_t first = after + 1 - entries.front().lsn;
+			for (size_t i = first; i < entries.size() && out.size() < max; i++)
+				out.push_back(entries[i]);
+		}
+	} else if (last < after) {
+		status = ERROR;
+	}
+	pthread_mutex_unlock(&lock);
+	return status;
+}
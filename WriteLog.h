@@ -0,0 +1,58 @@
+#ifndef WRITE_LOG_H
+#define WRITE_LOG_H
+
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+#include <cstdint>
+
+#define WRITE_LOG_ENTRIES 65536
+
+// The most recent graph writes applied on this replica, numbered by log
+// sequence number (LSN). The head of a partition's chain hands out LSNs in
+// the order it applies writes; every other replica, and every read replica
+// following one, records each write under the head's LSN. lsn() is then a
+// version of the partition's graph that clients can compare across
+// replicas. Only the last WRITE_LOG_ENTRIES writes are kept, for read
+// replicas to catch up from.
+class WriteLog {
+public:
+	struct Entry {
+		uint64_t lsn;
+		int op;
+		uint64_t node_a_id;
+		uint64_t node_b_id;
+	};
+
+	WriteLog();
+	~WriteLog();
+
+	// Both are called with the graph lock held exclusively, so LSN order
+	// is the order writes were applied. append numbers the write itself;
+	// record takes the LSN it was given upstream, and drops everything
+	// older if that skips ahead.
+	uint64_t append(int op, uint64_t node_a_id, uint64_t node_b_id);
+	void record(uint64_t lsn, int op, uint64_t node_a_id, uint64_t node_b_id);
+
+	// Empties the log and carries on numbering from lsn, for a replica
+	// that has just loaded a snapshot taken at lsn
+	void reset(uint64_t lsn);
+
+	uint64_t lsn();
+
+	// Fills out with up to max entries following after, waiting up to
+	// timeout_ms for one if there are none yet. Returns ERROR if entries
+	// after `after` have already been dropped.
+	int read(uint64_t after, std::vector<Entry> &out, size_t max, int timeout_ms);
+
+private:
+	pthread_mutex_t lock;
+	pthread_cond_t appended;
+	std::deque<Entry> entries;
+	uint64_t last;
+
+	void push(const Entry &e);
+};
+
+#endif
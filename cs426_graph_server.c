@@ -1,23 +1,381 @@
 #include "mongoose.h"
 #include "headers.h"
+#include <semaphore.h>
+#include <algorithm>
+#include <map>
+#include <set>
 
 int head;
 int tail;
 char *ip_next;
+char *ip_upstream;
 
 int part;
-char *rpc_port;
-char **ip_list;
-char *ip1;
-char *ip2;
-char *ip3;
+// Position in the partition's chain, from 1 at the head
+static int replica = 1;
+const char *rpc_port;
+int rpc_threads = 4;
+Partitioner partitioner;
 
-pthread_mutex_t mutex;
+GraphLocks graph_locks;
+EdgeIntents edge_intents;
+WriteLog write_log;
 
+SearchSessions search_sessions;
+
+struct PendingWrite;
+
+// One per HTTP event loop, as its mg_mgr's user_data
 typedef struct {
   Graph *graph;
+
+  // Deferred writes whose replies are ready, sent by this event loop.
+  // Only the write that finds the queue empty signals ready_cond, so a
+  // burst of completions costs one mg_broadcast rather than one each.
+  pthread_mutex_t ready_lock;
+  pthread_cond_t ready_cond;
+  std::vector<struct PendingWrite *> ready_writes;
 } Data;
 
+// Every reply but a 204 carries a Content-Length, so the connection can
+// stay open for the client's next request; a 204 may not have one (RFC
+// 7230 3.3.2) and never has a body. Statuses other than 200 have no body.
+static void send_status(struct mg_connection *nc, int status) {
+  const char *reason;
+  switch (status) {
+  case EXISTS: reason = "OK"; break;
+  case ERROR: reason = "Bad Request"; break;
+  case RPC_FAILED: reason = "RPC Failed"; break;
+  case STALE: reason = "Service Unavailable"; break;
+  default: status = 404; reason = "Not Found"; break;
+  }
+  if (status == EXISTS)
+    mg_printf(nc, "HTTP/1.1 %d %s\r\n"
+                  "\r\n", status, reason);
+  else
+    mg_printf(nc, "HTTP/1.1 %d %s\r\n"
+                  "Content-Length: 0\r\n"
+                  "\r\n", status, reason);
+}
+
+// A 400 for a request that couldn't be parsed, saying why
+static void send_bad_request(struct mg_connection *nc, const char *why) {
+  mg_printf(nc, "HTTP/1.1 400 Bad Request\r\n"
+                "Content-Length: %d\r\n"
+                "Content-Type: text/plain\r\n"
+                "\r\n%s\n", (int) strlen(why) + 1, why);
+}
+
+// Writes v in decimal to out, which has room for 20 digits, and returns
+// how many it wrote. Digits go two at a time, back to front.
+static int format_id(char *out, uint64_t v) {
+  static const char pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char tmp[20];
+  char *p = tmp + sizeof(tmp);
+
+  while (v >= 100) {
+    const char *d = pairs + (v % 100) * 2;
+    v /= 100;
+    *--p = d[1];
+    *--p = d[0];
+  }
+  if (v >= 10) {
+    *--p = pairs[v * 2 + 1];
+    *--p = pairs[v * 2];
+  } else {
+    *--p = '0' + v;
+  }
+
+  int len = tmp + sizeof(tmp) - p;
+  memcpy(out, p, len);
+  return len;
+}
+
+// A cursor is the ID of the last neighbor on a page, in hex. Clients
+// only ever hand it back, so what it holds can change.
+#define CURSOR_LEN 16
+
+// Which of a node's neighbors a get_neighbors reply lists: at most limit
+// of them, starting past the neighbor with ID after if has_after. The
+// next page starts past the last ID on this one, so pages neither repeat
+// nor skip neighbors when others are added or removed in between.
+typedef struct {
+  uint64_t limit;
+  bool has_after;
+  uint64_t after;
+} NeighborPage;
+
+// Reads limit and cursor from req; false if either is malformed
+static bool read_page(const ApiRequest &req, NeighborPage *page) {
+  page->limit = req.has(FIELD_LIMIT) ? req.limit : UINT64_MAX;
+  page->has_after = req.has(FIELD_CURSOR);
+  page->after = 0;
+
+  if (page->limit == 0)
+    return false;
+  if (!page->has_after)
+    return true;
+  if (req.cursor.len != CURSOR_LEN)
+    return false;
+  for (int i = 0; i < CURSOR_LEN; i++) {
+    char c = req.cursor.ptr[i];
+    int d;
+    if (c >= '0' && c <= '9')
+      d = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      d = c - 'a' + 10;
+    else
+      return false;
+    page->after = page->after << 4 | d;
+  }
+  return true;
+}
+
+// Writes the cursor for a page ending at last to out, with its NUL
+static void format_cursor(char *out, uint64_t last) {
+  snprintf(out, CURSOR_LEN + 1, "%016lx", last);
+}
+
+// Moves a node's iterator to the first neighbor of page
+static void seek_page(Graph::NeighborIterator *it, const NeighborPage &page) {
+  if (page.has_after)
+    it->seekPast(page.after);
+}
+
+// Appends the IDs it walks to out, separated by commas, stopping after
+// limit of them. Returns true, with the last ID appended in *last, if
+// it stopped with neighbors left.
+static bool append_ids(std::string *out, Graph::NeighborIterator it, uint64_t limit, uint64_t *last) {
+  char id[20];
+  for (uint64_t n = 0; !it.done(); it.next(), n++) {
+    if (n == limit)
+      return true;
+    if (n > 0)
+      out->push_back(',');
+    *last = it.id();
+    out->append(id, format_id(id, *last));
+  }
+  return false;
+}
+
+// Largest piece a streamed reply is sent in
+#define STREAM_CHUNK_SIZE 8192
+
+// A 200 reply written out as it is produced, through a fixed buffer, so
+// it takes no more memory here however long it gets. A reply that fits
+// in one buffer goes out with a Content-Length as usual. A longer one is
+// sent in chunks, or to a client older than HTTP/1.1 unframed with the
+// connection closed after it.
+typedef struct {
+  struct mg_connection *nc;
+  bool chunked;
+  bool started;
+  uint64_t lsn;
+  int len;
+  char buf[STREAM_CHUNK_SIZE];
+} ReplyStream;
+
+static void stream_begin(ReplyStream *s, struct mg_connection *nc, struct http_message *hm, uint64_t lsn) {
+  s->nc = nc;
+  s->chunked = mg_vcmp(&hm->proto, "HTTP/1.1") == 0;
+  s->started = false;
+  s->lsn = lsn;
+  s->len = 0;
+}
+
+static void stream_flush(ReplyStream *s) {
+  if (!s->started) {
+    mg_printf(s->nc, "HTTP/1.1 200 OK\r\n"
+                     "%s\r\n"
+                     "Content-Type: application/json\r\n"
+                     "X-LSN: %lu\r\n"
+                     "\r\n", s->chunked ? "Transfer-Encoding: chunked" : "Connection: close", s->lsn);
+    if (!s->chunked)
+      s->nc->flags |= MG_F_SEND_AND_CLOSE;
+    s->started = true;
+  }
+  if (s->chunked)
+    mg_send_http_chunk(s->nc, s->buf, s->len);
+  else
+    mg_send(s->nc, s->buf, s->len);
+  s->len = 0;
+}
+
+static void stream_write(ReplyStream *s, const char *p, int len) {
+  while (len > 0) {
+    if (s->len == STREAM_CHUNK_SIZE)
+      stream_flush(s);
+    int n = std::min(len, STREAM_CHUNK_SIZE - s->len);
+    memcpy(s->buf + s->len, p, n);
+    s->len += n;
+    p += n;
+    len -= n;
+  }
+}
+
+static void stream_id(ReplyStream *s, uint64_t id) {
+  if (s->len > STREAM_CHUNK_SIZE - 20)
+    stream_flush(s);
+  s->len += format_id(s->buf + s->len, id);
+}
+
+static void stream_end(ReplyStream *s) {
+  if (!s->started) {
+    mg_printf(s->nc, "HTTP/1.1 200 OK\r\n"
+                     "Content-Length: %d\r\n"
+                     "Content-Type: application/json\r\n"
+                     "X-LSN: %lu\r\n"
+                     "\r\n%.*s", s->len, s->lsn, s->len, s->buf);
+    return;
+  }
+  if (s->len > 0)
+    stream_flush(s);
+  if (s->chunked)
+    mg_send_http_chunk(s->nc, "", 0);
+}
+
+// How often the compaction thread checks the graph's delta buffers
+#define COMPACT_INTERVAL_US 100000
+
+// Folds the graph's write deltas into a fresh CSR base. Only the snapshot
+// and the final swap hold the graph lock; the rebuild runs without it.
+static void *compact_graph(void *v) {
+  Graph *graph = (Graph *) v;
+
+  for (;;) {
+    usleep(COMPACT_INTERVAL_US);
+
+    graph_locks.writeLock();
+    if (!graph->needsCompaction()) {
+      graph_locks.unlock();
+      continue;
+    }
+    graph->beginCompaction();
+    graph_locks.unlock();
+
+    graph->buildCompaction();
+
+    graph_locks.writeLock();
+    graph->finishCompaction();
+    graph_locks.unlock();
+  }
+
+  return NULL;
+}
+
+// Config file given with -c, reread on SIGHUP
+static const char *config_path;
+static sem_t reload_requested;
+
+static void request_reload(int sig) {
+  sem_post(&reload_requested);
+}
+
+// Switches to the partition map in the config file each time the server
+// gets SIGHUP, logging the peer connection counts first. The head first hands off the nodes this partition no
+// longer owns and only then switches, so it serves them until their new
+// owners have them. To add a partition, start it with the new file, then
+// update the file for every running partition and signal them. A
+// migration that fails leaves the old map in place and is retried on the
+// next SIGHUP.
+static void *reload_partitions(void *v) {
+  Graph *graph = (Graph *) v;
+  const PartitionMap *settled = partitioner.current();
+
+  for (;;) {
+    if (sem_wait(&reload_requested) != 0)
+      continue;
+
+    PartitionMap *next = Partitioner::read(config_path);
+    if (next == NULL)
+      continue;
+
+    // This replica's RPC port is already bound, and the chain it forwards
+    // to is fixed at startup
+    const char *self = settled->replica(part-1, replica-1);
+    if (part > (int) next->size() || replica > (int) next->replicas(part-1) ||
+        strcmp(next->replica(part-1, replica-1), self) != 0) {
+      fprintf(stderr, "Reload: partition %d replica %d must keep address %s\n", part, replica, self);
+      delete next;
+      continue;
+    }
+
+    fprintf(stderr, "Reload: %u partitions\n", next->size());
+    log_peers();
+
+    // The rest of the chain drops migrated nodes as the head's writes
+    // come down it
+    if (!head) {
+      partitioner.publish(next);
+      settled = next;
+    } else if (migrate_nodes(graph, next) == SUCCESS) {
+      settled = next;
+    } else {
+      delete next;
+    }
+  }
+
+  return NULL;
+}
+
+
+static void send_replicated_status(struct mg_connection *nc, int status, const char *json, int json_len);
+static bool relay_request(struct mg_connection *nc, struct http_message *hm, unsigned owner,
+                          int op, uint64_t node_a_id, uint64_t node_b_id);
+
+// Adds or removes a node owned by this partition. A removal must hold the
+// node's reservation in edge_intents, so no edge to it is in flight to
+// another partition. Refused while the node is migrating.
+static int write_node(Graph *graph, int op, uint64_t node_id) {
+  int status;
+
+  graph_locks.writeLock();
+  if (migration_blocks(graph, op, node_id, 0))
+    status = ERROR;
+  else
+    status = op == ADD_NODE ? graph->addNode(node_id) : graph->removeNode(node_id);
+  if (status == SUCCESS)
+    chain_append(op, node_id, 0);
+  graph_locks.unlock();
+  return status;
+}
+
+// Adds or removes an edge with both nodes in this partition, unless
+// either is migrating
+static int write_local_edge(Graph *graph, int op, uint64_t node_a_id, uint64_t node_b_id) {
+  int status;
+
+  graph_locks.writeLock();
+  if (migration_blocks(graph, op, node_a_id, node_b_id))
+    status = ERROR;
+  else if (op == ADD_EDGE)
+    status = graph->addEdge(node_a_id, node_b_id);
+  else
+    status = graph->removeEdge(node_a_id, node_b_id);
+  if (status == SUCCESS)
+    chain_append(op, node_a_id, node_b_id);
+  graph_locks.unlock();
+  return status;
+}
+
+// Checks a cross-partition edge write whose intent is held on the lower
+// partition: until the intent is released, no other write to the edge can
+// interleave and the lower node can't be removed. Returns ERROR, and
+// releases the intent, if the lower node doesn't exist.
+static int check_edge_write(Graph *graph, uint64_t min_node_id, uint64_t max_node_id) {
+  graph_locks.readLock();
+  bool in_graph = std::get<1>(graph->getNode(min_node_id));
+  graph_locks.unlock();
+
+  if (!in_graph) {
+    edge_intents.release(min_node_id, max_node_id);
+    return ERROR;
+  }
+  return SUCCESS;
+}
 
 static void add_node(struct mg_connection *nc, struct http_message *hm, void *user_data) {
   Data *data = (Data *) user_data;
@@ -26,41 +384,448 @@ static void add_node(struct mg_connection *nc, struct http_message *hm, void *us
   const char *json = hm->body.p;
   int json_len = (int) hm->body.len;
 
-  struct json_token *arr, *tok;
+  ApiRequest req;
   int status;
 
-  arr = parse_json2(json, json_len);
-  if (arr == NULL) {
-    mg_printf(nc, "Error in JSON\n");
-    free(arr);
+  if (!req.parse(json, json_len)) {
+    send_bad_request(nc, "Error in JSON");
     return;
   }
 
-  tok = find_json_token(arr, "node_id");
-  if (tok == NULL) {
-    mg_printf(nc, "Could not find node_id in JSON\n");
-    free(arr);
+  if (!req.has(FIELD_NODE_ID)) {
+    send_bad_request(nc, "Could not find node_id in JSON");
     return;
   }
 
-  status = graph->addNode(strtoull(tok->ptr, NULL, 10)); 
+  uint64_t node_id = req.node_id;
+
+  if (relay_request(nc, hm, partitioner.owner(node_id), ADD_NODE, node_id, node_id))
+    return;
+
+  status = write_node(graph, ADD_NODE, node_id);
 
   //DEBUG
-  fprintf(stderr, "add_node: %.*s = %d\n", tok->len, tok->ptr, status); 
+  fprintf(stderr, "add_node: %lu = %d\n", req.node_id, status); 
+
+  send_replicated_status(nc, status, json, json_len);
+}
 
+// Status line, plus the JSON body on success, for writes and relayed
+// reads. A write's body is the request echoed back. For a write, X-LSN is
+// at least the write's LSN on this partition, so passing it back as
+// min_lsn reads the write from any replica.
+static void send_reply(struct mg_connection *nc, int status, const char *json, int json_len, uint64_t lsn) {
   if (status == SUCCESS) {
     mg_printf(nc, "HTTP/1.1 %d OK\r\n"
                   "Content-Length: %d\r\n"
                   "Content-Type: application/json\r\n"
-                  "\r\n%.*s", status, json_len, json_len, json); 
-  } else if (status == EXISTS) {
-    mg_printf(nc, "HTTP/1.1 204 OK\r\n");
-    
+                  "X-LSN: %lu\r\n"
+                  "\r\n%.*s", status, json_len, lsn, json_len, json);  
+  } else {
+    send_status(nc, status);
+  }
+}
+
+// Largest request body a deferred write echoes back, and largest relayed
+// read reply kept in a WriteReply itself
+#define REPLY_JSON_SIZE 4096
+
+// A write whose reply waits on a replication RPC or on the chain, or a
+// request relayed to another server. The connection is matched by
+// pointer and serial, since it may have closed and its memory been reused
+// by the time the reply is sent.
+typedef struct {
+  struct mg_connection *nc;
+  unsigned long serial;
+  int status;
+  uint64_t lsn;
+  int json_len;
+  char json[REPLY_JSON_SIZE];
+
+  // Holds a relayed reply too big for json instead, or is NULL
+  char *long_json;
+} WriteReply;
+
+// The op of a request relay_request relays that isn't a write
+#define RELAYED_READ -1
+
+// For a request relay_request relayed, op is its write, or RELAYED_READ,
+// and min_node_id and max_node_id its nodes as the client gave them.
+typedef struct PendingWrite {
+  Graph *graph;
+  int op;
+  uint64_t min_node_id;
+  uint64_t max_node_id;
+  struct mg_mgr *mgr;
+  WriteReply reply;
+
+  // The partition a request was relayed to
+  unsigned owner;
+
+  // Set for a write another server relayed here, whose reply goes back
+  // to it rather than to an event loop
+  RelayCallback relayed;
+  void *relayed_arg;
+} PendingWrite;
+
+// Set on a connection whose client asked to close it once its deferred
+// reply is sent
+#define MG_F_CLOSE_AFTER_REPLY MG_F_USER_1
+
+// Marks nc as waiting on the deferred reply with serial. Requests the
+// client pipelined behind it are held back until it is sent, so replies
+// go out in request order.
+static void defer_reply(struct mg_connection *nc, unsigned long serial) {
+  nc->user_data = (void *) serial;
+  nc->flags |= MG_F_HTTP_HOLD;
+}
+
+static void release_reply(struct mg_connection *nc) {
+  nc->user_data = NULL;
+  nc->flags &= ~MG_F_HTTP_HOLD;
+}
+
+static std::atomic<unsigned long> next_serial(0);
+
+// Defers nc's reply to a new PendingWrite, which echoes json back unless
+// it is too big to hand to the event loop
+static PendingWrite *defer_write(struct mg_connection *nc, const char *json, int json_len) {
+  if (json_len > REPLY_JSON_SIZE)
+    json_len = 0;
+
+  PendingWrite *w = (PendingWrite *) malloc(sizeof(PendingWrite));
+  w->mgr = nc->mgr;
+  w->relayed = NULL;
+  w->reply.nc = nc;
+  w->reply.serial = ++next_serial;
+  w->reply.status = RPC_FAILED;
+  w->reply.lsn = 0;
+  w->reply.json_len = json_len;
+  w->reply.long_json = NULL;
+  memcpy(w->reply.json, json, json_len);
+  defer_reply(nc, w->reply.serial);
+  return w;
+}
+
+// A PendingWrite for a write another server relayed here, which replies
+// to done instead of an event loop
+static PendingWrite *relayed_write(Graph *graph, int op, uint64_t min_node_id, uint64_t max_node_id,
+                                   RelayCallback done, void *arg) {
+  PendingWrite *w = (PendingWrite *) malloc(sizeof(PendingWrite));
+  w->graph = graph;
+  w->op = op;
+  w->min_node_id = min_node_id;
+  w->max_node_id = max_node_id;
+  w->mgr = NULL;
+  w->relayed = done;
+  w->relayed_arg = arg;
+  w->reply.nc = NULL;
+  w->reply.status = RPC_FAILED;
+  w->reply.lsn = 0;
+  w->reply.json_len = 0;
+  w->reply.long_json = NULL;
+  return w;
+}
+
+// Applies an edge write the higher partition has accepted. Caller holds
+// graph_locks for writing.
+static int apply_edge_write(Graph *graph, int op, uint64_t min_node_id, uint64_t max_node_id) {
+  int status;
+  if (op == ADD_EDGE) {
+    if (graph->addNode(max_node_id) == SUCCESS)
+      chain_append(ADD_NODE, max_node_id, 0);
+    status = graph->addEdge(min_node_id, max_node_id); 
+    if (status == SUCCESS)
+      chain_append(ADD_EDGE, min_node_id, max_node_id);
   } else {
-    mg_printf(nc, "HTTP/1.1 400 Bad Request\r\n");
+    status = graph->removeEdge(min_node_id, max_node_id); 
+    if (status == SUCCESS)
+      chain_append(REMOVE_EDGE, min_node_id, max_node_id);
+  }
+  return status;
+}
+
+// Applies a replicated edge write locally and releases its intent
+static int commit_edge_write(PendingWrite *w, int status) {
+  const char *name = w->op == ADD_EDGE ? "add_edge" : "remove_edge";
+
+  if (status == RPC_FAILED) {
+    fprintf(stderr, "%s: RPC failed \n", name);
+  } else if (status == SUCCESS || w->op == REMOVE_EDGE) {
+    graph_locks.writeLock();
+    status = apply_edge_write(w->graph, w->op, w->min_node_id, w->max_node_id);
+    graph_locks.unlock();
+  }
+  edge_intents.release(w->min_node_id, w->max_node_id);
+
+  //DEBUG
+  fprintf(stderr, "%s: %lu, %lu = %d\n", name, w->min_node_id, w->max_node_id, status);
+  return status;
+}
+
+// Runs on the event loop via mg_broadcast, once per open connection. The
+// first call sends every queued reply.
+static void reply_pending_writes(struct mg_connection *nc, int ev, void *ev_data) {
+  Data *data = (Data *) nc->mgr->user_data;
+  std::vector<PendingWrite *> ready;
+  pthread_mutex_lock(&data->ready_lock);
+  ready.swap(data->ready_writes);
+  pthread_mutex_unlock(&data->ready_lock);
+  if (ready.empty())
+    return;
+
+  std::unordered_map<unsigned long, PendingWrite *> by_serial;
+  for (size_t i = 0; i < ready.size(); i++)
+    by_serial[ready[i]->reply.serial] = ready[i];
+
+  for (struct mg_connection *c = mg_next(nc->mgr, NULL); c != NULL; c = mg_next(nc->mgr, c)) {
+    std::unordered_map<unsigned long, PendingWrite *>::iterator it =
+        by_serial.find((unsigned long) c->user_data);
+    if (it == by_serial.end() || it->second->reply.nc != c)
+      continue;
+
+    WriteReply *reply = &it->second->reply;
+    send_reply(c, reply->status, reply->long_json != NULL ? reply->long_json : reply->json,
+               reply->json_len, reply->lsn);
+    release_reply(c);
+    if (c->flags & MG_F_CLOSE_AFTER_REPLY) {
+      c->flags |= MG_F_SEND_AND_CLOSE;
+    } else if (c->recv_mbuf.len > 0) {
+      // Dispatch the requests that were held behind this one
+      int received = 0;
+      c->proto_handler(c, MG_EV_RECV, &received);
+    }
+  }
+
+  for (size_t i = 0; i < ready.size(); i++) {
+    free(ready[i]->reply.long_json);
+    free(ready[i]);
+  }
+}
+
+// Hands a finished deferred write to its event loop, which frees it, or
+// for a relayed write sends its reply back to the server that relayed it
+static void queue_reply(PendingWrite *w) {
+  if (w->relayed != NULL) {
+    w->relayed(w->reply.status, NULL, 0, w->reply.lsn, w->relayed_arg);
+    free(w);
+    return;
+  }
+
+  Data *data = (Data *) w->mgr->user_data;
+
+  pthread_mutex_lock(&data->ready_lock);
+  if (data->ready_writes.empty())
+    pthread_cond_signal(&data->ready_cond);
+  data->ready_writes.push_back(w);
+  pthread_mutex_unlock(&data->ready_lock);
+}
+
+// Wakes an event loop whenever it has replies queued. mg_broadcast waits
+// for the event loop, which can't broadcast to itself and may be busy
+// with a long request meanwhile, so neither it nor the completion threads
+// queuing replies broadcast themselves; they leave that to this thread.
+static void *wake_event_loop(void *v) {
+  struct mg_mgr *mgr = (struct mg_mgr *) v;
+  Data *data = (Data *) mgr->user_data;
+
+  // mongoose drops a broadcast with no payload
+  char unused = 0;
+
+  pthread_mutex_lock(&data->ready_lock);
+  for (;;) {
+    while (data->ready_writes.empty())
+      pthread_cond_wait(&data->ready_cond, &data->ready_lock);
+    pthread_mutex_unlock(&data->ready_lock);
+
+    mg_broadcast(mgr, reply_pending_writes, &unused, sizeof(unused));
+
+    pthread_mutex_lock(&data->ready_lock);
+  }
+  return NULL;
+}
+
+// Sends a deferred reply once the write has reached the tail of this
+// partition's chain
+static void finish_replicated_write(int status, void *arg) {
+  PendingWrite *w = (PendingWrite *) arg;
+
+  if (status != SUCCESS)
+    w->reply.status = status;
+  w->reply.lsn = write_log.lsn();
+  queue_reply(w);
+}
+
+// Replies to a deferred write, with the status already in its reply, once
+// the write has reached the tail of this partition's chain
+static void reply_after_chain(PendingWrite *w) {
+  if (chain_barrier(finish_replicated_write, w) == SUCCESS)
+    finish_replicated_write(SUCCESS, w);
+}
+
+// Completion for propogate_async, on the RPC client thread. The intent
+// it releases may have another write queued behind it.
+static void finish_edge_write(int status, void *arg) {
+  PendingWrite *w = (PendingWrite *) arg;
+
+  w->reply.status = commit_edge_write(w, status);
+  reply_after_chain(w);
+}
+
+// Replies to a write applied on this replica once the rest of its chain
+// has it too, so a read at the tail always sees an acknowledged write.
+// The reply is deferred like a cross-partition edge write's, and a body
+// too big to hand to the event loop is not echoed.
+static void send_replicated_status(struct mg_connection *nc, int status, const char *json, int json_len) {
+  PendingWrite *w = defer_write(nc, json, json_len);
+  w->reply.status = status;
+  if (chain_barrier(finish_replicated_write, w) == 0)
+    return;
+
+  release_reply(nc);
+  send_reply(nc, status, w->reply.json, w->reply.json_len, write_log.lsn());
+  free(w);
+}
+
+// The partition that owns a relayed write under the current map
+static unsigned relayed_owner(const PendingWrite *w) {
+  const PartitionMap *map = partitioner.current();
+  if (w->op == ADD_NODE || w->op == REMOVE_NODE)
+    return map->owner(w->min_node_id);
+  return std::min(map->owner(w->min_node_id), map->owner(w->max_node_id));
+}
+
+static void finish_relay(int status, const char *body, int body_len, uint64_t lsn, void *arg);
+
+// Relays a write again, rebuilt from its op and nodes, to the partition
+// that owns it now. Returns 0 once the call has started.
+static int relay_again(PendingWrite *w, unsigned owner) {
+  static const char *const uris[] = {
+    "/api/v1/add_node", "/api/v1/remove_node", "/api/v1/add_edge", "/api/v1/remove_edge"
+  };
+  char body[100];
+  int body_len;
+
+  if (w->op == ADD_NODE || w->op == REMOVE_NODE)
+    body_len = snprintf(body, sizeof(body), "{\"node_id\" : %lu}", w->min_node_id);
+  else
+    body_len = snprintf(body, sizeof(body), "{\"node_a_id\" : %lu, \"node_b_id\" : %lu}",
+                        w->min_node_id, w->max_node_id);
+
+  fprintf(stderr, "Relaying %s again to partition %u \n", uris[w->op], owner+1);
+
+  w->owner = owner;
+  return relay_async(owner, uris[w->op], body, body_len, finish_relay, w);
+}
+
+// Completion for relay_async, on the RPC client thread. A write the head
+// refused because the partition map has since moved it is sent on to its
+// new owner; the head never relays it on itself.
+static void finish_relay(int status, const char *body, int body_len, uint64_t lsn, void *arg) {
+  PendingWrite *w = (PendingWrite *) arg;
+
+  if (status == ERROR && w->op != RELAYED_READ) {
+    unsigned owner = relayed_owner(w);
+    if (owner != w->owner && relay_again(w, owner) == 0)
+      return;
+  }
+
+  if (body_len > REPLY_JSON_SIZE) {
+    w->reply.long_json = (char *) malloc(body_len);
+    memcpy(w->reply.long_json, body, body_len);
+    w->reply.json_len = body_len;
+  } else if (body_len > 0) {
+    memcpy(w->reply.json, body, body_len);
+    w->reply.json_len = body_len;
+  }
+  w->reply.status = status;
+  w->reply.lsn = lsn;
+  queue_reply(w);
+}
+
+// Sends a request this server can't answer to the head of partition
+// owner (numbered from 0), and replies from the event loop once the head
+// has. Any server can then take any request. Returns false without doing
+// anything if the request is answered here: owner is this partition and,
+// for a write, this is the head. op is the request's write, or
+// RELAYED_READ, and node_a_id and node_b_id the nodes a write routes by
+// (both node_id for a node write), so it can be relayed again.
+static bool relay_request(struct mg_connection *nc, struct http_message *hm, unsigned owner,
+                          int op, uint64_t node_a_id, uint64_t node_b_id) {
+  bool write = op != RELAYED_READ;
+  if (owner == (unsigned) (part-1) && (head || !write))
+    return false;
+
+  fprintf(stderr, "Relaying %.*s to partition %u \n", (int) hm->uri.len, hm->uri.p, owner+1);
+
+  // A write is echoed back as the head would have, unless it is too big
+  PendingWrite *w = defer_write(nc, hm->body.p, write ? (int) hm->body.len : 0);
+  w->op = op;
+  w->min_node_id = node_a_id;
+  w->max_node_id = node_b_id;
+  w->owner = owner;
+
+  std::string uri(hm->uri.p, hm->uri.len);
+  if (relay_async(owner, uri.c_str(), hm->body.p, (int) hm->body.len, finish_relay, w) == 0)
+    return true;
+
+  release_reply(nc);
+  free(w);
+  send_reply(nc, RPC_FAILED, NULL, 0, 0);
+  return true;
+}
+
+// Sends the replication RPC for an edge write add_edge or remove_edge, or
+// a relayed request, has reserved, once the lower node has been checked.
+// The reply is sent from finish_edge_write. Runs on the thread that
+// reserved the intent if it was free, and otherwise on the thread that
+// released the intent it waited for.
+static void start_edge_write(void *arg) {
+  PendingWrite *w = (PendingWrite *) arg;
+
+  if (check_edge_write(w->graph, w->min_node_id, w->max_node_id) != SUCCESS) {
+    fprintf(stderr, "%s: lower node doesn't exist \n", w->op == ADD_EDGE ? "add_edge" : "remove_edge");
+    w->reply.status = ERROR;
+    w->reply.lsn = write_log.lsn();
+    queue_reply(w);
+    return;
   }
 
-  free(arr);
+  int status = propogate_async(w->op, w->min_node_id, w->max_node_id, finish_edge_write, w);
+  if (status != 0)
+    finish_edge_write(status, w);
+}
+
+// Reserves a cross-partition edge write for add_edge or remove_edge and
+// starts it once the intent is held, which may be behind another write to
+// the same edge. The reply is deferred either way, and a body too big to
+// hand to the event loop is not echoed.
+static void replicate_edge_write(struct mg_connection *nc, Graph *graph, int op,
+                                 uint64_t min_node_id, uint64_t max_node_id,
+                                 const char *json, int json_len) {
+  PendingWrite *w = defer_write(nc, json, json_len);
+  w->graph = graph;
+  w->op = op;
+  w->min_node_id = min_node_id;
+  w->max_node_id = max_node_id;
+
+  if (edge_intents.reserve(min_node_id, max_node_id, start_edge_write, w))
+    start_edge_write(w);
+}
+
+// Removes a node reserved by remove_node, or for a relayed request, once
+// no edge to it is in flight, and replies once the removal has reached the
+// tail of the chain
+static void finish_node_removal(void *arg) {
+  PendingWrite *w = (PendingWrite *) arg;
+
+  w->reply.status = write_node(w->graph, REMOVE_NODE, w->min_node_id);
+  edge_intents.releaseNode(w->min_node_id);
+
+  //DEBUG
+  fprintf(stderr, "remove_node: %lu = %d\n", w->min_node_id, w->reply.status);
+
+  reply_after_chain(w);
 }
 
 static void add_edge(struct mg_connection *nc, struct http_message *hm, void *user_data) {
@@ -71,53 +836,56 @@ static void add_edge(struct mg_connection *nc, struct http_message *hm, void *us
   const char *json = hm->body.p;
   int json_len = (int) hm->body.len;
 
-  struct json_token *arr, *tok, *tok1;
+  ApiRequest req;
   int status = 0;
 
-  arr = parse_json2(json, json_len);
-  if (arr == NULL) {
-    mg_printf(nc, "Error in JSON\n");
-    free(arr);
+  if (!req.parse(json, json_len)) {
+    send_bad_request(nc, "Error in JSON");
     return;
   }
 
-  tok = find_json_token(arr, "node_a_id");
-  if (tok == NULL) {
-    mg_printf(nc, "Could not find node_a_id in JSON\n");
-    free(arr);
+  if (!req.has(FIELD_NODE_A_ID)) {
+    send_bad_request(nc, "Could not find node_a_id in JSON");
     return;
   }
 
-  tok1 = find_json_token(arr, "node_b_id");
-  if (tok1 == NULL) {
-    mg_printf(nc, "Could not find node_b_id in JSON\n");
-    free(arr);
+  if (!req.has(FIELD_NODE_B_ID)) {
+    send_bad_request(nc, "Could not find node_b_id in JSON");
     return;
   }
 
   // Get node IDs
-  uint64_t node_a_id = strtoull(tok->ptr, NULL, 10);
-  uint64_t node_b_id = strtoull(tok1->ptr, NULL, 10);
+  uint64_t node_a_id = req.node_a_id;
+  uint64_t node_b_id = req.node_b_id;
+
+  // Route the edge by one map throughout
+  const PartitionMap *map = partitioner.current();
+  unsigned owner_a = map->owner(node_a_id);
+  unsigned owner_b = map->owner(node_b_id);
+
+  // Cross-partition edges are written through the lower partition
+  if (relay_request(nc, hm, std::min(owner_a, owner_b), ADD_EDGE, node_a_id, node_b_id))
+    return;
 
   // Neither node in this partition
-  if (node_a_id % 3 != part-1 && node_b_id % 3 != part-1) {
+  if (owner_a != part-1 && owner_b != part-1) {
     fprintf(stderr, "BAD REQUEST: Neither node is in this partition \n");
     status = ERROR;
   }
 
   // Both nodes in this partition
-  else if (node_a_id % 3 == part-1 && node_b_id % 3 == part-1) {
+  else if (owner_a == part-1 && owner_b == part-1) {
     fprintf(stderr, "Both nodes in this partition \n");
-    status = graph->addEdge(node_a_id, node_b_id); 
+    status = write_local_edge(graph, ADD_EDGE, node_a_id, node_b_id);
   }
 
   // Exactly one node in this partition
   else {
-    uint64_t max_node_id = ((node_a_id % 3) < (node_b_id % 3))? node_b_id : node_a_id;
-    uint64_t min_node_id = ((node_a_id % 3) > (node_b_id % 3))? node_b_id : node_a_id;
+    uint64_t max_node_id = map->higherNode(node_a_id, node_b_id);
+    uint64_t min_node_id = map->lowerNode(node_a_id, node_b_id);
 
     // I am the higher partition
-    if (max_node_id % 3 == part-1) {
+    if (map->owner(max_node_id) == part-1) {
       fprintf(stderr, "BAD REQUEST: Request sent to higher partition \n");
       status = ERROR; 
     }
@@ -125,55 +893,19 @@ static void add_edge(struct mg_connection *nc, struct http_message *hm, void *us
     // I am the lower partition
     else {
       fprintf(stderr, "Add_edge: I am the lower partition, about to send RPC to higher partition \n");
-      
-      // Check if this partition has lower node
-      std::pair<int, bool> result;
-      result = graph->getNode(min_node_id);
-      bool in_graph = std::get<1>(result);
-
-      // If lower node doesn't exist, return
-      if (!in_graph) {
-        status = ERROR;
-        fprintf(stderr, "Add_edge: lower node doesn't exist \n");
-        mg_printf(nc, "HTTP/1.1 400 Bad Request\r\n");
-        fprintf(stderr, "add_edge: %.*s, %.*s = %d\n", tok->len, tok->ptr, tok1->len, tok1->ptr, status);
-        free(arr);
-        return;
-      }
-
-      status = propogate(ADD_EDGE, min_node_id, max_node_id);
-      if (status == RPC_FAILED) {
-        fprintf(stderr, "Add_edge: RPC failed \n");
-        mg_printf(nc, "HTTP/1.1 500 RPC Failed\r\n");
-        fprintf(stderr, "add_edge: %.*s, %.*s = %d\n", tok->len, tok->ptr, tok1->len, tok1->ptr, status);
-        free(arr);
-        return;
-      }
 
-      if (status == SUCCESS) {
-        graph->addNode(max_node_id);
-        status = graph->addEdge(min_node_id, max_node_id); 
-      }
+      // Reserve the edge, replicate it to the higher partition with no
+      // graph lock held, then commit locally. None of it blocks the event
+      // loop, and the reply is deferred until it is done.
+      replicate_edge_write(nc, graph, ADD_EDGE, min_node_id, max_node_id, json, json_len);
+      return;
     }
   } 
 
   //DEBUG
-  fprintf(stderr, "add_edge: %.*s, %.*s = %d\n", tok->len, tok->ptr, tok1->len, tok1->ptr, status); 
-
-  if (status == SUCCESS) {
-    mg_printf(nc, "HTTP/1.1 %d OK\r\n"
-                  "Content-Length: %d\r\n"
-                  "Content-Type: application/json\r\n"
-                  "\r\n%.*s", status, json_len, json_len, json);  
-  } else if (status == EXISTS) {
-    mg_printf(nc, "HTTP/1.1 204 OK\r\n");
-  } else if (status == ERROR) {
-    mg_printf(nc, "HTTP/1.1 400 Bad Request\r\n");
-  } else {
-    mg_printf(nc, "HTTP/1.1 404 Not Found\r\n");
-  }
+  fprintf(stderr, "add_edge: %lu, %lu = %d\n", req.node_a_id, req.node_b_id, status); 
 
-  free(arr);
+  send_replicated_status(nc, status, json, json_len);
 }
 
 static void remove_node(struct mg_connection *nc, struct http_message *hm, void *user_data) {
@@ -183,43 +915,42 @@ static void remove_node(struct mg_connection *nc, struct http_message *hm, void
   const char *json = hm->body.p;
   int json_len = (int) hm->body.len;
 
-  struct json_token *arr, *tok;
+  ApiRequest req;
   int status = 0;
 
-  arr = parse_json2(json, json_len);
-  if (arr == NULL) {
-    mg_printf(nc, "Error in JSON\n");
-    free(arr);
+  if (!req.parse(json, json_len)) {
+    send_bad_request(nc, "Error in JSON");
     return;
   }
 
-  tok = find_json_token(arr, "node_id");
-  if (tok == NULL) {
-    mg_printf(nc, "Could not find node_id in JSON\n");
-    free(arr);
+  if (!req.has(FIELD_NODE_ID)) {
+    send_bad_request(nc, "Could not find node_id in JSON");
     return;
   }
 
-  status = graph->removeNode(strtoull(tok->ptr, NULL, 10)); 
+  uint64_t node_id = req.node_id;
 
-  //DEBUG
-  fprintf(stderr, "remove_node: %.*s = %d\n", tok->len, tok->ptr, status);
+  if (relay_request(nc, hm, partitioner.owner(node_id), REMOVE_NODE, node_id, node_id))
+    return;
 
-  if (status == SUCCESS) {
-    mg_printf(nc, "HTTP/1.1 %d OK\r\n"
-                  "Content-Length: %d\r\n"
-                  "Content-Type: application/json\r\n"
-                  "\r\n%.*s", status, json_len, json_len, json); 
-    
-    
-  } else if (status == ERROR) {
-    mg_printf(nc, "HTTP/1.1 400 Bad Request\r\n");
-    
-  } else {
-    mg_printf(nc, "HTTP/1.1 404 Not Found\r\n");
-  }
+  // Edges to this node may be in flight to another partition. If so the
+  // removal is queued behind them and its reply deferred.
+  PendingWrite *w = defer_write(nc, json, json_len);
+  w->graph = graph;
+  w->op = REMOVE_NODE;
+  w->min_node_id = w->max_node_id = node_id;
+  if (!edge_intents.reserveNode(node_id, finish_node_removal, w))
+    return;
+  release_reply(nc);
+  free(w);
+
+  status = write_node(graph, REMOVE_NODE, node_id);
+  edge_intents.releaseNode(node_id);
+
+  //DEBUG
+  fprintf(stderr, "remove_node: %lu = %d\n", req.node_id, status);
 
-  free(arr);
+  send_replicated_status(nc, status, json, json_len);
 }
 
 static void remove_edge(struct mg_connection *nc, struct http_message *hm, void *user_data) {
@@ -229,53 +960,56 @@ static void remove_edge(struct mg_connection *nc, struct http_message *hm, void
   const char *json = hm->body.p;
   int json_len = (int) hm->body.len;
 
-  struct json_token *arr, *tok, *tok1;
+  ApiRequest req;
   int status = 0;
 
-  arr = parse_json2(json, json_len);
-  if (arr == NULL) {
-    mg_printf(nc, "Error in JSON\n");
-    free(arr);
+  if (!req.parse(json, json_len)) {
+    send_bad_request(nc, "Error in JSON");
     return;
   }
 
-  tok = find_json_token(arr, "node_a_id");
-  if (tok == NULL) {
-    mg_printf(nc, "Could not find node_a_id in JSON\n");
-    free(arr);
+  if (!req.has(FIELD_NODE_A_ID)) {
+    send_bad_request(nc, "Could not find node_a_id in JSON");
     return;
   }
 
-  tok1 = find_json_token(arr, "node_b_id");
-  if (tok1 == NULL) {
-    mg_printf(nc, "Could not find node_b_id in JSON\n");
-    free(arr);
+  if (!req.has(FIELD_NODE_B_ID)) {
+    send_bad_request(nc, "Could not find node_b_id in JSON");
     return;
   }
 
   // Get node IDs
-  uint64_t node_a_id = strtoull(tok->ptr, NULL, 10);
-  uint64_t node_b_id = strtoull(tok1->ptr, NULL, 10);
+  uint64_t node_a_id = req.node_a_id;
+  uint64_t node_b_id = req.node_b_id;
+
+  // Route the edge by one map throughout
+  const PartitionMap *map = partitioner.current();
+  unsigned owner_a = map->owner(node_a_id);
+  unsigned owner_b = map->owner(node_b_id);
+
+  // Cross-partition edges are written through the lower partition
+  if (relay_request(nc, hm, std::min(owner_a, owner_b), REMOVE_EDGE, node_a_id, node_b_id))
+    return;
 
   // Neither node in this partition
-  if (node_a_id % 3 != part-1 && node_b_id % 3 != part-1) {
+  if (owner_a != part-1 && owner_b != part-1) {
     fprintf(stderr, "BAD REQUEST: Neither node is in this partition \n");
     status = ERROR;
   }
 
   // Both nodes in this partition
-  else if (node_a_id % 3 == part-1 && node_b_id % 3 == part-1) {
+  else if (owner_a == part-1 && owner_b == part-1) {
     fprintf(stderr, "Both nodes in this partition \n");
-    status = graph->removeEdge(node_a_id, node_b_id); 
+    status = write_local_edge(graph, REMOVE_EDGE, node_a_id, node_b_id);
   }
 
   // Exactly one node in this partition
   else {
-    uint64_t max_node_id = ((node_a_id % 3) < (node_b_id % 3))? node_b_id : node_a_id;
-    uint64_t min_node_id = ((node_a_id % 3) > (node_b_id % 3))? node_b_id : node_a_id;
+    uint64_t max_node_id = map->higherNode(node_a_id, node_b_id);
+    uint64_t min_node_id = map->lowerNode(node_a_id, node_b_id);
 
     // I am the higher partition
-    if (max_node_id % 3 == part-1) {
+    if (map->owner(max_node_id) == part-1) {
       fprintf(stderr, "BAD REQUEST: Request sent to higher partition \n");
       status = ERROR; 
     }
@@ -284,52 +1018,48 @@ static void remove_edge(struct mg_connection *nc, struct http_message *hm, void
     else {
       fprintf(stderr, "Remove_edge: I am the lower partition, about to send RPC to higher partition \n");
 
-      // Check if this partition has lower node
-      std::pair<int, bool> result;
-      result = graph->getNode(min_node_id);
-      bool in_graph = std::get<1>(result);
-
-      // If lower node doesn't exist, return
-      if (!in_graph) {
-        status = ERROR;
-        fprintf(stderr, "Remove_edge: lower node doesn't exist \n");
-        mg_printf(nc, "HTTP/1.1 400 Bad Request\r\n");
-        fprintf(stderr, "remove_edge: %.*s, %.*s = %d\n", tok->len, tok->ptr, tok1->len, tok1->ptr, status);
-        free(arr);
-        return;
-      }
-
-      status = propogate(REMOVE_EDGE, min_node_id, max_node_id);
-      if (status == RPC_FAILED) {
-        mg_printf(nc, "HTTP/1.1 500 RPC Failed\r\n");
-        fprintf(stderr, "remove_edge: %.*s, %.*s = %d\n", tok->len, tok->ptr, tok1->len, tok1->ptr, status);
-        free(arr);
-        return;
-      }
-      
-      status = graph->removeEdge(min_node_id, max_node_id); 
+      // Reserve the edge, replicate it to the higher partition with no
+      // graph lock held, then commit locally. None of it blocks the event
+      // loop, and the reply is deferred until it is done.
+      replicate_edge_write(nc, graph, REMOVE_EDGE, min_node_id, max_node_id, json, json_len);
+      return;
     }
 
   } 
 
   //DEBUG
-  fprintf(stderr, "remove_edge: %.*s, %.*s = %d\n", tok->len, tok->ptr, tok1->len, tok1->ptr, status);
+  fprintf(stderr, "remove_edge: %lu, %lu = %d\n", req.node_a_id, req.node_b_id, status);
 
-  if (status == SUCCESS) {
-    mg_printf(nc, "HTTP/1.1 %d OK\r\n"
-                  "Content-Length: %d\r\n"
-                  "Content-Type: application/json\r\n"
-                  "\r\n%.*s", status, json_len, json_len, json);  
-    
-    
-  } else if (status == ERROR) {
-    mg_printf(nc, "HTTP/1.1 400 Bad Request\r\n");
-    
-  } else {
-    mg_printf(nc, "HTTP/1.1 404 Not Found\r\n");
+  send_replicated_status(nc, status, json, json_len);
+}
+
+// Longest a read replica may go without hearing from the replica it
+// follows before it turns reads away, set with -s
+static uint64_t max_staleness_ms = 1000;
+
+// True for a read this server can't answer fresh enough: any read on a
+// read replica that is more than max_staleness_ms behind, or one whose
+// min_lsn hasn't been applied here yet. The client can retry or go to the
+// tail instead.
+static bool too_stale(const ApiRequest &req) {
+  uint64_t lag = follower_lag_ms();
+  if (lag > max_staleness_ms) {
+    fprintf(stderr, "Refusing read: %lu ms behind \n", lag);
+    return true;
+  }
+
+  if (req.has(FIELD_MIN_LSN) && req.min_lsn > write_log.lsn()) {
+    fprintf(stderr, "Refusing read: LSN %lu before min_lsn %lu \n", write_log.lsn(), req.min_lsn);
+    return true;
   }
+  return false;
+}
 
-  free(arr);
+static bool refuse_stale_read(struct mg_connection *nc, const ApiRequest &req) {
+  if (!too_stale(req))
+    return false;
+  send_status(nc, STALE);
+  return true;
 }
 
 static void get_node(struct mg_connection *nc, struct http_message *hm, void *user_data) {
@@ -339,35 +1069,41 @@ static void get_node(struct mg_connection *nc, struct http_message *hm, void *us
   const char *json = hm->body.p;
   int json_len = (int) hm->body.len;
 
-  struct json_token *arr, *tok;
+  ApiRequest req;
 
   std::pair<int, bool> result;
   int status;
+  uint64_t lsn;
   bool in_graph;
 
   char buf[1000];
   int json_buf_size = sizeof(buf);
 
-  arr = parse_json2(json, json_len);
-  if (arr == NULL) {
-    mg_printf(nc, "Error in JSON\n");
-    free(arr);
+  if (!req.parse(json, json_len)) {
+    send_bad_request(nc, "Error in JSON");
     return;
   }
 
-  tok = find_json_token(arr, "node_id");
-  if (tok == NULL) {
-    mg_printf(nc, "Could not find node_id in JSON\n");
-    free(arr);
+  if (!req.has(FIELD_NODE_ID)) {
+    send_bad_request(nc, "Could not find node_id in JSON");
     return;
   }
 
-  result = graph->getNode(strtoull(tok->ptr, NULL, 10));
+  if (relay_request(nc, hm, partitioner.owner(req.node_id), RELAYED_READ, 0, 0))
+    return;
+
+  if (refuse_stale_read(nc, req))
+    return;
+
+  graph_locks.readLock();
+  result = graph->getNode(req.node_id);
+  lsn = write_log.lsn();
+  graph_locks.unlock();
   status = std::get<0>(result); 
   in_graph = std::get<1>(result);
 
   //DEBUG
-  fprintf(stderr, "get_node: %.*s = %d\n", tok->len, tok->ptr, status);
+  fprintf(stderr, "get_node: %lu = %d\n", req.node_id, status);
 
   if (in_graph == true) {
     json_buf_size = json_emit(buf, sizeof(buf), "{s : T}", "in_graph");
@@ -376,8 +1112,7 @@ static void get_node(struct mg_connection *nc, struct http_message *hm, void *us
     json_buf_size = json_emit(buf, sizeof(buf), "{s : F}", "in_graph");
     assert(json_buf_size >= 0 && (size_t) json_buf_size <= sizeof(buf));
   } else {
-    mg_printf(nc, "Error creating JSON in_graph field \n");
-    free(arr);
+    send_bad_request(nc, "Error creating JSON in_graph field");
     return;
   }
 
@@ -385,13 +1120,12 @@ static void get_node(struct mg_connection *nc, struct http_message *hm, void *us
     mg_printf(nc, "HTTP/1.1 %d OK\r\n"
                   "Content-Length: %d\r\n"
                   "Content-Type: application/json\r\n"
-                  "\r\n%.*s", status, json_buf_size, json_buf_size, buf); 
+                  "X-LSN: %lu\r\n"
+                  "\r\n%.*s", status, json_buf_size, lsn, json_buf_size, buf); 
     
   } else {
-    mg_printf(nc, "HTTP/1.1 404 Not Found\r\n");
+    send_status(nc, 404);
   }
-
-  free(arr);
 }
 
 static void get_edge(struct mg_connection *nc, struct http_message *hm, void *user_data) {
@@ -401,42 +1135,51 @@ static void get_edge(struct mg_connection *nc, struct http_message *hm, void *us
   const char *json = hm->body.p;
   int json_len = (int) hm->body.len;
 
-  struct json_token *arr, *tok, *tok1;
+  ApiRequest req;
 
   std::pair<int, bool> result;
   int status;
+  uint64_t lsn;
   bool in_graph;
 
   char buf[1000];
   int json_buf_size = sizeof(buf);
 
-  arr = parse_json2(json, json_len);
-  if (arr == NULL) {
-    mg_printf(nc, "Error in JSON\n");
-    free(arr);
+  if (!req.parse(json, json_len)) {
+    send_bad_request(nc, "Error in JSON");
     return;
   }
 
-  tok = find_json_token(arr, "node_a_id");
-  if (tok == NULL) {
-    mg_printf(nc, "Could not find node_a_id in JSON\n");
-    free(arr);
+  if (!req.has(FIELD_NODE_A_ID)) {
+    send_bad_request(nc, "Could not find node_a_id in JSON");
     return;
   }
 
-  tok1 = find_json_token(arr, "node_b_id");
-  if (tok1 == NULL) {
-    mg_printf(nc, "Could not find node_b_id in JSON\n");
-    free(arr);
+  if (!req.has(FIELD_NODE_B_ID)) {
+    send_bad_request(nc, "Could not find node_b_id in JSON");
     return;
   }
 
-  result = graph->getEdge(strtoull(tok->ptr, NULL, 10), strtoull(tok1->ptr, NULL, 10));
+  // Either node's partition has the edge
+  const PartitionMap *map = partitioner.current();
+  unsigned owner = map->owner(req.node_a_id);
+  if (map->owner(req.node_b_id) == (unsigned) (part-1))
+    owner = part-1;
+  if (relay_request(nc, hm, owner, RELAYED_READ, 0, 0))
+    return;
+
+  if (refuse_stale_read(nc, req))
+    return;
+
+  graph_locks.readLock();
+  result = graph->getEdge(req.node_a_id, req.node_b_id);
+  lsn = write_log.lsn();
+  graph_locks.unlock();
   status = std::get<0>(result); 
   in_graph = std::get<1>(result); 
 
   //DEBUG
-  fprintf(stderr, "get_edge: %.*s, %.*s = %d\n", tok->len, tok->ptr, tok1->len, tok1->ptr, status);
+  fprintf(stderr, "get_edge: %lu, %lu = %d\n", req.node_a_id, req.node_b_id, status);
 
   if (in_graph == true) {
     json_buf_size = json_emit(buf, sizeof(buf), "{s : T}", "in_graph");
@@ -445,8 +1188,7 @@ static void get_edge(struct mg_connection *nc, struct http_message *hm, void *us
     json_buf_size = json_emit(buf, sizeof(buf), "{s : F}", "in_graph");
     assert(json_buf_size >= 0 && (size_t) json_buf_size <= sizeof(buf));
   } else {
-    mg_printf(nc, "Error creating JSON in_graph field \n");
-    free(arr);
+    send_bad_request(nc, "Error creating JSON in_graph field");
     return;
   }
 
@@ -454,17 +1196,18 @@ static void get_edge(struct mg_connection *nc, struct http_message *hm, void *us
     mg_printf(nc, "HTTP/1.1 %d OK\r\n"
                   "Content-Length: %d\r\n"
                   "Content-Type: application/json\r\n"
-                  "\r\n%.*s", status, json_buf_size, json_buf_size, buf); 
+                  "X-LSN: %lu\r\n"
+                  "\r\n%.*s", status, json_buf_size, lsn, json_buf_size, buf); 
     
-  } else if (status == ERROR) {
-    mg_printf(nc, "HTTP/1.1 400 Bad Request\r\n");
   } else {
-    mg_printf(nc, "HTTP/1.1 404 Not Found\r\n");
+    send_status(nc, status == ERROR ? ERROR : 404);
   }
-
-  free(arr);
 }
 
+// Lists a node's neighbors in ID order. With a limit, only that many are
+// listed, and if more remain the reply carries a next_cursor; passing it
+// back as cursor gets the page after. Each page costs a binary search of
+// the adjacency list plus the IDs on it.
 static void get_neighbors(struct mg_connection *nc, struct http_message *hm, void *user_data) {
   Data *data = (Data *) user_data;
   Graph *graph = data->graph;
@@ -472,54 +1215,1017 @@ static void get_neighbors(struct mg_connection *nc, struct http_message *hm, voi
   const char *json = hm->body.p;
   int json_len = (int) hm->body.len;
 
-  struct json_token *arr, *tok;
+  ApiRequest req;
 
-  std::pair<int, std::string> result;
+  Graph::NeighborIterator it;
+  NeighborPage page;
+  ReplyStream reply;
+  uint64_t n = 0;
+  uint64_t last = 0;
   int status;
-  std::string neighbor_list;
 
-  char buf[1000];
-  int json_buf_size = sizeof(buf);
+  char chunk_head[64];
 
-  arr = parse_json2(json, json_len);
-  if (arr == NULL) {
-    mg_printf(nc, "Error in JSON\n");
-    free(arr);
+  if (!req.parse(json, json_len)) {
+    send_bad_request(nc, "Error in JSON");
     return;
   }
 
-  tok = find_json_token(arr, "node_id");
-  if (tok == NULL) {
-    mg_printf(nc, "Could not find node_id in JSON\n");
-    free(arr);
+  if (!req.has(FIELD_NODE_ID)) {
+    send_bad_request(nc, "Could not find node_id in JSON");
     return;
   }
 
-  result = graph->getNeighbors(strtoull(tok->ptr, NULL, 10));
+  if (!read_page(req, &page)) {
+    send_bad_request(nc, "Bad limit or cursor in JSON");
+    return;
+  }
 
-  status = std::get<0>(result); 
-  neighbor_list = std::get<1>(result);
+  if (relay_request(nc, hm, partitioner.owner(req.node_id), RELAYED_READ, 0, 0))
+    return;
 
-  //DEBUG
-  fprintf(stderr, "get_neighbors: %.*s = %d\n", tok->len, tok->ptr, status);
+  if (refuse_stale_read(nc, req))
+    return;
 
-  json_buf_size = json_emit(buf, sizeof(buf), "{s : V, s : [S]}", 
-                            "node_id", tok->ptr, tok->len, "neighbors", neighbor_list.c_str());
-  assert(json_buf_size >= 0 && (size_t) json_buf_size <= sizeof(buf));
+  // Neighbors go from the adjacency lists straight to the connection,
+  // under the read lock until the last one is written
+  graph_locks.readLock();
+  if (graph->findNeighbors(req.node_id, &it)) {
+    status = SUCCESS;
+    seek_page(&it, page);
+    stream_begin(&reply, nc, hm, write_log.lsn());
+    stream_write(&reply, chunk_head, snprintf(chunk_head, sizeof(chunk_head), "{\"node_id\" : %lu, \"neighbors\" : [", req.node_id));
+    for (; !it.done() && n < page.limit; it.next(), n++) {
+      if (n > 0)
+        stream_write(&reply, ",", 1);
+      last = it.id();
+      stream_id(&reply, last);
+    }
+    stream_write(&reply, "]", 1);
+    if (!it.done()) {
+      stream_write(&reply, ", \"next_cursor\" : \"", 19);
+      format_cursor(chunk_head, last);
+      stream_write(&reply, chunk_head, CURSOR_LEN);
+      stream_write(&reply, "\"", 1);
+    }
+    stream_write(&reply, "}", 1);
+    stream_end(&reply);
+  } else {
+    status = ERROR;
+  }
+  graph_locks.unlock();
 
-  if (status == SUCCESS && buf != NULL) {
-    mg_printf(nc, "HTTP/1.1 %d OK\r\n"
-                  "Content-Length: %d\r\n"
-                  "Content-Type: application/json\r\n"
-                  "\r\n%.*s", status, json_buf_size, json_buf_size, buf); 
-    
-  } else if (status == ERROR) {
-    mg_printf(nc, "HTTP/1.1 400 Bad Request\r\n");
+  //DEBUG
+  fprintf(stderr, "get_neighbors: %lu = %d\n", req.node_id, status);
+
+  if (status != SUCCESS)
+    send_status(nc, status);
+}
+
+// Most ops one /api/v1/batch request may carry. A batch's whole reply is
+// built in memory, and a leg of it has to fit one RPC.
+#define BATCH_MAX_OPS 4096
+
+// Batch op codes: the four writes, then the reads
+enum {
+  BATCH_GET_NODE = REMOVE_EDGE + 1,
+  BATCH_GET_EDGE,
+  BATCH_GET_NEIGHBORS,
+  BATCH_OPS
+};
+
+static const char *batch_op_names[BATCH_OPS] = {
+  "add_node", "remove_node", "add_edge", "remove_edge",
+  "get_node", "get_edge", "get_neighbors"
+};
+
+// One op of a batch. result is its JSON object in the reply, filled in
+// once it has been answered here or by the partition it was sent to. An
+// edge write that crosses partitions has its lower node in node_a_id.
+typedef struct {
+  int op;
+  uint64_t node_a_id;
+  uint64_t node_b_id;
+  unsigned owner;
+  bool crosses;
+  int status;
+  bool in_graph;
+  NeighborPage page;
+  std::string neighbors;
+  std::string next_cursor;
+  std::string result;
+} BatchOp;
+
+struct Batch;
+
+// Called once every op of a batch has its result
+typedef void (*BatchDone)(struct Batch *b);
+
+// The reply to one RPC a batch sent: a relayed leg, or the replication of
+// one of its cross-partition edge writes
+typedef struct {
+  struct Batch *batch;
+  int status;
+  std::string body;
+} BatchCall;
+
+// A batch in progress. run_batch starts it, and from then on it advances
+// from the completion of whatever it waits on, on whichever thread that
+// completes: a relayed leg, an edge intent, a replication RPC or the
+// chain. The ops kept here run one step at a time, in request order.
+typedef struct Batch {
+  Graph *graph;
+  std::vector<BatchOp> ops;
+  BatchDone done;
+  void *arg;
+
+  // For a leg relayed here, where its results go
+  RelayCallback relayed;
+
+  // Sub-batches relayed to other partitions, by owner, and their replies
+  std::map<unsigned, std::vector<size_t> > legs;
+  std::vector<unsigned> owners;
+  std::vector<BatchCall> calls;
+
+  // The ops run here, and the next of them to run
+  std::vector<size_t> local;
+  size_t next;
+
+  // A run of cross-partition edge writes, local[next..run_end): its edges
+  // in the order they are reserved, how many have been, and their RPCs
+  size_t run_end;
+  std::vector<std::pair<std::pair<uint64_t, uint64_t>, size_t> > edges;
+  size_t reserving;
+  std::vector<bool> reserved;
+  std::vector<BatchCall> run_calls;
+
+  // Legs in flight, plus one until the ops run here are done; and the
+  // replication RPCs of the current run in flight
+  pthread_mutex_t lock;
+  int pending;
+  int run_pending;
+} Batch;
+
+static bool batch_write(const BatchOp &o) {
+  return o.op <= REMOVE_EDGE;
+}
+
+static bool batch_edge(const BatchOp &o) {
+  return o.op == ADD_EDGE || o.op == REMOVE_EDGE || o.op == BATCH_GET_EDGE;
+}
+
+// Reads the ops array of a batch. An op that can't be understood is kept,
+// with status ERROR, so the results still line up with the request.
+// Returns false if there is no ops array.
+static bool parse_batch(const ApiRequest &req, std::vector<BatchOp> &ops) {
+  if (!req.has(FIELD_OPS))
+    return false;
+
+  // Every op is routed by the same map
+  const PartitionMap *map = partitioner.current();
+
+  ApiOpReader reader(req.ops);
+  ApiRequest element;
+  int read;
+  while ((read = reader.next(&element)) != 0) {
+    BatchOp o;
+    o.op = -1;
+    o.node_a_id = o.node_b_id = 0;
+    o.crosses = false;
+    o.status = ERROR;
+    o.in_graph = false;
+    o.page.limit = UINT64_MAX;
+    o.page.has_after = false;
+
+    for (int i = 0; read > 0 && element.has(FIELD_OP) && i < BATCH_OPS; i++) {
+      if (element.op.is(batch_op_names[i]))
+        o.op = i;
+    }
+
+    if (o.op >= 0 && batch_edge(o) && element.has(FIELD_NODE_A_ID) && element.has(FIELD_NODE_B_ID)) {
+      o.node_a_id = element.node_a_id;
+      o.node_b_id = element.node_b_id;
+      o.status = 0;
+    } else if (o.op >= 0 && !batch_edge(o) && element.has(FIELD_NODE_ID) &&
+               (o.op != BATCH_GET_NEIGHBORS || read_page(element, &o.page))) {
+      o.node_a_id = o.node_b_id = element.node_id;
+      o.status = 0;
+    }
+
+    if (o.status != 0) {
+      o.op = -1;
+    } else {
+      // A write goes to the partition that writes it, a read to any
+      // partition that has it
+      if (o.op == ADD_EDGE || o.op == REMOVE_EDGE) {
+        uint64_t min_node_id = map->lowerNode(o.node_a_id, o.node_b_id);
+        uint64_t max_node_id = map->higherNode(o.node_a_id, o.node_b_id);
+        o.crosses = map->owner(min_node_id) != map->owner(max_node_id);
+        if (o.crosses) {
+          o.node_a_id = min_node_id;
+          o.node_b_id = max_node_id;
+        }
+        o.owner = map->owner(min_node_id);
+      } else if (o.op == BATCH_GET_EDGE && map->owner(o.node_b_id) == (unsigned) (part-1)) {
+        o.owner = part-1;
+      } else {
+        o.owner = map->owner(o.node_a_id);
+      }
+    }
+    ops.push_back(o);
+  }
+  return true;
+}
+
+// The JSON object for an answered op, with statuses mapped as the single
+// op endpoints map them
+static void format_batch_result(BatchOp &o) {
+  char buf[100];
+  int status = o.status;
+
+  if (o.op == BATCH_GET_NODE && status != SUCCESS && status != STALE)
+    status = 404;
+  else if (status != SUCCESS && status != EXISTS && status != ERROR && status != RPC_FAILED && status != STALE)
+    status = 404;
+
+  if (status == SUCCESS && (o.op == BATCH_GET_NODE || o.op == BATCH_GET_EDGE)) {
+    snprintf(buf, sizeof(buf), "{\"status\": %d, \"in_graph\": %s}", status, o.in_graph ? "true" : "false");
+    o.result = buf;
+  } else if (status == SUCCESS && o.op == BATCH_GET_NEIGHBORS) {
+    snprintf(buf, sizeof(buf), "{\"status\": %d, \"node_id\": %lu, \"neighbors\": [", status, o.node_a_id);
+    o.result = buf;
+    o.result += o.neighbors;
+    o.result += "]";
+    if (!o.next_cursor.empty())
+      o.result += ", \"next_cursor\": \"" + o.next_cursor + "\"";
+    o.result += "}";
+  } else {
+    snprintf(buf, sizeof(buf), "{\"status\": %d}", status);
+    o.result = buf;
+  }
+}
+
+// Runs ops[run[first..last)], none of them a cross-partition edge write
+// or a node removal, under a single acquisition of graph_locks
+static void apply_batch_run(Graph *graph, std::vector<BatchOp> &ops,
+                            const std::vector<size_t> &run, size_t first, size_t last) {
+  bool writes = false;
+  for (size_t i = first; i < last; i++)
+    writes = writes || batch_write(ops[run[i]]);
+
+  if (writes)
+    graph_locks.writeLock();
+  else
+    graph_locks.readLock();
+
+  for (size_t i = first; i < last; i++) {
+    BatchOp &o = ops[run[i]];
+    std::pair<int, bool> found;
+    Graph::NeighborIterator it;
+    uint64_t last_id;
+    char cursor[CURSOR_LEN + 1];
+
+    if (batch_write(o) && migration_blocks(graph, o.op, o.node_a_id, o.node_b_id)) {
+      o.status = ERROR;
+      continue;
+    }
+
+    switch (o.op) {
+    case ADD_NODE:
+      o.status = graph->addNode(o.node_a_id);
+      break;
+    case ADD_EDGE:
+      o.status = graph->addEdge(o.node_a_id, o.node_b_id);
+      break;
+    case REMOVE_EDGE:
+      o.status = graph->removeEdge(o.node_a_id, o.node_b_id);
+      break;
+    case BATCH_GET_NODE:
+      found = graph->getNode(o.node_a_id);
+      o.status = std::get<0>(found);
+      o.in_graph = std::get<1>(found);
+      break;
+    case BATCH_GET_EDGE:
+      found = graph->getEdge(o.node_a_id, o.node_b_id);
+      o.status = std::get<0>(found);
+      o.in_graph = std::get<1>(found);
+      break;
+    case BATCH_GET_NEIGHBORS:
+      o.status = graph->findNeighbors(o.node_a_id, &it) ? SUCCESS : ERROR;
+      if (o.status == SUCCESS) {
+        seek_page(&it, o.page);
+        if (append_ids(&o.neighbors, it, o.page.limit, &last_id)) {
+          format_cursor(cursor, last_id);
+          o.next_cursor = cursor;
+        }
+      }
+      break;
+    }
+    if (batch_write(o) && o.status == SUCCESS)
+      chain_append(o.op, o.node_a_id, o.node_b_id);
+  }
+  graph_locks.unlock();
+}
+
+static void batch_step(Batch *b);
+
+// Counts down a relayed leg, or the ops run here, and finishes the batch
+// after the last: fills in the results of the ops whose legs have
+// replied, then calls done and frees the batch
+static void batch_part_done(Batch *b) {
+  pthread_mutex_lock(&b->lock);
+  bool last = --b->pending == 0;
+  pthread_mutex_unlock(&b->lock);
+  if (!last)
+    return;
+
+  std::vector<BatchOp> &ops = b->ops;
+  for (size_t i = 0; i < ops.size(); i++) {
+    if (ops[i].status != 0)
+      format_batch_result(ops[i]);
+  }
+
+  // A leg's reply has one result per line, in the order its ops were sent
+  for (size_t l = 0; l < b->owners.size(); l++) {
+    std::vector<size_t> &leg = b->legs[b->owners[l]];
+    BatchCall &call = b->calls[l];
+    std::vector<std::string> results;
+    if (call.status == SUCCESS) {
+      size_t start = 0, end;
+      while ((end = call.body.find('\n', start)) != std::string::npos) {
+        results.push_back(call.body.substr(start, end - start));
+        start = end + 1;
+      }
+      if (results.size() != leg.size()) {
+        fprintf(stderr, "Batch from partition %u has %zu results for %zu ops \n",
+                b->owners[l]+1, results.size(), leg.size());
+        call.status = RPC_FAILED;
+      }
+    }
+
+    for (size_t i = 0; i < leg.size(); i++) {
+      BatchOp &o = ops[leg[i]];
+      if (call.status == SUCCESS) {
+        o.result.swap(results[i]);
+      } else {
+        o.status = call.status;
+        format_batch_result(o);
+      }
+    }
+  }
+
+  //DEBUG
+  fprintf(stderr, "batch: %zu ops, %zu here, %zu relayed to %zu partitions\n",
+          ops.size(), b->local.size(), ops.size() - b->local.size(), b->legs.size());
+
+  b->done(b);
+  pthread_mutex_destroy(&b->lock);
+  delete b;
+}
+
+// Completion for relay_async
+static void finish_batch_leg(int status, const char *body, int body_len, uint64_t lsn, void *arg) {
+  BatchCall *call = (BatchCall *) arg;
+  call->status = status;
+  call->body.assign(body != NULL ? body : "", body_len);
+  batch_part_done(call->batch);
+}
+
+// Completion for chain_barrier once the ops run here are done
+static void finish_batch_chain(int status, void *arg) {
+  Batch *b = (Batch *) arg;
+  if (status != SUCCESS) {
+    for (size_t i = 0; i < b->local.size(); i++) {
+      BatchOp &o = b->ops[b->local[i]];
+      if (batch_write(o) && o.status == SUCCESS)
+        o.status = status;
+    }
+  }
+  batch_part_done(b);
+}
+
+// Applies the run's edge writes the higher partitions have accepted, under
+// one acquisition of graph_locks, then releases their intents and moves
+// past the run. As in commit_edge_write, a removal is applied here
+// whatever the higher partition found, unless it couldn't be reached.
+static void commit_batch_run(Batch *b) {
+  graph_locks.writeLock();
+  for (size_t i = 0; i < b->edges.size(); i++) {
+    BatchOp &o = b->ops[b->edges[i].second];
+    o.status = b->run_calls[i].status;
+    if (b->reserved[i] && (o.status == SUCCESS || (o.op == REMOVE_EDGE && o.status != RPC_FAILED)))
+      o.status = apply_edge_write(b->graph, o.op, b->edges[i].first.first, b->edges[i].first.second);
+  }
+  graph_locks.unlock();
+
+  for (size_t i = 0; i < b->edges.size(); i++) {
+    if (b->reserved[i])
+      edge_intents.release(b->edges[i].first.first, b->edges[i].first.second);
+  }
+  b->next = b->run_end;
+}
+
+// Counts down the run's replication RPCs. True after the last.
+static bool batch_run_done(Batch *b) {
+  pthread_mutex_lock(&b->lock);
+  bool last = --b->run_pending == 0;
+  pthread_mutex_unlock(&b->lock);
+  return last;
+}
+
+// Completion for propogate_async. After the run's last RPC, commits the
+// run and goes on with the next ops.
+static void finish_batch_edge(int status, void *arg) {
+  BatchCall *call = (BatchCall *) arg;
+  Batch *b = call->batch;
+
+  call->status = status;
+  if (batch_run_done(b)) {
+    commit_batch_run(b);
+    batch_step(b);
+  }
+}
+
+// Starts the replication RPCs of every reserved edge in the run back to
+// back, so EdgeBatcher sends each higher partition one RPC for all of
+// them. Returns true if they had all finished by then and the run is
+// committed; otherwise finish_batch_edge carries on after the last.
+static bool replicate_batch_run(Batch *b) {
+  b->run_pending = 1;
+  for (size_t i = 0; i < b->edges.size(); i++) {
+    if (!b->reserved[i])
+      continue;
+
+    BatchOp &o = b->ops[b->edges[i].second];
+    pthread_mutex_lock(&b->lock);
+    b->run_pending++;
+    pthread_mutex_unlock(&b->lock);
+    int status = propogate_async(o.op, b->edges[i].first.first, b->edges[i].first.second,
+                                 finish_batch_edge, &b->run_calls[i]);
+    if (status != 0) {
+      b->run_calls[i].status = status;
+      batch_run_done(b);
+    }
+  }
+
+  if (!batch_run_done(b))
+    return false;
+  commit_batch_run(b);
+  return true;
+}
+
+// Checks the edge just reserved for the run
+static void batch_edge_reserved(Batch *b) {
+  size_t i = b->reserving++;
+  b->run_calls[i].status = check_edge_write(b->graph, b->edges[i].first.first, b->edges[i].first.second);
+  b->reserved[i] = b->run_calls[i].status == SUCCESS;
+}
+
+// Reserves the run's edges from reserving on. Returns false if one has to
+// wait behind another write to it; batch_edge_granted carries on from
+// there once it is reserved. The run holds the edges before, so those
+// after the first don't queue behind node removals.
+static bool reserve_batch_run(Batch *b);
+
+static void batch_edge_granted(void *arg) {
+  Batch *b = (Batch *) arg;
+  batch_edge_reserved(b);
+  if (reserve_batch_run(b) && replicate_batch_run(b))
+    batch_step(b);
+}
+
+static bool reserve_batch_run(Batch *b) {
+  while (b->reserving < b->edges.size()) {
+    size_t i = b->reserving;
+    bool now;
+    if (i == 0)
+      now = edge_intents.reserve(b->edges[i].first.first, b->edges[i].first.second,
+                                 batch_edge_granted, b);
+    else
+      now = edge_intents.reserveNext(b->edges[i].first.first, b->edges[i].first.second,
+                                     batch_edge_granted, b);
+    if (!now)
+      return false;
+    batch_edge_reserved(b);
+  }
+  return true;
+}
+
+// Writes local[next..run_end), cross-partition edge writes on distinct
+// edges, together: their intents are all reserved, then their replication
+// RPCs sent, then the accepted writes applied. Intents are reserved in
+// edge order, so two batches can't each hold an edge the other is waiting
+// for. Returns true if the run is already committed, and false if it has
+// to wait; it then carries on by itself.
+static bool start_batch_run(Batch *b) {
+  b->edges.clear();
+  for (size_t i = b->next; i < b->run_end; i++) {
+    BatchOp &o = b->ops[b->local[i]];
+    b->edges.push_back(std::make_pair(std::make_pair(o.node_a_id, o.node_b_id), b->local[i]));
+  }
+  std::sort(b->edges.begin(), b->edges.end());
+
+  BatchCall call;
+  call.batch = b;
+  call.status = 0;
+  b->run_calls.assign(b->edges.size(), call);
+  b->reserved.assign(b->edges.size(), false);
+  b->reserving = 0;
+
+  return reserve_batch_run(b) && replicate_batch_run(b);
+}
+
+// Removes the node of the op at next, whose reservation is held, and
+// moves past it
+static void remove_batch_node(Batch *b) {
+  BatchOp &o = b->ops[b->local[b->next]];
+  o.status = write_node(b->graph, REMOVE_NODE, o.node_a_id);
+  edge_intents.releaseNode(o.node_a_id);
+  b->next++;
+}
+
+// Completion for a node reservation the batch had to wait for
+static void batch_node_granted(void *arg) {
+  Batch *b = (Batch *) arg;
+  remove_batch_node(b);
+  batch_step(b);
+}
+
+// Runs the ops kept here from next on, until one has to wait or all are
+// done: node removals one at a time, since each waits out edges to its
+// node still in flight; runs of consecutive cross-partition edge writes on
+// distinct edges with start_batch_run; and runs of anything else with
+// apply_batch_run. Once all are done and any write among them has reached
+// the tail of the chain, they count as one part of the batch done.
+static void batch_step(Batch *b) {
+  std::vector<BatchOp> &ops = b->ops;
+  std::vector<size_t> &local = b->local;
+
+  while (b->next < local.size()) {
+    size_t i = b->next;
+    size_t j = i + 1;
+    BatchOp &o = ops[local[i]];
+    if (o.op == REMOVE_NODE) {
+      if (!edge_intents.reserveNode(o.node_a_id, batch_node_granted, b))
+        return;
+      remove_batch_node(b);
+    } else if (o.crosses) {
+      std::set<std::pair<uint64_t, uint64_t> > edges;
+      edges.insert(std::make_pair(o.node_a_id, o.node_b_id));
+      for (; j < local.size() && ops[local[j]].crosses; j++) {
+        BatchOp &next = ops[local[j]];
+        if (!edges.insert(std::make_pair(next.node_a_id, next.node_b_id)).second)
+          break;
+      }
+      b->run_end = j;
+      if (!start_batch_run(b))
+        return;
+    } else {
+      for (; j < local.size() && ops[local[j]].op != REMOVE_NODE && !ops[local[j]].crosses; j++)
+        ;
+      apply_batch_run(b->graph, ops, local, i, j);
+      b->next = j;
+    }
+  }
+
+  bool writes = false;
+  for (size_t i = 0; i < local.size(); i++)
+    writes = writes || (batch_write(ops[local[i]]) && ops[local[i]].status == SUCCESS);
+  if (writes && chain_barrier(finish_batch_chain, b) == 0)
+    return;
+  batch_part_done(b);
+}
+
+// The body of the sub-batch relayed to another partition
+static std::string batch_leg_json(const ApiRequest &req, const std::vector<BatchOp> &ops,
+                                  const std::vector<size_t> &leg) {
+  char buf[160];
+  std::string json = "{\"ops\": [";
+  for (size_t i = 0; i < leg.size(); i++) {
+    const BatchOp &o = ops[leg[i]];
+    if (batch_edge(o))
+      snprintf(buf, sizeof(buf), "%s{\"op\": \"%s\", \"node_a_id\": %lu, \"node_b_id\": %lu",
+               i > 0 ? ", " : "", batch_op_names[o.op], o.node_a_id, o.node_b_id);
+    else
+      snprintf(buf, sizeof(buf), "%s{\"op\": \"%s\", \"node_id\": %lu",
+               i > 0 ? ", " : "", batch_op_names[o.op], o.node_a_id);
+    json += buf;
+
+    if (o.op == BATCH_GET_NEIGHBORS && o.page.limit != UINT64_MAX) {
+      snprintf(buf, sizeof(buf), ", \"limit\": %lu", o.page.limit);
+      json += buf;
+    }
+    if (o.op == BATCH_GET_NEIGHBORS && o.page.has_after) {
+      json += ", \"cursor\": \"";
+      format_cursor(buf, o.page.after);
+      json += buf;
+      json += "\"";
+    }
+    json += "}";
+  }
+  json += "]";
+
+  if (req.has(FIELD_MIN_LSN)) {
+    snprintf(buf, sizeof(buf), ", \"min_lsn\": %lu", req.min_lsn);
+    json += buf;
+  }
+  json += "}";
+  return json;
+}
+
+// Runs a batch and fills in every op's result. Ops owned by another
+// partition are relayed to its head as one sub-batch per partition, as
+// are this partition's ops if this isn't the head and any of them write.
+// The ops kept here run while those are in flight. A batch relayed here
+// (relayed is true) never relays again; ops the partition map has since
+// moved fail with 400.
+//
+// Ops run in request order within each partition, and a write's result
+// is sent once it has reached the tail of its chain. Nothing is ordered
+// across partitions, and a batch is not atomic: each op succeeds or fails
+// on its own.
+//
+// Nothing here blocks. It returns once the legs are sent and the ops kept
+// here have gone as far as they can without waiting, and b->done is
+// called, maybe before then, once every op has its result.
+static void run_batch(Batch *b, const ApiRequest &req, bool relayed) {
+  std::vector<BatchOp> &ops = b->ops;
+  bool reads = false;
+
+  // Off the head, reads go with the writes so they stay in order
+  bool to_head = false;
+  for (size_t i = 0; i < ops.size() && !head; i++)
+    to_head = to_head || (ops[i].status == 0 && ops[i].owner == (unsigned) (part-1) && batch_write(ops[i]));
+
+  for (size_t i = 0; i < ops.size(); i++) {
+    BatchOp &o = ops[i];
+    if (o.status != 0)
+      continue;
+    if (o.owner != (unsigned) (part-1) || to_head) {
+      if (relayed) {
+        fprintf(stderr, "BAD REQUEST: Relayed batch op %s sent to the wrong server \n", batch_op_names[o.op]);
+        o.status = ERROR;
+      } else {
+        b->legs[o.owner].push_back(i);
+      }
+    } else {
+      reads = reads || !batch_write(o);
+      b->local.push_back(i);
+    }
+  }
+
+  // Freshness is checked once for the whole batch
+  if (reads && too_stale(req)) {
+    std::vector<size_t> writes;
+    for (size_t i = 0; i < b->local.size(); i++) {
+      if (batch_write(ops[b->local[i]]))
+        writes.push_back(b->local[i]);
+      else
+        ops[b->local[i]].status = STALE;
+    }
+    b->local.swap(writes);
+  }
+
+  pthread_mutex_init(&b->lock, NULL);
+  b->pending = b->legs.size() + 1;
+  b->next = 0;
+
+  BatchCall call;
+  call.batch = b;
+  call.status = RPC_FAILED;
+  b->calls.assign(b->legs.size(), call);
+
+  // The legs' bodies are built before any is sent, since a leg that
+  // replies at once could otherwise finish the batch under this loop
+  std::vector<std::string> bodies;
+  for (std::map<unsigned, std::vector<size_t> >::iterator it = b->legs.begin(); it != b->legs.end(); ++it) {
+    b->owners.push_back(it->first);
+    bodies.push_back(batch_leg_json(req, ops, it->second));
+  }
+  for (size_t l = 0; l < b->owners.size(); l++) {
+    fprintf(stderr, "Relaying %zu batch ops to partition %u \n", b->legs[b->owners[l]].size(), b->owners[l]+1);
+    if (relay_async(b->owners[l], "/api/v1/batch", bodies[l].data(), (int) bodies[l].size(),
+                    finish_batch_leg, &b->calls[l]) != 0)
+      batch_part_done(b);
+  }
+
+  batch_step(b);
+}
+
+// Completion for a leg run by serve_batch_leg: sends back its results,
+// one per line
+static void finish_served_leg(Batch *b) {
+  std::string body;
+  for (size_t i = 0; i < b->ops.size(); i++) {
+    body.append(b->ops[i].result);
+    body.push_back('\n');
+  }
+  b->relayed(SUCCESS, body.data(), (int) body.size(), write_log.lsn(), b->arg);
+}
+
+// Runs a leg of a batch relayed here by run_batch
+static void serve_batch_leg(Graph *graph, const ApiRequest &req, RelayCallback done, void *arg) {
+  Batch *b = new Batch();
+  if (!parse_batch(req, b->ops)) {
+    delete b;
+    done(ERROR, NULL, 0, write_log.lsn(), arg);
+    return;
+  }
+
+  b->graph = graph;
+  b->done = finish_served_leg;
+  b->relayed = done;
+  b->arg = arg;
+  run_batch(b, req, true);
+}
+
+// Writes an edge for a relayed request: one within this partition at
+// once, and one crossing partitions by reserving and replicating it as
+// add_edge does
+static void serve_relayed_edge(Graph *graph, int op, uint64_t node_a_id, uint64_t node_b_id,
+                               RelayCallback done, void *arg) {
+  const PartitionMap *map = partitioner.current();
+  uint64_t max_node_id = map->higherNode(node_a_id, node_b_id);
+  uint64_t min_node_id = map->lowerNode(node_a_id, node_b_id);
+  PendingWrite *w = relayed_write(graph, op, min_node_id, max_node_id, done, arg);
+
+  if (map->owner(node_a_id) == part-1 && map->owner(node_b_id) == part-1) {
+    w->reply.status = write_local_edge(graph, op, node_a_id, node_b_id);
+    reply_after_chain(w);
+  } else if (map->owner(min_node_id) != part-1) {
+    w->reply.status = ERROR;
+    w->reply.lsn = write_log.lsn();
+    queue_reply(w);
+  } else if (edge_intents.reserve(min_node_id, max_node_id, start_edge_write, w)) {
+    start_edge_write(w);
+  }
+}
+
+// Answers a request another server relayed here with relay_request, by
+// calling done with the reply, maybe before it returns. It runs on an RPC
+// thread and defers a write's reply as the HTTP handlers do, so nothing
+// here waits on a replication RPC or the chain. It never relays the
+// request on again: a write the partition map has moved elsewhere
+// meanwhile fails with ERROR, and the server that relayed it sends it to
+// the new owner. The body is the JSON reply of a successful read.
+void serve_relayed(Graph *graph, const char *uri, const char *json, int json_len,
+                   RelayCallback done, void *arg) {
+  ApiRequest req;
+  int status = ERROR;
+  std::string body;
+  char buf[1000];
+  int json_buf_size = 0;
+
+  if (!req.parse(json, json_len)) {
+    done(ERROR, NULL, 0, write_log.lsn(), arg);
+    return;
+  }
+
+  if (strcmp(uri, "/api/v1/batch") == 0) {
+    serve_batch_leg(graph, req, done, arg);
+    return;
+  }
+
+  bool has_a = req.has(FIELD_NODE_ID) || req.has(FIELD_NODE_A_ID);
+  uint64_t node_a_id = req.has(FIELD_NODE_ID) ? req.node_id : req.node_a_id;
+  uint64_t node_b_id = req.node_b_id;
+
+  bool node_write = strcmp(uri, "/api/v1/add_node") == 0 || strcmp(uri, "/api/v1/remove_node") == 0;
+  bool edge_write = strcmp(uri, "/api/v1/add_edge") == 0 || strcmp(uri, "/api/v1/remove_edge") == 0;
+  bool edge = edge_write || strcmp(uri, "/api/v1/get_edge") == 0;
+
+  if (!has_a || (edge && !req.has(FIELD_NODE_B_ID))) {
+    status = ERROR;
+  } else if ((node_write || edge_write) && !head) {
+    fprintf(stderr, "BAD REQUEST: Relayed write sent to a replica \n");
+    status = ERROR;
+  } else if (node_write && partitioner.owner(node_a_id) != (unsigned) (part-1)) {
+    fprintf(stderr, "BAD REQUEST: Relayed write for a node partition %u owns \n",
+            partitioner.owner(node_a_id)+1);
+    status = ERROR;
+  } else if (strcmp(uri, "/api/v1/add_node") == 0) {
+    PendingWrite *w = relayed_write(graph, ADD_NODE, node_a_id, node_a_id, done, arg);
+    w->reply.status = write_node(graph, ADD_NODE, node_a_id);
+
+    //DEBUG
+    fprintf(stderr, "relayed %s = %d\n", uri, w->reply.status);
+
+    reply_after_chain(w);
+    return;
+  } else if (strcmp(uri, "/api/v1/remove_node") == 0) {
+    PendingWrite *w = relayed_write(graph, REMOVE_NODE, node_a_id, node_a_id, done, arg);
+    if (edge_intents.reserveNode(node_a_id, finish_node_removal, w))
+      finish_node_removal(w);
+    return;
+  } else if (edge_write) {
+    serve_relayed_edge(graph, strcmp(uri, "/api/v1/add_edge") == 0 ? ADD_EDGE : REMOVE_EDGE,
+                       node_a_id, node_b_id, done, arg);
+    return;
+  } else if (too_stale(req)) {
+    status = STALE;
+  } else if (strcmp(uri, "/api/v1/get_node") == 0) {
+    graph_locks.readLock();
+    std::pair<int, bool> result = graph->getNode(node_a_id);
+    graph_locks.unlock();
+    status = std::get<0>(result);
+    json_buf_size = json_emit(buf, sizeof(buf), std::get<1>(result) ? "{s : T}" : "{s : F}", "in_graph");
+  } else if (strcmp(uri, "/api/v1/get_edge") == 0) {
+    graph_locks.readLock();
+    std::pair<int, bool> result = graph->getEdge(node_a_id, node_b_id);
+    graph_locks.unlock();
+    status = std::get<0>(result);
+    json_buf_size = json_emit(buf, sizeof(buf), std::get<1>(result) ? "{s : T}" : "{s : F}", "in_graph");
+  } else if (strcmp(uri, "/api/v1/get_neighbors") == 0) {
+    NeighborPage page;
+    Graph::NeighborIterator it;
+    uint64_t last;
+    if (!read_page(req, &page)) {
+      status = ERROR;
+    } else {
+      graph_locks.readLock();
+      status = graph->findNeighbors(node_a_id, &it) ? SUCCESS : ERROR;
+      if (status == SUCCESS) {
+        seek_page(&it, page);
+        body.append(buf, snprintf(buf, sizeof(buf), "{\"node_id\" : %lu, \"neighbors\" : [", node_a_id));
+        bool more = append_ids(&body, it, page.limit, &last);
+        body.append("]");
+        if (more) {
+          body.append(", \"next_cursor\" : \"");
+          format_cursor(buf, last);
+          body.append(buf, CURSOR_LEN);
+          body.append("\"");
+        }
+        body.append("}");
+      }
+      graph_locks.unlock();
+    }
+  }
+  assert(json_buf_size >= 0 && (size_t) json_buf_size <= sizeof(buf));
+
+  //DEBUG
+  fprintf(stderr, "relayed %s = %d\n", uri, status);
+
+  if (status == SUCCESS && json_buf_size > 0)
+    body.assign(buf, json_buf_size);
+  done(status, body.data(), (int) body.size(), write_log.lsn(), arg);
+}
+
+// Completion for a batch run by the HTTP handler: hands the reply to the
+// event loop
+static void reply_batch(Batch *b) {
+  PendingWrite *w = (PendingWrite *) b->arg;
+
+  std::string json = "{\"results\": [";
+  for (size_t i = 0; i < b->ops.size(); i++) {
+    if (i > 0)
+      json += ", ";
+    json += b->ops[i].result;
+  }
+  json += "]}";
+
+  w->reply.status = SUCCESS;
+  w->reply.lsn = write_log.lsn();
+  w->reply.json_len = (int) json.size();
+  if (json.size() > REPLY_JSON_SIZE) {
+    w->reply.long_json = (char *) malloc(json.size());
+    memcpy(w->reply.long_json, json.data(), json.size());
   } else {
-    mg_printf(nc, "HTTP/1.1 404 Not Found\r\n");
+    memcpy(w->reply.json, json.data(), json.size());
   }
+  queue_reply(w);
+}
 
-  free(arr);
+// Runs a JSON array of mixed ops in one request:
+//
+//   {"ops": [{"op": "add_node", "node_id": 1},
+//            {"op": "add_edge", "node_a_id": 1, "node_b_id": 2},
+//            {"op": "get_neighbors", "node_id": 1}]}
+//
+// and answers with one result per op, in order, each with the status the
+// op's own endpoint would have replied with and the fields of its body:
+//
+//   {"results": [{"status": 200}, {"status": 200},
+//                {"status": 200, "node_id": 1, "neighbors": [2]}]}
+//
+// get_neighbors ops take limit and cursor as the endpoint does. min_lsn
+// applies to every read. A malformed op gets status 400 without failing
+// the rest. X-LSN is this partition's LSN once the batch is done.
+static void batch(struct mg_connection *nc, struct http_message *hm, void *user_data) {
+  Data *data = (Data *) user_data;
+  Graph *graph = data->graph;
+
+  ApiRequest req;
+  std::vector<BatchOp> ops;
+
+  if (!req.parse(hm->body.p, (int) hm->body.len)) {
+    send_bad_request(nc, "Error in JSON");
+    return;
+  }
+
+  if (!parse_batch(req, ops)) {
+    send_bad_request(nc, "Could not find ops array in JSON");
+    return;
+  }
+
+  if (ops.size() > BATCH_MAX_OPS) {
+    send_bad_request(nc, "Too many ops in batch");
+    return;
+  }
+
+  PendingWrite *w = defer_write(nc, hm->body.p, 0);
+
+  Batch *b = new Batch();
+  b->graph = graph;
+  b->ops.swap(ops);
+  b->done = reply_batch;
+  b->arg = w;
+  run_batch(b, req, false);
+}
+
+// A cluster shortest_path search, queued for a search worker
+typedef struct {
+  Graph *graph;
+  uint64_t node_a_id;
+  uint64_t node_b_id;
+  PendingWrite *w;
+} ClusterSearch;
+
+// Cluster searches run on a fixed set of worker threads. Searches beyond
+// what the queue holds are refused with a 503, so a burst of them can't
+// pile up threads, each with RPCs in flight to every partition.
+#define SEARCH_WORKERS 8
+#define SEARCH_QUEUE 64
+
+static ClusterSearch *search_queue[SEARCH_QUEUE];
+static unsigned search_first;
+static unsigned search_count;
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t search_ready;
+
+// Runs a cluster search, whose supersteps wait on RPCs to every partition
+// it reaches, and hands its reply to the event loop that deferred it
+static void run_cluster_search(ClusterSearch *search) {
+  PendingWrite *w = search->w;
+  uint64_t distance = 0;
+  char distance_buf[22];
+
+  int status = distributed_shortest_path(search->graph, search->node_a_id, search->node_b_id, &distance);
+
+  //DEBUG
+  fprintf(stderr, "shortest_path: %lu, %lu = %d\n", search->node_a_id, search->node_b_id, status);
+
+  snprintf(distance_buf, sizeof(distance_buf), "%lu", distance);
+  w->reply.json_len = json_emit(w->reply.json, REPLY_JSON_SIZE, "{s : S}", "distance", distance_buf);
+  assert(w->reply.json_len >= 0 && w->reply.json_len <= REPLY_JSON_SIZE);
+  w->reply.status = status;
+  w->reply.lsn = write_log.lsn();
+  queue_reply(w);
+
+  free(search);
+}
+
+static void *search_worker(void *v) {
+  for (;;) {
+    if (sem_wait(&search_ready) != 0)
+      continue;
+
+    pthread_mutex_lock(&search_lock);
+    ClusterSearch *search = search_queue[search_first];
+    search_first = (search_first + 1) % SEARCH_QUEUE;
+    search_count--;
+    pthread_mutex_unlock(&search_lock);
+
+    run_cluster_search(search);
+  }
+
+  return NULL;
+}
+
+// Hands a search to the workers. False if the queue is full.
+static bool queue_cluster_search(ClusterSearch *search) {
+  pthread_mutex_lock(&search_lock);
+  if (search_count == SEARCH_QUEUE) {
+    pthread_mutex_unlock(&search_lock);
+    return false;
+  }
+  search_queue[(search_first + search_count) % SEARCH_QUEUE] = search;
+  search_count++;
+  pthread_mutex_unlock(&search_lock);
+
+  sem_post(&search_ready);
+  return true;
+}
+
+static void init_search_workers() {
+  sem_init(&search_ready, 0, 0);
+  for (int i = 0; i < SEARCH_WORKERS; i++) {
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, search_worker, NULL)) {
+      fprintf(stderr, "Error creating thread\n");
+      exit(1);
+    }
+    pthread_detach(worker);
+  }
 }
 
 static void shortest_path(struct mg_connection *nc, struct http_message *hm, void *user_data) {
@@ -529,43 +2235,102 @@ static void shortest_path(struct mg_connection *nc, struct http_message *hm, voi
   const char *json = hm->body.p;
   int json_len = (int) hm->body.len;
 
-  struct json_token *arr, *tok, *tok1;
+  ApiRequest req;
   std::pair<int, uint64_t> result;
   int status;
-  uint64_t distance;
+  uint64_t distance = 0;
+  SearchMode mode = SEARCH_AUTO;
+  bool cluster = true;
 
   char buf[1000];
   int json_buf_size = sizeof(buf);
 
   char distance_buf[22];
 
-  arr = parse_json2(json, json_len);
-  if (arr == NULL) {
-    mg_printf(nc, "Error in JSON\n");
-    free(arr);
+  if (!req.parse(json, json_len)) {
+    send_bad_request(nc, "Error in JSON");
+    return;
+  }
+
+  if (!req.has(FIELD_NODE_A_ID)) {
+    send_bad_request(nc, "Could not find node_id in JSON");
+    return;
+  }
+
+  if (!req.has(FIELD_NODE_B_ID)) {
+    send_bad_request(nc, "Could not find node_b_id in JSON");
     return;
   }
 
-  tok = find_json_token(arr, "node_a_id");
-  if (tok == NULL) {
-    mg_printf(nc, "Could not find node_id in JSON\n");
-    free(arr);
+  // Optional search strategy, defaults to auto
+  if (req.has(FIELD_MODE)) {
+    if (req.mode.is("forward")) {
+      mode = SEARCH_FORWARD;
+    } else if (req.mode.is("bidirectional")) {
+      mode = SEARCH_BIDIRECTIONAL;
+    } else if (req.mode.is("direction_optimizing")) {
+      mode = SEARCH_DIRECTION_OPTIMIZING;
+    } else if (req.mode.is("parallel")) {
+      mode = SEARCH_PARALLEL;
+    } else if (!req.mode.is("auto")) {
+      send_status(nc, ERROR);
+        return;
+    }
+  }
+
+  // Optional search scope, defaults to the whole cluster. "partition" only
+  // follows edges stored in this partition, and is where mode applies.
+  if (req.has(FIELD_SCOPE)) {
+    if (req.scope.is("partition")) {
+      cluster = false;
+    } else if (!req.scope.is("cluster")) {
+      send_status(nc, ERROR);
+        return;
+    }
+  }
+
+  // A cluster search expands one partition's share of the frontier at a
+  // time, so no strategy but auto applies to it. With one partition every
+  // edge is here and the local search answers for the cluster.
+  if (cluster && partitioner.size() == 1) {
+    cluster = false;
+  } else if (cluster && mode != SEARCH_AUTO) {
+    send_status(nc, ERROR);
     return;
   }
 
-  tok1 = find_json_token(arr, "node_b_id");
-  if (tok1 == NULL) {
-    mg_printf(nc, "Could not find node_b_id in JSON\n");
-    free(arr);
+  // A cluster search takes the read lock only around local expansion:
+  // it makes RPCs, and so may the partitions it calls into. It runs on a
+  // search worker with the reply deferred, so the event loop never waits
+  // on those RPCs.
+  if (cluster) {
+    ClusterSearch *search = (ClusterSearch *) malloc(sizeof(ClusterSearch));
+    search->graph = graph;
+    search->node_a_id = req.node_a_id;
+    search->node_b_id = req.node_b_id;
+    search->w = defer_write(nc, hm->body.p, 0);
+
+    if (queue_cluster_search(search))
+      return;
+
+    release_reply(nc);
+    free(search->w);
+    free(search);
+    send_status(nc, STALE);
     return;
   }
 
-  result = graph->shortestPath(strtoull(tok->ptr, NULL, 10), strtoull(tok1->ptr, NULL, 10));
+  graph_locks.readLock();
+  result = graph->shortestPath(req.node_a_id, req.node_b_id, mode);
+  graph_locks.unlock();
   status = std::get<0>(result);
   distance = std::get<1>(result);
 
   //DEBUG
-  fprintf(stderr, "shortest_path: %.*s, %.*s = %d\n", tok->len, tok->ptr, tok1->len, tok1->ptr, status);
+  fprintf(stderr, "shortest_path: %lu, %lu = %d\n", req.node_a_id, req.node_b_id, status);
+  fprintf(stderr, "shortest_path: visited %lu, edges checked %lu, levels %s\n",
+    Graph::lastSearchStats().visited, Graph::lastSearchStats().edges_checked,
+    Graph::lastSearchStats().levels.c_str());
 
   snprintf(distance_buf, sizeof(distance_buf), "%lu", distance);
 
@@ -578,15 +2343,21 @@ static void shortest_path(struct mg_connection *nc, struct http_message *hm, voi
                   "Content-Type: application/json\r\n"
                   "\r\n%.*s", status, json_buf_size, json_buf_size, buf); 
     
-  } else if (status == EXISTS) {
-    mg_printf(nc, "HTTP/1.1 204 OK\r\n");
-  } else if (status == ERROR) {
-    mg_printf(nc, "HTTP/1.1 400 Bad Request\r\n");
   } else {
-    mg_printf(nc, "HTTP/1.1 404 Not Found\r\n");
+    send_status(nc, status);
   }
+}
 
-  free(arr);
+// Keep-alive connections left idle this long are closed
+#define IDLE_TIMEOUT_S 60
+
+// HTTP/1.1 connections are persistent unless the client says otherwise;
+// HTTP/1.0 ones only if it asks
+static bool wants_close(struct http_message *hm) {
+  struct mg_str *connection = mg_get_http_header(hm, "Connection");
+  if (connection != NULL)
+    return mg_vcasecmp(connection, "close") == 0;
+  return mg_vcmp(&hm->proto, "HTTP/1.1") != 0;
 }
 
 static void ev_handler(struct mg_connection *nc, int ev, void *ev_data) {
@@ -596,7 +2367,8 @@ static void ev_handler(struct mg_connection *nc, int ev, void *ev_data) {
     struct http_message *hm = (struct http_message *) ev_data;
     struct mg_str *uri = &(hm->uri);
 
-    pthread_mutex_lock(&mutex);
+    // Handlers take graph_locks themselves, and relay requests owned by
+    // another partition, or writes when this isn't the head, to its head
 
     if (mg_vcmp(uri, "/api/v1/add_node") == 0) {
       add_node(nc, hm, nc->mgr->user_data);
@@ -612,41 +2384,142 @@ static void ev_handler(struct mg_connection *nc, int ev, void *ev_data) {
       get_edge(nc, hm, nc->mgr->user_data);
     } else if (mg_vcmp(uri, "/api/v1/get_neighbors") == 0) {
       get_neighbors(nc, hm, nc->mgr->user_data);
+    } else if (mg_vcmp(uri, "/api/v1/batch") == 0) {
+      batch(nc, hm, nc->mgr->user_data);
     } else if (mg_vcmp(uri, "/api/v1/shortest_path") == 0) {
       shortest_path(nc, hm, nc->mgr->user_data);
     } else {
-      mg_printf(nc, "HTTP/1.1 404 Not Found\r\n");
+      send_status(nc, 404);
     }
 
-    pthread_mutex_unlock(&mutex); 
+    // The connection stays open for more requests unless the client
+    // asked to close it
+    if (wants_close(hm)) {
+      if (nc->user_data == NULL)
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+      else
+        nc->flags |= MG_F_CLOSE_AFTER_REPLY;
+    }
 
+  } else if (ev == MG_EV_POLL && nc->listener != NULL && nc->user_data == NULL &&
+             *(time_t *) ev_data - nc->last_io_time > IDLE_TIMEOUT_S) {
     nc->flags |= MG_F_SEND_AND_CLOSE;
   }
 }
 
+// HTTP event loops, set with -e. With more than one, each has its own
+// listening socket on the port, bound with SO_REUSEPORT, and the kernel
+// spreads new connections over them. Handlers take graph_locks and queue
+// deferred replies to the loop that owns the connection, so loops share
+// nothing else.
+static int http_threads = 1;
+
+// A listening socket on port ("8000" or "host:8000") that other event
+// loops can bind as well; -1 on error
+static int listen_reuseport(const char *port) {
+  std::string host;
+  const char *colon = strrchr(port, ':');
+  if (colon != NULL) {
+    host.assign(port, colon - port);
+    port = colon + 1;
+  }
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(host.empty() ? NULL : host.c_str(), port, &hints, &res) != 0)
+    return -1;
+
+  int on = 1;
+  int fd = socket(res->ai_family, SOCK_STREAM, 0);
+  if (fd >= 0 &&
+      (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+       setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+       bind(fd, res->ai_addr, res->ai_addrlen) != 0 ||
+       listen(fd, SOMAXCONN) != 0)) {
+    perror("listen_reuseport");
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+static void *serve_http(void *v) {
+  struct mg_mgr *mgr = (struct mg_mgr *) v;
+
+  for (;;) {
+    mg_mgr_poll(mgr, 1000);
+  }
+  return NULL;
+}
+
 int main(int argc, char *argv[]) {
 
-  if (argc != 8) {
+  if (argc < 6) {
     fprintf(stderr, 
-      "Usage: ./cs426_graph_server <graph_server_port> -p <partnum> -l <partlist> \n");
+      "Usage: ./cs426_graph_server <graph_server_port> -p <partnum> "
+      "(-l <partlist> | -c <config> [-n <replica> | -f <replica> [-s <max_staleness_ms>]]) "
+      "[-a <alpha>] [-b <beta>] [-t <search_threads>] [-r <rpc_threads>] [-e <http_threads>] \n");
     return 1;
   }
 
   // Parse arguments
   char *port;
+  char *first_host = NULL;
+  char *config = NULL;
+  int follow = 0;
   int c;
 
-  while ((c = getopt(argc, argv, "p:l:")) != -1)
+  // Direction-optimizing BFS switching thresholds
+  SearchTuning tuning;
+  tuning.alpha = 14;
+  tuning.beta = 24;
+
+  // Parallel BFS workers, 1 disables the pool
+  int search_threads = 1;
+
+  while ((c = getopt(argc, argv, "p:l:c:n:f:s:a:b:t:r:e:")) != -1)
     switch (c)
       {
       case 'p':
         part = atoi(optarg);
         break;
       case 'l':
-        ip1 = optarg;
+        first_host = optarg;
+        break;
+      case 'c':
+        config = optarg;
+        break;
+      case 'n':
+        replica = atoi(optarg);
+        break;
+      case 'f':
+        follow = atoi(optarg);
+        break;
+      case 's':
+        max_staleness_ms = strtoull(optarg, NULL, 10);
+        break;
+      case 'a':
+        tuning.alpha = atoi(optarg);
+        break;
+      case 'b':
+        tuning.beta = atoi(optarg);
+        break;
+      case 't':
+        search_threads = atoi(optarg);
+        break;
+      case 'r':
+        rpc_threads = atoi(optarg);
+        break;
+      case 'e':
+        http_threads = atoi(optarg);
         break;
       case '?':
-        if (optopt == 'p')
+        if (optopt == 'p' || optopt == 'l' || optopt == 'c' || optopt == 'n' || optopt == 'f' || optopt == 's' || optopt == 'a' || optopt == 'b' || optopt == 't' ||
+            optopt == 'r' || optopt == 'e')
           fprintf(stderr, "Option -%c requires an argument. \n", optopt);
         else if (isprint (optopt))
           fprintf(stderr, "Unknown option '-%c'.\n", optopt);
@@ -660,60 +2533,158 @@ int main(int argc, char *argv[]) {
         abort();
       }
 
-  if (argc - optind != 3) {
-    fprintf(stderr, "Incorrect number of arguments\n");
+  // Partition hosts come from the config file, or follow -l on the
+  // command line after the port
+  if (config != NULL) {
+    if (argc - optind != 1) {
+      fprintf(stderr, "Incorrect number of arguments\n");
+      return 1;
+    }
+    if (partitioner.load(config) != SUCCESS)
+      return 1;
+    config_path = config;
+    port = argv[optind];
+  } else {
+    if (first_host == NULL || argc - optind < 2) {
+      fprintf(stderr, "Incorrect number of arguments\n");
+      return 1;
+    }
+    port = argv[optind++];
+    std::vector<std::string> hosts(1, first_host);
+    while (optind < argc)
+      hosts.push_back(argv[optind++]);
+    partitioner.setHosts(hosts);
+  }
+
+  if (http_threads < 1) {
+    fprintf(stderr, "Need at least one HTTP thread\n");
     return 1;
   }
-  
-  port = argv[optind++];
-  ip2 = argv[optind++];
-  ip3 = argv[optind];
-  fprintf(stderr, "Port: %s, part: %d, address1: %s, address2: %s, address3: %s\n", 
-    port, part, ip1, ip2, ip3);
-
-  ip_list = (char **) malloc(3* sizeof(char *));
-  ip_list[0] = ip1;
-  ip_list[1] = ip2;
-  ip_list[2] = ip3;
-  rpc_port = strchr(ip_list[part-1], ':');
+
+  if (part < 1 || part > (int) partitioner.size()) {
+    fprintf(stderr, "Partition %d out of range 1-%u\n", part, partitioner.size());
+    return 1;
+  }
+
+  // A read replica takes the place of the replica it follows in checks
+  // against the config, but is not part of the chain
+  if (follow != 0)
+    replica = follow;
+
+  const PartitionMap *map = partitioner.current();
+  if (replica < 1 || replica > (int) map->replicas(part-1)) {
+    fprintf(stderr, "Replica %d out of range 1-%u\n", replica, map->replicas(part-1));
+    return 1;
+  }
+  if (follow != 0) {
+    head = tail = 0;
+    ip_next = NULL;
+    ip_upstream = strdup(map->replica(part-1, replica-1));
+  } else {
+    head = replica == 1;
+    tail = replica == (int) map->replicas(part-1);
+    ip_next = tail ? NULL : strdup(map->replica(part-1, replica));
+  }
+
+  fprintf(stderr, "Port: %s, part: %d of %u, replica %d of %u\n", port, part, partitioner.size(),
+          replica, map->replicas(part-1));
+  for (unsigned p = 0; p < partitioner.size(); p++)
+    fprintf(stderr, "address%u: %s\n", p+1, partitioner.host(p));
+  if (ip_next != NULL)
+    fprintf(stderr, "next replica: %s\n", ip_next);
+  if (ip_upstream != NULL)
+    fprintf(stderr, "read replica of %s, at most %lu ms behind\n", ip_upstream, max_staleness_ms);
+  if (http_threads > 1)
+    fprintf(stderr, "HTTP event loops: %d\n", http_threads);
+
+  rpc_port = strchr(map->replica(part-1, replica-1), ':');
 
   // Create new graph
   Graph *graph = new Graph();
+  graph->setSearchTuning(tuning);
+  graph->setSearchThreads(search_threads);
+
+  // Channels to the other partitions, kept for the life of the server
+  init_peers();
+
+  // Stream to the next replica, if this isn't the tail, or on a read
+  // replica, from the one it follows
+  if (ip_upstream != NULL)
+    init_follower(graph);
+  else
+    init_chain();
+
+  if (config_path != NULL) {
+    sem_init(&reload_requested, 0, 0);
+    signal(SIGHUP, request_reload);
+
+    pthread_t reload_thread;
+    if (pthread_create(&reload_thread, NULL, reload_partitions, graph)) {
+      fprintf(stderr, "Error creating thread\n");
+      return 1;
+    }
+  }
 
-  // RPC Server
+  // RPC Server; a read replica's port belongs to the replica it follows
   pthread_t rpc_thread;
 
-  if (pthread_create(&rpc_thread, NULL, RunServer, graph)) {
+  if (ip_upstream == NULL && pthread_create(&rpc_thread, NULL, RunServer, graph)) {
     fprintf(stderr, "Error creating thread\n");
     return 1;
   }
 
-  // HTTP Server
-  Data *data = (Data *) malloc(sizeof(Data));
-  data->graph = graph;
-
-  struct mg_mgr mgr;
-  struct mg_connection *nc;
-
-  mg_mgr_init(&mgr, (void *) data);
+  // Threads that run cluster searches
+  init_search_workers();
 
-  nc = mg_bind(&mgr, port, ev_handler);
+  // Background compaction
+  pthread_t compact_thread;
 
-  if (nc == NULL) {
-    printf("Failed to create listener\n");
+  if (pthread_create(&compact_thread, NULL, compact_graph, graph)) {
+    fprintf(stderr, "Error creating thread\n");
     return 1;
   }
 
-  mg_set_protocol_http_websocket(nc);
+  // HTTP Server, one mg_mgr per event loop. The main thread runs the first.
+  struct mg_mgr *mgrs = new struct mg_mgr[http_threads];
 
-  for (;;) {
-    mg_mgr_poll(&mgr, 1000);
+  for (int i = 0; i < http_threads; i++) {
+    Data *data = new Data();
+    data->graph = graph;
+    pthread_mutex_init(&data->ready_lock, NULL);
+    pthread_cond_init(&data->ready_cond, NULL);
+    mg_mgr_init(&mgrs[i], (void *) data);
+
+    pthread_t wake_thread;
+    if (pthread_create(&wake_thread, NULL, wake_event_loop, &mgrs[i])) {
+      fprintf(stderr, "Error creating thread\n");
+      return 1;
+    }
+
+    struct mg_connection *nc;
+    if (http_threads == 1) {
+      nc = mg_bind(&mgrs[i], port, ev_handler);
+    } else {
+      int fd = listen_reuseport(port);
+      nc = fd < 0 ? NULL : mg_add_sock(&mgrs[i], fd, ev_handler);
+      if (nc != NULL)
+        nc->flags |= MG_F_LISTENING;
+    }
+
+    if (nc == NULL) {
+      printf("Failed to create listener\n");
+      return 1;
+    }
+
+    mg_set_protocol_http_websocket(nc);
+
+    pthread_t http_thread;
+    if (i > 0 && pthread_create(&http_thread, NULL, serve_http, &mgrs[i])) {
+      fprintf(stderr, "Error creating thread\n");
+      return 1;
+    }
   }
-  mg_mgr_free(&mgr);
 
-  // Free 
-  free(data);
-  free(ip_list);
+  serve_http(&mgrs[0]);
 
   return 0;
 }
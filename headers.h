@@ -2,31 +2,53 @@
 #include <unistd.h>
 
 #include "Graph.h"
-
-#define I1_ADDRESS "104.197.8.216"
-#define I2_ADDRESS "104.197.8.216"
-#define I3_ADDRESS "104.198.211.89"
-#define RPC_PORT "50051"
+#include "Partitioner.h"
+#include "GraphLocks.h"
+#include "EdgeIntents.h"
+#include "SearchSessions.h"
+#include "WriteLog.h"
+#include "ApiRequest.h"
 
 #define RPC_FAILED 500
+#define STALE 503
 
 #define ADD_NODE 0
 #define REMOVE_NODE 1
 #define ADD_EDGE 2
 #define REMOVE_EDGE 3
 
+// Markers in a Follow stream: the snapshot that starts it, and how far
+// the upstream replica's log has been sent
+#define SNAPSHOT 4
+#define HEARTBEAT 5
+
+// Called with the replication status once a propogate_async call completes
+typedef void (*PropogateCallback)(int status, void *arg);
+
+// Called with the owner's reply once a relay_async call completes, and by
+// serve_relayed with the reply to send back. body is the JSON reply of a
+// read, and empty for a write.
+typedef void (*RelayCallback)(int status, const char *body, int body_len, uint64_t lsn, void *arg);
+
+// This server's place in its partition's chain of replicas. ip_next is
+// the next replica's RPC address, NULL on the tail.
 extern int head;
 extern int tail;
 extern char *ip_next;
 
+// Set on a read replica: the RPC address of the replica it follows
+extern char *ip_upstream;
+
 extern int part;
-extern char *rpc_port;
-extern char **ip_list;
-extern char *ip1;
-extern char *ip2;
-extern char *ip3;
+extern const char *rpc_port;
+extern int rpc_threads;
+extern Partitioner partitioner;
+
+extern GraphLocks graph_locks;
+extern EdgeIntents edge_intents;
+extern WriteLog write_log;
 
-extern pthread_mutex_t mutex;
+extern SearchSessions search_sessions;
 
 #ifdef __cplusplus
 	#define EXTERNC extern "C"
@@ -35,6 +57,21 @@ extern pthread_mutex_t mutex;
 #endif
 
 EXTERNC void *RunServer(void *);
+EXTERNC void init_peers();
+EXTERNC void log_peers();
 EXTERNC int propogate(const int, const uint64_t, const uint64_t);
+EXTERNC int propogate_async(const int, const uint64_t, const uint64_t, PropogateCallback, void *);
+EXTERNC int relay_async(const unsigned, const char *, const char *, const int, RelayCallback, void *);
+EXTERNC void serve_relayed(Graph *, const char *, const char *, int, RelayCallback, void *);
+EXTERNC int distributed_shortest_path(Graph *, const uint64_t, const uint64_t, uint64_t *);
+EXTERNC int migrate_nodes(Graph *, const PartitionMap *);
+EXTERNC bool migration_blocks(Graph *, const int, const uint64_t, const uint64_t);
+EXTERNC void init_chain();
+EXTERNC void chain_append(const int, const uint64_t, const uint64_t);
+EXTERNC void chain_forward(const uint64_t, const int, const uint64_t, const uint64_t);
+EXTERNC int chain_barrier(PropogateCallback, void *);
+EXTERNC int apply_write(Graph *, const int, const uint64_t, const uint64_t);
+EXTERNC void init_follower(Graph *);
+EXTERNC uint64_t follower_lag_ms();
 
 #undef EXTERNC
\ No newline at end of file
@@ -1901,7 +1901,8 @@ void to_wchar(const char *path, wchar_t *wbuf, size_t wbuf_len) {
 #define _MG_CALLBACK_MODIFIABLE_FLAGS_MASK                               \
   (MG_F_USER_1 | MG_F_USER_2 | MG_F_USER_3 | MG_F_USER_4 | MG_F_USER_5 | \
    MG_F_USER_6 | MG_F_WEBSOCKET_NO_DEFRAG | MG_F_SEND_AND_CLOSE |        \
-   MG_F_CLOSE_IMMEDIATELY | MG_F_IS_WEBSOCKET | MG_F_DELETE_CHUNK)
+   MG_F_CLOSE_IMMEDIATELY | MG_F_IS_WEBSOCKET | MG_F_DELETE_CHUNK |      \
+   MG_F_HTTP_HOLD)
 
 #ifndef intptr_t
 #define intptr_t long
@@ -4537,6 +4538,9 @@ void http_handler(struct mg_connection *nc, int ev, void *ev_data) {
 
   if (ev == MG_EV_RECV) {
     struct mg_str *s;
+  again:
+    /* Buffered requests wait while the application holds them back */
+    if (nc->flags & MG_F_HTTP_HOLD) return;
     req_len = mg_parse_http(io->buf, io->len, hm, is_req);
 
     if (req_len > 0 &&
@@ -4634,6 +4638,12 @@ void http_handler(struct mg_connection *nc, int ev, void *ev_data) {
       mg_call(nc, nc->handler, trigger_ev, hm);
 #endif
       mbuf_remove(io, hm->message.len);
+
+      /* Pipelined: the next request may already be buffered */
+      if (io->len > 0 &&
+          !(nc->flags & (MG_F_SEND_AND_CLOSE | MG_F_CLOSE_IMMEDIATELY))) {
+        goto again;
+      }
     }
   }
 }
@@ -804,6 +804,7 @@ struct mg_connection {
 #define MG_F_CLOSE_IMMEDIATELY (1 << 11)   /* Disconnect */
 #define MG_F_WEBSOCKET_NO_DEFRAG (1 << 12) /* Websocket specific */
 #define MG_F_DELETE_CHUNK (1 << 13)        /* HTTP specific */
+#define MG_F_HTTP_HOLD (1 << 14)           /* HTTP: don't dispatch requests */
 
 #define MG_F_USER_1 (1 << 20) /* Flags left for application */
 #define MG_F_USER_2 (1 << 21)
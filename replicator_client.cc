@@ -27,22 +27,89 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "headers.h"
 #include <grpc++/grpc++.h>
 #include "replicator.grpc.pb.h"
 
 using grpc::Channel;
+using grpc::ClientAsyncResponseReader;
 using grpc::ClientContext;
+using grpc::ClientReader;
+using grpc::ClientReaderWriter;
+using grpc::ClientWriter;
+using grpc::CompletionQueue;
 using grpc::Status;
 using replicator::Node;
 using replicator::Edge;
 using replicator::Ack;
+using replicator::BatchAck;
+using replicator::Frontier;
+using replicator::Adjacency;
+using replicator::ClientRequest;
+using replicator::ClientReply;
+using replicator::ChainOp;
+using replicator::ChainAck;
+using replicator::ChainService;
+using replicator::FollowRequest;
 using replicator::ReplicatorService;
 
+// A replication call started with ReplicatorClient::StartAsync. Owned by
+// the completion queue poller from the moment it is started.
+struct AsyncCall {
+  int op;
+  ClientContext context;
+  Ack ack;
+  Status status;
+  std::unique_ptr<ClientAsyncResponseReader<Ack> > reader;
+  std::shared_ptr<class ReplicatorClient> client;
+  PropogateCallback done;
+  void *arg;
+};
+
+// A request started with ReplicatorClient::StartRelay, owned the same way
+struct RelayCall {
+  ClientContext context;
+  ClientReply reply;
+  Status status;
+  std::unique_ptr<ClientAsyncResponseReader<ClientReply> > reader;
+  std::shared_ptr<class ReplicatorClient> client;
+  RelayCallback done;
+  void *arg;
+};
+
+// How long a cluster search waits on any one of its RPCs before failing
+// the search, so a stuck partition can't hold a search worker forever
+#define SEARCH_RPC_TIMEOUT_MS 5000
+
+static void set_search_deadline(ClientContext *context) {
+  context->set_deadline(std::chrono::system_clock::now() +
+                        std::chrono::milliseconds(SEARCH_RPC_TIMEOUT_MS));
+}
+
+// One partition's share of a superstep of distributed_shortest_path,
+// started with ReplicatorClient::StartExpandFrontier. Owned by the search.
+struct ExpandCall {
+  ClientContext context;
+  Frontier reply;
+  Status status;
+  std::unique_ptr<ClientAsyncResponseReader<Frontier> > reader;
+};
+
 class ReplicatorClient {
  public:
   ReplicatorClient(std::shared_ptr<Channel> channel)
@@ -136,56 +203,348 @@ class ReplicatorClient {
     }
   }
 
+  // Starts op without waiting for the reply; cq yields call when it lands
+  void StartAsync(AsyncCall *call, const uint64_t node_a_id, const uint64_t node_b_id,
+                  CompletionQueue *cq) {
+    Node node;
+    node.set_node_id(node_a_id);
+
+    Edge edge;
+    edge.mutable_node_a()->set_node_id(node_a_id);
+    edge.mutable_node_b()->set_node_id(node_b_id);
+
+    switch (call->op) {
+      case ADD_NODE:
+        call->reader = stub_->AsyncAddNode(&call->context, node, cq);
+        break;
+      case REMOVE_NODE:
+        call->reader = stub_->AsyncRemoveNode(&call->context, node, cq);
+        break;
+      case ADD_EDGE:
+        call->reader = stub_->AsyncAddEdge(&call->context, edge, cq);
+        break;
+      case REMOVE_EDGE:
+        call->reader = stub_->AsyncRemoveEdge(&call->context, edge, cq);
+        break;
+    }
+    call->reader->Finish(&call->ack, &call->status, call);
+  }
+
+  void StartRelay(RelayCall *call, const char *uri, const char *body, const int body_len,
+                  CompletionQueue *cq) {
+    ClientRequest request;
+    request.set_uri(uri);
+    request.set_body(body, body_len);
+
+    call->reader = stub_->AsyncRelay(&call->context, request, cq);
+    call->reader->Finish(&call->reply, &call->status, call);
+  }
+
+  // Streams edges as one AddEdges or RemoveEdges call. On success statuses
+  // holds one entry per edge.
+  int SendEdgeBatch(const int op, const std::vector<std::pair<uint64_t, uint64_t> > &edges,
+                    std::vector<int> &statuses) {
+    BatchAck ack;
+    ClientContext context;
+
+    std::unique_ptr<ClientWriter<Edge> > writer(op == ADD_EDGE ?
+        stub_->AddEdges(&context, &ack) : stub_->RemoveEdges(&context, &ack));
+
+    for (size_t i = 0; i < edges.size(); i++) {
+      Edge edge;
+      edge.mutable_node_a()->set_node_id(edges[i].first);
+      edge.mutable_node_b()->set_node_id(edges[i].second);
+      if (!writer->Write(edge))
+        break;
+    }
+    writer->WritesDone();
+    Status status = writer->Finish();
+
+    if (status.ok()) {
+      statuses.assign(ack.statuses().begin(), ack.statuses().end());
+      // Edges the server never got to count as failed
+      statuses.resize(edges.size(), RPC_FAILED);
+      return SUCCESS;
+    } else {
+      std::cout << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return RPC_FAILED;
+    }
+  }
+
+  // Streams nodes and their adjacency as one MigrateNodes call. On
+  // success statuses holds one entry per node.
+  int SendMigrateNodes(const std::vector<std::pair<uint64_t, std::vector<uint64_t> > > &nodes,
+                       std::vector<int> &statuses) {
+    BatchAck ack;
+    ClientContext context;
+
+    std::unique_ptr<ClientWriter<Adjacency> > writer(stub_->MigrateNodes(&context, &ack));
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+      Adjacency node;
+      node.set_node_id(nodes[i].first);
+      for (size_t j = 0; j < nodes[i].second.size(); j++)
+        node.add_neighbors(nodes[i].second[j]);
+      if (!writer->Write(node))
+        break;
+    }
+    writer->WritesDone();
+    Status status = writer->Finish();
+
+    if (status.ok()) {
+      statuses.assign(ack.statuses().begin(), ack.statuses().end());
+      statuses.resize(nodes.size(), RPC_FAILED);
+      return SUCCESS;
+    } else {
+      std::cout << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return RPC_FAILED;
+    }
+  }
+
+  int SendHasNode(const uint64_t node_id) {
+    Node node;
+    node.set_node_id(node_id);
+
+    Ack ack;
+
+    ClientContext context;
+    set_search_deadline(&context);
+
+    Status status = stub_->HasNode(&context, node, &ack);
+
+    if (status.ok()) {
+      return ack.status();
+    } else {
+      std::cout << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return RPC_FAILED;
+    }
+  }
+
+  void StartExpandFrontier(ExpandCall *call, const uint64_t search_id, const uint64_t target,
+                           const uint64_t bound, const std::vector<Seed> &seeds, CompletionQueue *cq) {
+    Frontier request;
+    request.set_search_id(search_id);
+    request.set_target(target);
+    request.set_bound(bound == UINT64_MAX ? 0 : bound);
+    for (size_t i = 0; i < seeds.size(); i++) {
+      replicator::Seed *seed = request.add_seeds();
+      seed->set_node_id(seeds[i].first);
+      seed->set_distance(seeds[i].second);
+    }
+
+    set_search_deadline(&call->context);
+    call->reader = stub_->AsyncExpandFrontier(&call->context, request, cq);
+    call->reader->Finish(&call->reply, &call->status, call);
+  }
+
+  int SendEndSearch(const uint64_t search_id) {
+    Frontier request;
+    request.set_search_id(search_id);
+
+    Ack ack;
+    ClientContext context;
+    set_search_deadline(&context);
+
+    Status status = stub_->EndSearch(&context, request, &ack);
+
+    if (status.ok()) {
+      return ack.status();
+    } else {
+      std::cout << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      return RPC_FAILED;
+    }
+  }
+
  private:
   std::unique_ptr<ReplicatorService::Stub> stub_;
 };
 
+// One long-lived channel and stub per peer partition. gRPC stubs are
+// thread-safe, so the lock only guards looking up or replacing them.
+struct Peer {
+  Peer() : calls(0), reused(0), connects(0) {}
+
+  std::shared_ptr<Channel> channel;
+  std::shared_ptr<ReplicatorClient> client;
+  uint64_t calls;
+  uint64_t reused;
+  uint64_t connects;
+};
+
+// Both grow when a new partition map adds partitions
+static std::vector<Peer> peers;
+static std::vector<class EdgeBatcher *> batchers;
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Replies to every propogate_async call arrive here, and to every
+// relay_async call on relay_cq
+static CompletionQueue async_cq;
+static CompletionQueue relay_cq;
+
+static void connect_peer(int partition, const PartitionMap *map) {
+  std::string server_address(map->host(partition));
+  peers[partition].channel = grpc::CreateChannel(
+      server_address, grpc::InsecureChannelCredentials());
+  peers[partition].client = std::make_shared<ReplicatorClient>(peers[partition].channel);
+  peers[partition].connects++;
+
+  // Start the handshake now rather than on the first call
+  peers[partition].channel->GetState(true);
+}
+
+static void *poll_async(void *v) {
+  void *tag;
+  bool ok;
+
+  while (async_cq.Next(&tag, &ok)) {
+    AsyncCall *call = (AsyncCall *) tag;
+    int status;
+
+    if (ok && call->status.ok()) {
+      status = call->ack.status();
+    } else {
+      std::cout << call->status.error_code() << ": " << call->status.error_message()
+                << std::endl;
+      status = RPC_FAILED;
+    }
+
+    call->done(status, call->arg);
+    delete call;
+  }
+
+  return NULL;
+}
+
+static void *poll_relays(void *v) {
+  void *tag;
+  bool ok;
+
+  while (relay_cq.Next(&tag, &ok)) {
+    RelayCall *call = (RelayCall *) tag;
+
+    if (ok && call->status.ok()) {
+      const std::string &body = call->reply.body();
+      call->done(call->reply.status(), body.data(), body.size(), call->reply.lsn(), call->arg);
+    } else {
+      std::cout << call->status.error_code() << ": " << call->status.error_message()
+                << std::endl;
+      call->done(RPC_FAILED, NULL, 0, 0, call->arg);
+    }
+    delete call;
+  }
+
+  return NULL;
+}
+
+void init_peers() {
+  pthread_mutex_lock(&peers_lock);
+  peers.resize(partitioner.size());
+  for (int p = 0; p < (int) partitioner.size(); p++) {
+    if (p != part-1)
+      connect_peer(p, partitioner.current());
+  }
+  pthread_mutex_unlock(&peers_lock);
+
+  pthread_t poller;
+  if (pthread_create(&poller, NULL, poll_async, NULL)) {
+    fprintf(stderr, "Error creating thread\n");
+    exit(1);
+  }
+  pthread_detach(poller);
+
+  if (pthread_create(&poller, NULL, poll_relays, NULL)) {
+    fprintf(stderr, "Error creating thread\n");
+    exit(1);
+  }
+  pthread_detach(poller);
+}
+
+// Returns the stub for a peer partition, whose address is looked up in
+// map if it has to connect. A channel that has failed or shut down is
+// replaced, which also skips gRPC's reconnect backoff.
+static std::shared_ptr<ReplicatorClient> peer(int partition, const PartitionMap *map) {
+  std::shared_ptr<ReplicatorClient> client;
+
+  pthread_mutex_lock(&peers_lock);
+  if (partition >= (int) peers.size())
+    peers.resize(partition + 1);
+  Peer &p = peers[partition];
+  if (!p.channel) {
+    connect_peer(partition, map);
+  } else {
+    grpc_connectivity_state state = p.channel->GetState(true);
+    if (state == GRPC_CHANNEL_TRANSIENT_FAILURE || state == GRPC_CHANNEL_SHUTDOWN) {
+      std::cout << "Reconnecting to partition " << partition+1 << std::endl;
+      connect_peer(partition, map);
+    } else if (state == GRPC_CHANNEL_READY) {
+      p.reused++;
+    }
+  }
+  p.calls++;
+  client = p.client;
+  pthread_mutex_unlock(&peers_lock);
+
+  return client;
+}
+
+// Prints each peer's call counts, for diagnostics
+void log_peers() {
+  pthread_mutex_lock(&peers_lock);
+  for (size_t i = 0; i < peers.size(); i++) {
+    if ((int) i == part-1)
+      continue;
+    std::cout << "Peer " << i+1 << ": calls " << peers[i].calls << ", reused " << peers[i].reused
+              << ", connects " << peers[i].connects << std::endl;
+  }
+  pthread_mutex_unlock(&peers_lock);
+}
+
+static std::shared_ptr<ReplicatorClient> peer(int partition) {
+  return peer(partition, partitioner.current());
+}
+
 int propogate(const int op, const uint64_t node_a_id, const uint64_t node_b_id) {
   int status = 0;
 
-  uint64_t node_id = ((node_a_id % 3) < (node_b_id % 3))? node_b_id : node_a_id;
-  int modulo = node_id % 3;
+  const PartitionMap *map = partitioner.current();
+  int owner = map->owner(map->higherNode(node_a_id, node_b_id));
 
-  if (modulo == part-1) {
+  if (owner == part-1) {
     std::cout << "Propogate received RPC request even though you are the higher partition" << std::endl;
     return 200;
   }
 
-  if (ip_list[modulo] == NULL) {
-    std::cout << "Error: ip address " << modulo+1 << " undefined" << std::endl;
+  std::shared_ptr<ReplicatorClient> client = peer(owner);
+  if (!client) {
     return RPC_FAILED;
   }
 
-  std::string server_address(ip_list[modulo]);
-  std::cout << "Propogate created server address " << server_address << std::endl;
-
-  ReplicatorClient client(grpc::CreateChannel(
-      server_address, grpc::InsecureChannelCredentials()));
-
-  std::cout << "Propogate created client" << std::endl;
-
   switch (op) {
     case ADD_NODE: {
       std::cout << "Client calling: ADD_NODE" << std::endl;
-      status = client.SendAddNode(node_a_id);
+      status = client->SendAddNode(node_a_id);
       std::cout << "Client received: ADD_NODE" << std::endl;
       break;
     }
     case REMOVE_NODE: {
       std::cout << "Client calling: REMOVE_NODE" << std::endl;
-      status = client.SendRemoveNode(node_a_id);
+      status = client->SendRemoveNode(node_a_id);
       std::cout << "Client received: REMOVE_NODE" << std::endl;
       break;
     }
     case ADD_EDGE: {
       std::cout << "Client calling: ADD_EDGE" << std::endl;
-      status = client.SendAddEdge(node_a_id, node_b_id);
+      status = client->SendAddEdge(node_a_id, node_b_id);
       std::cout << "Client received: ADD_EDGE" << std::endl;
       break;
     }
     case REMOVE_EDGE: {
       std::cout << "Client calling: REMOVE_EDGE" << std::endl;
-      status = client.SendRemoveEdge(node_a_id, node_b_id);
+      status = client->SendRemoveEdge(node_a_id, node_b_id);
       std::cout << "Client received: REMOVE_EDGE" << std::endl;
       break;
     }
@@ -195,3 +554,770 @@ int propogate(const int op, const uint64_t node_a_id, const uint64_t node_b_id)
 
   return status;
 }
+
+// Edge writes queued for one peer are sent together once BATCH_MAX_EDGES
+// are waiting or the oldest has waited BATCH_WINDOW_US
+#define BATCH_MAX_EDGES 512
+#define BATCH_WINDOW_US 500
+
+// Coalesces the cross-partition edge writes bound for one peer into
+// client-streaming AddEdges and RemoveEdges calls, sent from the
+// batcher's own thread. Writes queued while a batch is in flight go out
+// in the next one.
+class EdgeBatcher {
+ public:
+  explicit EdgeBatcher(int partition) : partition_(partition) {
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&wake_, NULL);
+    if (pthread_create(&thread_, NULL, Run, this)) {
+      fprintf(stderr, "Error creating thread\n");
+      exit(1);
+    }
+    pthread_detach(thread_);
+  }
+
+  void Add(const int op, const uint64_t node_a_id, const uint64_t node_b_id,
+           PropogateCallback done, void *arg) {
+    PendingEdge e;
+    e.edge = std::make_pair(node_a_id, node_b_id);
+    e.done = done;
+    e.arg = arg;
+
+    pthread_mutex_lock(&lock_);
+    if (adds_.empty() && removes_.empty())
+      gettimeofday(&oldest_, NULL);
+    if (op == ADD_EDGE)
+      adds_.push_back(e);
+    else
+      removes_.push_back(e);
+    pthread_cond_signal(&wake_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+ private:
+  struct PendingEdge {
+    std::pair<uint64_t, uint64_t> edge;
+    PropogateCallback done;
+    void *arg;
+  };
+
+  int partition_;
+  pthread_t thread_;
+  pthread_mutex_t lock_;
+  pthread_cond_t wake_;
+  std::vector<PendingEdge> adds_;
+  std::vector<PendingEdge> removes_;
+  struct timeval oldest_;
+
+  static void *Run(void *v) {
+    EdgeBatcher *b = (EdgeBatcher *) v;
+    for (;;) {
+      std::vector<PendingEdge> adds, removes;
+      b->Take(adds, removes);
+      b->Send(ADD_EDGE, adds);
+      b->Send(REMOVE_EDGE, removes);
+    }
+    return NULL;
+  }
+
+  // Waits for a full batch or for the window to close on a partial one
+  void Take(std::vector<PendingEdge> &adds, std::vector<PendingEdge> &removes) {
+    pthread_mutex_lock(&lock_);
+    for (;;) {
+      size_t queued = adds_.size() + removes_.size();
+      if (queued >= BATCH_MAX_EDGES)
+        break;
+      if (queued == 0) {
+        pthread_cond_wait(&wake_, &lock_);
+        continue;
+      }
+
+      struct timespec deadline;
+      long usec = oldest_.tv_usec + BATCH_WINDOW_US;
+      deadline.tv_sec = oldest_.tv_sec + usec / 1000000;
+      deadline.tv_nsec = (usec % 1000000) * 1000;
+      if (pthread_cond_timedwait(&wake_, &lock_, &deadline) == ETIMEDOUT)
+        break;
+    }
+    adds.swap(adds_);
+    removes.swap(removes_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  void Send(const int op, std::vector<PendingEdge> &batch) {
+    for (size_t first = 0; first < batch.size(); first += BATCH_MAX_EDGES) {
+      size_t last = std::min(batch.size(), first + BATCH_MAX_EDGES);
+      std::vector<std::pair<uint64_t, uint64_t> > edges;
+      std::vector<int> statuses;
+      for (size_t i = first; i < last; i++)
+        edges.push_back(batch[i].edge);
+
+      int status = RPC_FAILED;
+      std::shared_ptr<ReplicatorClient> client = peer(partition_);
+      if (client)
+        status = client->SendEdgeBatch(op, edges, statuses);
+
+      std::cout << "Client sent batch of " << edges.size() << " edges to partition "
+                << partition_+1 << ": " << status << std::endl;
+
+      for (size_t i = first; i < last; i++)
+        batch[i].done(status == SUCCESS ? statuses[i - first] : RPC_FAILED, batch[i].arg);
+    }
+  }
+};
+
+// Each peer's batcher thread is started by the first edge write to it
+static EdgeBatcher *batcher(int partition) {
+  EdgeBatcher *b;
+
+  pthread_mutex_lock(&peers_lock);
+  if (partition >= (int) batchers.size())
+    batchers.resize(partition + 1, NULL);
+  if (batchers[partition] == NULL)
+    batchers[partition] = new EdgeBatcher(partition);
+  b = batchers[partition];
+  pthread_mutex_unlock(&peers_lock);
+
+  return b;
+}
+
+// Like propogate, but returns 0 as soon as the write is handed off and
+// later calls done with its status from a client thread, so any number of
+// writes can be in flight at once. Edge writes are batched per peer. If
+// no RPC is needed or it can't be sent, returns the status right away and
+// never calls done.
+int propogate_async(const int op, const uint64_t node_a_id, const uint64_t node_b_id,
+                     PropogateCallback done, void *arg) {
+  const PartitionMap *map = partitioner.current();
+  int owner = map->owner(map->higherNode(node_a_id, node_b_id));
+
+  if (owner == part-1) {
+    std::cout << "Propogate received RPC request even though you are the higher partition" << std::endl;
+    return SUCCESS;
+  }
+
+  if (op == ADD_EDGE || op == REMOVE_EDGE) {
+    batcher(owner)->Add(op, node_a_id, node_b_id, done, arg);
+    return 0;
+  }
+
+  std::shared_ptr<ReplicatorClient> client = peer(owner);
+  if (!client) {
+    return RPC_FAILED;
+  }
+
+  AsyncCall *call = new AsyncCall();
+  call->op = op;
+  call->client = client;
+  call->done = done;
+  call->arg = arg;
+  client->StartAsync(call, node_a_id, node_b_id, &async_cq);
+  return 0;
+}
+
+// Hands a client request to the head of partition owner. Returns 0 once
+// the call has started; done gets the head's reply.
+int relay_async(const unsigned owner, const char *uri, const char *body, const int body_len,
+                RelayCallback done, void *arg) {
+  std::shared_ptr<ReplicatorClient> client = peer(owner);
+  if (!client) {
+    return RPC_FAILED;
+  }
+
+  RelayCall *call = new RelayCall();
+  call->client = client;
+  call->done = done;
+  call->arg = arg;
+  client->StartRelay(call, uri, body, body_len, &relay_cq);
+  return 0;
+}
+
+// Stubs are fetched from the pool the first time a search needs them
+static ReplicatorClient *search_client(std::vector<std::shared_ptr<ReplicatorClient> > &clients, int p) {
+  if (!clients[p])
+    clients[p] = peer(p);
+  return clients[p].get();
+}
+
+static bool node_exists(Graph *graph, const PartitionMap *map,
+                        std::vector<std::shared_ptr<ReplicatorClient> > &clients,
+                        const uint64_t node_id, int *status) {
+  int owner = map->owner(node_id);
+  if (owner == part-1) {
+    graph_locks.readLock();
+    bool in_graph = std::get<1>(graph->getNode(node_id));
+    graph_locks.unlock();
+    *status = SUCCESS;
+    return in_graph;
+  }
+
+  *status = search_client(clients, owner)->SendHasNode(node_id);
+  return *status == SUCCESS;
+}
+
+// Reads the reply to a finished ExpandFrontier call: the boundary nodes it
+// hit and the best distance to the target it found
+static int finish_expand(ExpandCall *call, bool ok, std::vector<Seed> &boundary, uint64_t *reached) {
+  if (!ok || !call->status.ok()) {
+    std::cout << call->status.error_code() << ": " << call->status.error_message()
+              << std::endl;
+    return RPC_FAILED;
+  }
+
+  for (int i = 0; i < call->reply.seeds_size(); i++)
+    boundary.push_back(std::make_pair(call->reply.seeds(i).node_id(), call->reply.seeds(i).distance()));
+  *reached = call->reply.bound() == 0 ? UINT64_MAX : call->reply.bound();
+  return SUCCESS;
+}
+
+// Routes the boundary nodes one partition hit to their owners for the
+// next superstep, unless already routed at no greater distance
+static void route_boundary(const PartitionMap *map, const std::vector<Seed> &boundary,
+                           std::unordered_map<uint64_t, uint64_t> &routed,
+                           std::vector<std::vector<Seed> > &next) {
+  for (size_t i = 0; i < boundary.size(); i++) {
+    std::unordered_map<uint64_t, uint64_t>::iterator r = routed.find(boundary[i].first);
+    if (r != routed.end() && r->second <= boundary[i].second)
+      continue;
+    routed[boundary[i].first] = boundary[i].second;
+    next[map->owner(boundary[i].first)].push_back(boundary[i]);
+  }
+}
+
+// Cross-partition BFS in bulk-synchronous supersteps, driven by the
+// partition that received the request. Each superstep every partition
+// with pending seeds expands them as far as its own nodes reach and
+// returns only the boundary nodes it hit, which are routed to their
+// owners for the next superstep. The other partitions' expansions are in
+// flight at once while this one's runs here. Runs without the graph lock
+// held except around local lookups, so two coordinators cannot deadlock.
+// Blocks for the whole search, so it is run off the event loop.
+int distributed_shortest_path(Graph *graph, const uint64_t node_a_id, const uint64_t node_b_id,
+                              uint64_t *distance) {
+  static std::atomic<uint64_t> next_search(0);
+
+  if (node_a_id == node_b_id)
+    return EXISTS;
+
+  // The whole search routes by one map, so a reload can't change the
+  // number of partitions under it
+  const PartitionMap *map = partitioner.current();
+  int num_parts = map->size();
+  std::vector<std::shared_ptr<ReplicatorClient> > clients(num_parts);
+
+  int status = SUCCESS;
+  bool found_a = node_exists(graph, map, clients, node_a_id, &status);
+  bool found_b = status != RPC_FAILED && node_exists(graph, map, clients, node_b_id, &status);
+  if (status == RPC_FAILED)
+    return RPC_FAILED;
+  if (!found_a || !found_b)
+    return EXISTS;
+
+  uint64_t search_id = ((uint64_t) part << 56) | ((uint64_t) time(NULL) << 24) | (next_search++ & 0xffffff);
+  uint64_t best = UINT64_MAX;
+  std::vector<std::vector<Seed> > pending(num_parts);
+  std::unordered_map<uint64_t, uint64_t> routed;
+  int supersteps = 0;
+  CompletionQueue cq;
+
+  pending[map->owner(node_a_id)].push_back(std::make_pair(node_a_id, (uint64_t) 0));
+  routed[node_a_id] = 0;
+
+  for (;;) {
+    bool active = false;
+    for (int p = 0; p < num_parts; p++)
+      active = active || !pending[p].empty();
+    if (!active || status == RPC_FAILED)
+      break;
+
+    std::vector<std::vector<Seed> > next(num_parts);
+    supersteps++;
+
+    int started = 0;
+    for (int p = 0; p < num_parts; p++) {
+      if (pending[p].empty() || p == part-1)
+        continue;
+      search_client(clients, p)->StartExpandFrontier(new ExpandCall(), search_id, node_b_id, best,
+                                                     pending[p], &cq);
+      started++;
+    }
+
+    if (part-1 < num_parts && !pending[part-1].empty()) {
+      std::vector<Seed> boundary;
+      graph_locks.readLock();
+      uint64_t reached = search_sessions.expand(graph, search_id, node_b_id, best, pending[part-1], boundary);
+      graph_locks.unlock();
+
+      best = std::min(best, reached);
+      route_boundary(map, boundary, routed, next);
+    }
+
+    // Every call is waited for, failed or not, before the next superstep
+    for (; started > 0; started--) {
+      void *tag;
+      bool ok;
+      cq.Next(&tag, &ok);
+
+      ExpandCall *call = (ExpandCall *) tag;
+      std::vector<Seed> boundary;
+      uint64_t reached;
+      if (finish_expand(call, ok, boundary, &reached) == RPC_FAILED) {
+        status = RPC_FAILED;
+      } else {
+        best = std::min(best, reached);
+        route_boundary(map, boundary, routed, next);
+      }
+      delete call;
+    }
+
+    // Seeds that cannot beat the best path found this superstep are dropped
+    for (int p = 0; p < num_parts; p++) {
+      pending[p].clear();
+      for (size_t i = 0; i < next[p].size(); i++) {
+        if (next[p][i].second + 1 < best)
+          pending[p].push_back(next[p][i]);
+      }
+    }
+  }
+
+  cq.Shutdown();
+  void *tag;
+  bool ok;
+  while (cq.Next(&tag, &ok))
+    ;
+
+  search_sessions.end(search_id);
+  // Only partitions the search reached hold a session
+  for (int p = 0; p < num_parts; p++) {
+    if (clients[p])
+      clients[p]->SendEndSearch(search_id);
+  }
+
+  std::cout << "Distributed shortest path took " << supersteps << " supersteps" << std::endl;
+
+  if (status == RPC_FAILED)
+    return RPC_FAILED;
+  if (best == UINT64_MAX)
+    return ERROR;
+
+  *distance = best;
+  return SUCCESS;
+}
+
+// Nodes handed to a new owner per MigrateNodes call
+#define MIGRATE_BATCH_NODES 256
+
+// Nodes migrate_nodes is handing to their new owners. Changed only under
+// graph_locks' write lock, so any graph lock is enough to read it.
+static std::unordered_set<uint64_t> migrating;
+
+// Whether a write must be refused because it would change a node on its
+// way to a new owner after the node's adjacency may have been sent.
+// Removing a node takes its edges with it, so that is refused if any
+// neighbor is migrating. Caller holds graph_locks.
+bool migration_blocks(Graph *graph, const int op, const uint64_t node_a_id, const uint64_t node_b_id) {
+  if (migrating.empty())
+    return false;
+  if (migrating.count(node_a_id) > 0)
+    return true;
+  if (op == ADD_EDGE || op == REMOVE_EDGE)
+    return migrating.count(node_b_id) > 0;
+  if (op == REMOVE_NODE) {
+    std::vector<uint64_t> neighbors = std::get<1>(graph->getNeighborIds(node_a_id));
+    for (size_t i = 0; i < neighbors.size(); i++) {
+      if (migrating.count(neighbors[i]) > 0)
+        return true;
+    }
+  }
+  return false;
+}
+
+// Drops what this partition no longer needs of a node it handed over:
+// its edges to nodes not owned here under map, then any such neighbor
+// left without edges, then the node itself unless an edge to a node owned
+// here keeps it as the far end of a cross-partition edge. The caller
+// holds the node's reservation.
+static void release_node(Graph *graph, const PartitionMap *map, const uint64_t node_id) {
+  graph_locks.readLock();
+  std::vector<uint64_t> neighbors = std::get<1>(graph->getNeighborIds(node_id));
+  graph_locks.unlock();
+
+  for (size_t i = 0; i < neighbors.size(); i++) {
+    uint64_t neighbor = neighbors[i];
+    if ((int) map->owner(neighbor) == part-1)
+      continue;
+
+    graph_locks.writeLock();
+    if (graph->removeEdge(node_id, neighbor) == SUCCESS)
+      chain_append(REMOVE_EDGE, node_id, neighbor);
+    if (std::get<1>(graph->getNeighborIds(neighbor)).empty() && graph->removeNode(neighbor) == SUCCESS)
+      chain_append(REMOVE_NODE, neighbor, 0);
+    graph_locks.unlock();
+  }
+
+  graph_locks.writeLock();
+  if (std::get<1>(graph->getNeighborIds(node_id)).empty() && graph->removeNode(node_id) == SUCCESS)
+    chain_append(REMOVE_NODE, node_id, 0);
+  graph_locks.unlock();
+}
+
+// Hands every node this partition owns under the current map but not
+// under new_map to its new owner, then publishes new_map and drops the
+// nodes here. Each leaving node is reserved and marked migrating from
+// before its adjacency is read until it is dropped: no edge write to it
+// is in flight to another partition, none starts, and writes that would
+// change it here are refused, so what is sent is final. Until the new
+// owners have acked, the map isn't published and reads of the leaving
+// nodes are still served here. Every adjacency is sent before anything is
+// dropped, so two neighbors bound for different partitions both carry the
+// edge between them. If a peer can't be reached nothing is dropped, the
+// current map stays, and the whole migration can be run again.
+int migrate_nodes(Graph *graph, const PartitionMap *new_map) {
+  const PartitionMap *old_map = partitioner.current();
+
+  graph_locks.readLock();
+  std::vector<uint64_t> nodes = graph->getNodes();
+  graph_locks.unlock();
+
+  std::vector<std::vector<uint64_t> > leaving(new_map->size());
+  std::vector<uint64_t> moving;
+  size_t owned = 0;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if ((int) old_map->owner(nodes[i]) != part-1)
+      continue;
+    owned++;
+    int p = new_map->owner(nodes[i]);
+    if (p != part-1) {
+      leaving[p].push_back(nodes[i]);
+      moving.push_back(nodes[i]);
+    }
+  }
+
+  for (size_t i = 0; i < moving.size(); i++)
+    edge_intents.waitToReserveNode(moving[i]);
+  graph_locks.writeLock();
+  migrating.insert(moving.begin(), moving.end());
+  graph_locks.unlock();
+
+  int status = SUCCESS;
+  for (int p = 0; p < (int) leaving.size() && status == SUCCESS; p++) {
+    for (size_t first = 0; first < leaving[p].size(); first += MIGRATE_BATCH_NODES) {
+      size_t last = std::min(leaving[p].size(), first + MIGRATE_BATCH_NODES);
+      std::vector<std::pair<uint64_t, std::vector<uint64_t> > > batch;
+      std::vector<int> statuses;
+
+      graph_locks.readLock();
+      for (size_t i = first; i < last; i++) {
+        batch.push_back(std::make_pair(leaving[p][i],
+                                       std::get<1>(graph->getNeighborIds(leaving[p][i]))));
+      }
+      graph_locks.unlock();
+
+      status = RPC_FAILED;
+      std::shared_ptr<ReplicatorClient> client = peer(p, new_map);
+      if (client)
+        status = client->SendMigrateNodes(batch, statuses);
+      if (status != SUCCESS) {
+        std::cout << "Migration to partition " << p+1 << " failed" << std::endl;
+        break;
+      }
+    }
+  }
+
+  // The new owners have every leaving node, so requests for them can go
+  // there now
+  if (status == SUCCESS) {
+    partitioner.publish(new_map);
+    for (size_t i = 0; i < moving.size(); i++)
+      release_node(graph, new_map, moving[i]);
+  }
+
+  graph_locks.writeLock();
+  migrating.clear();
+  graph_locks.unlock();
+  for (size_t i = 0; i < moving.size(); i++)
+    edge_intents.releaseNode(moving[i]);
+
+  if (status == SUCCESS)
+    std::cout << "Migrated " << moving.size() << " of " << owned << " nodes" << std::endl;
+  return status;
+}
+
+// How long a broken link to the next replica waits before reconnecting
+#define CHAIN_RETRY_US 100000
+
+// Forwards the graph writes applied on this replica to the next one in
+// its chain over a single Forward stream. Writes are sent under their
+// LSNs in the order they were appended without waiting for acks, so any
+// number can be in flight; acks are cumulative. If the stream breaks,
+// everything not yet acked is sent again on a new one, and the next
+// replica skips the LSNs it has already applied.
+class ChainLink {
+ public:
+  explicit ChainLink(const char *next)
+      : next_(next), last_seq_(0), sent_(0), acked_(0), broken_(false) {
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&wake_, NULL);
+    if (pthread_create(&thread_, NULL, Run, this)) {
+      fprintf(stderr, "Error creating thread\n");
+      exit(1);
+    }
+    pthread_detach(thread_);
+  }
+
+  // Call in the order the writes were applied, i.e. with the graph lock
+  // still held
+  void Append(const uint64_t lsn, const int op, const uint64_t node_a_id, const uint64_t node_b_id) {
+    ChainOp o;
+    o.set_seq(lsn);
+    o.set_op(op);
+    o.set_node_a(node_a_id);
+    o.set_node_b(node_b_id);
+
+    pthread_mutex_lock(&lock_);
+    // An LSN that skips ahead means this replica missed writes, so the
+    // older ones still queued can no longer be resent as a run
+    if (!unacked_.empty() && lsn != last_seq_ + 1)
+      unacked_.clear();
+    last_seq_ = lsn;
+    unacked_.push_back(o);
+    pthread_cond_signal(&wake_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  // Calls done once every write appended so far has reached the tail.
+  // Returns SUCCESS without calling done if there is nothing to wait for.
+  int Barrier(PropogateCallback done, void *arg) {
+    pthread_mutex_lock(&lock_);
+    uint64_t last = last_seq_;
+    if (last <= acked_) {
+      pthread_mutex_unlock(&lock_);
+      return SUCCESS;
+    }
+    Waiter w;
+    w.seq = last;
+    w.done = done;
+    w.arg = arg;
+    waiters_.push_back(w);
+    pthread_mutex_unlock(&lock_);
+    return 0;
+  }
+
+ private:
+  struct Waiter {
+    uint64_t seq;
+    PropogateCallback done;
+    void *arg;
+  };
+
+  std::string next_;
+  pthread_t thread_;
+  pthread_mutex_t lock_;
+  pthread_cond_t wake_;
+  std::deque<ChainOp> unacked_;
+  std::deque<Waiter> waiters_;
+  uint64_t last_seq_;
+  uint64_t sent_;
+  uint64_t acked_;
+  bool broken_;
+  std::unique_ptr<ClientReaderWriter<ChainOp, ChainAck> > stream_;
+
+  static void *Run(void *v) {
+    ChainLink *l = (ChainLink *) v;
+    std::shared_ptr<Channel> channel = grpc::CreateChannel(
+        l->next_, grpc::InsecureChannelCredentials());
+    std::unique_ptr<ChainService::Stub> stub = ChainService::NewStub(channel);
+
+    for (;;) {
+      ClientContext context;
+      l->stream_ = stub->Forward(&context);
+
+      pthread_mutex_lock(&l->lock_);
+      l->sent_ = l->acked_;
+      l->broken_ = false;
+      pthread_mutex_unlock(&l->lock_);
+
+      pthread_t reader;
+      if (pthread_create(&reader, NULL, ReadAcks, l)) {
+        fprintf(stderr, "Error creating thread\n");
+        exit(1);
+      }
+      l->Send();
+      context.TryCancel();
+      pthread_join(reader, NULL);
+      l->stream_->Finish();
+
+      std::cout << "Chain link to " << l->next_ << " broken, reconnecting" << std::endl;
+      usleep(CHAIN_RETRY_US);
+    }
+    return NULL;
+  }
+
+  // Writes appended ops until the stream breaks. Ops taken together are
+  // written with a buffer hint on all but the last, so they share packets.
+  void Send() {
+    for (;;) {
+      std::vector<ChainOp> batch;
+
+      pthread_mutex_lock(&lock_);
+      while (!broken_ && (unacked_.empty() || unacked_.back().seq() <= sent_))
+        pthread_cond_wait(&wake_, &lock_);
+      if (broken_) {
+        pthread_mutex_unlock(&lock_);
+        return;
+      }
+      // Sequence numbers in unacked_ are contiguous
+      size_t first = sent_ < unacked_.front().seq() ? 0 : sent_ + 1 - unacked_.front().seq();
+      batch.assign(unacked_.begin() + first, unacked_.end());
+      sent_ = batch.back().seq();
+      pthread_mutex_unlock(&lock_);
+
+      for (size_t i = 0; i < batch.size(); i++) {
+        grpc::WriteOptions options;
+        if (i + 1 < batch.size())
+          options.set_buffer_hint();
+        if (!stream_->Write(batch[i], options))
+          return;
+      }
+    }
+  }
+
+  static void *ReadAcks(void *v) {
+    ChainLink *l = (ChainLink *) v;
+    ChainAck ack;
+
+    while (l->stream_->Read(&ack)) {
+      std::vector<Waiter> ready;
+
+      pthread_mutex_lock(&l->lock_);
+      while (!l->unacked_.empty() && l->unacked_.front().seq() <= ack.seq())
+        l->unacked_.pop_front();
+      if (ack.seq() > l->acked_)
+        l->acked_ = ack.seq();
+      while (!l->waiters_.empty() && l->waiters_.front().seq <= l->acked_) {
+        ready.push_back(l->waiters_.front());
+        l->waiters_.pop_front();
+      }
+      pthread_mutex_unlock(&l->lock_);
+
+      for (size_t i = 0; i < ready.size(); i++)
+        ready[i].done(SUCCESS, ready[i].arg);
+    }
+
+    pthread_mutex_lock(&l->lock_);
+    l->broken_ = true;
+    pthread_cond_signal(&l->wake_);
+    pthread_mutex_unlock(&l->lock_);
+    return NULL;
+  }
+};
+
+// Link to ip_next; NULL on the tail
+static ChainLink *chain_link = NULL;
+
+void init_chain() {
+  if (ip_next != NULL)
+    chain_link = new ChainLink(ip_next);
+}
+
+// Numbers a write applied on the head and passes it down the chain
+void chain_append(const int op, const uint64_t node_a_id, const uint64_t node_b_id) {
+  uint64_t lsn = write_log.append(op, node_a_id, node_b_id);
+  if (chain_link != NULL)
+    chain_link->Append(lsn, op, node_a_id, node_b_id);
+}
+
+// Records a write that came down the chain under the head's LSN and
+// passes it on
+void chain_forward(const uint64_t lsn, const int op, const uint64_t node_a_id, const uint64_t node_b_id) {
+  write_log.record(lsn, op, node_a_id, node_b_id);
+  if (chain_link != NULL)
+    chain_link->Append(lsn, op, node_a_id, node_b_id);
+}
+
+int chain_barrier(PropogateCallback done, void *arg) {
+  if (chain_link == NULL)
+    return SUCCESS;
+  return chain_link->Barrier(done, arg);
+}
+
+// Milliseconds on the monotonic clock when this read replica last heard
+// it had everything its upstream had sent; 0 while it has yet to
+static std::atomic<uint64_t> follower_synced_ms(0);
+
+static uint64_t monotonic_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Empties the graph before a new snapshot is loaded over it
+static void clear_graph(Graph *graph) {
+  graph_locks.writeLock();
+  std::vector<uint64_t> nodes = graph->getNodes();
+  for (size_t i = 0; i < nodes.size(); i++)
+    graph->removeNode(nodes[i]);
+  graph_locks.unlock();
+}
+
+// Keeps this read replica's graph in step with ip_upstream's. Every Follow
+// stream starts from a fresh snapshot, so a replica that falls too far
+// behind, or whose upstream restarts, just reconnects.
+static void *follow_upstream(void *v) {
+  Graph *graph = (Graph *) v;
+  std::shared_ptr<Channel> channel = grpc::CreateChannel(
+      ip_upstream, grpc::InsecureChannelCredentials());
+  std::unique_ptr<ChainService::Stub> stub = ChainService::NewStub(channel);
+
+  for (;;) {
+    ClientContext context;
+    FollowRequest request;
+    request.set_partition(part);
+    std::unique_ptr<ClientReader<ChainOp> > reader = stub->Follow(&context, request);
+
+    ChainOp op;
+    while (reader->Read(&op)) {
+      if (op.op() == SNAPSHOT) {
+        follower_synced_ms = 0;
+        clear_graph(graph);
+        write_log.reset(op.seq());
+        std::cout << "Following " << ip_upstream << " from LSN " << op.seq() << std::endl;
+      } else if (op.op() == HEARTBEAT) {
+        follower_synced_ms = monotonic_ms();
+      } else {
+        graph_locks.writeLock();
+        apply_write(graph, op.op(), op.node_a(), op.node_b());
+        // Snapshot ops carry the snapshot's LSN and aren't logged
+        if (op.seq() > write_log.lsn())
+          write_log.record(op.seq(), op.op(), op.node_a(), op.node_b());
+        graph_locks.unlock();
+      }
+    }
+
+    Status status = reader->Finish();
+    std::cout << "Stopped following " << ip_upstream << ": " << status.error_message()
+              << ", reconnecting" << std::endl;
+    usleep(CHAIN_RETRY_US);
+  }
+  return NULL;
+}
+
+void init_follower(Graph *graph) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, follow_upstream, graph)) {
+    fprintf(stderr, "Error creating thread\n");
+    exit(1);
+  }
+  pthread_detach(thread);
+}
+
+// How far behind its upstream this read replica may be, in milliseconds;
+// 0 if it is not a read replica
+uint64_t follower_lag_ms() {
+  if (ip_upstream == NULL)
+    return 0;
+  uint64_t synced = follower_synced_ms;
+  if (synced == 0)
+    return UINT64_MAX;
+  return monotonic_ms() - synced;
+}
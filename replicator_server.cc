@@ -37,83 +37,618 @@
 #include "replicator.grpc.pb.h"
 
 using grpc::Server;
+using grpc::ServerAsyncReader;
+using grpc::ServerAsyncResponseWriter;
 using grpc::ServerBuilder;
+using grpc::ServerCompletionQueue;
 using grpc::ServerContext;
+using grpc::ServerReaderWriter;
+using grpc::ServerWriter;
 using grpc::Status;
 using replicator::Node;
 using replicator::Edge;
 using replicator::Ack;
+using replicator::BatchAck;
+using replicator::Frontier;
+using replicator::Adjacency;
+using replicator::ClientRequest;
+using replicator::ClientReply;
+using replicator::ChainOp;
+using replicator::ChainAck;
+using replicator::ChainService;
+using replicator::FollowRequest;
 using replicator::ReplicatorService;
 
-class ReplicatorImpl final : public ReplicatorService::Service {
+// Handlers for the replication RPCs. Each runs on one of the completion
+// queue threads and takes graph_locks itself, so inbound updates from
+// different peers are applied in parallel.
+class ReplicatorImpl {
  public:
   explicit ReplicatorImpl(Graph *g) {
     graph = g;
   }
 
-  Status AddNode(ServerContext* context, const Node* node, Ack *ack) override {
-    pthread_mutex_lock(&mutex);
+  Status AddNode(ServerContext* context, const Node* node, Ack *ack) {
+    graph_locks.writeLock();
 
     std::cout << "RPC Server " << part << " adding node: " << node->node_id() << std::endl;
 
-    int status;
+    int status = ERROR;
 
-    status = graph->addNode(node->node_id());
+    if (!migration_blocks(graph, ADD_NODE, node->node_id(), 0))
+      status = graph->addNode(node->node_id());
+    if (status == SUCCESS)
+      chain_append(ADD_NODE, node->node_id(), 0);
     ack->set_status(status);
 
-    pthread_mutex_unlock(&mutex);
+    graph_locks.unlock();
     return Status::OK;
   }
 
-  Status RemoveNode(ServerContext* context, const Node* node, Ack *ack) override {
-    pthread_mutex_lock(&mutex);
+  // Caller holds the node's reservation in edge_intents, so no edge to it
+  // is in flight from here to another partition
+  Status RemoveNode(ServerContext* context, const Node* node, Ack *ack) {
+    graph_locks.writeLock();
 
     std::cout << "RPC Server " << part << " removing node: " << node->node_id() << std::endl;
 
-    int status;
+    int status = ERROR;
 
-    status = graph->removeNode(node->node_id());
+    if (!migration_blocks(graph, REMOVE_NODE, node->node_id(), 0))
+      status = graph->removeNode(node->node_id());
+    if (status == SUCCESS)
+      chain_append(REMOVE_NODE, node->node_id(), 0);
     ack->set_status(status);
 
-    pthread_mutex_unlock(&mutex);
+    graph_locks.unlock();
     return Status::OK;
   }
 
-  Status AddEdge(ServerContext* context, const Edge* edge, Ack *ack) override {
-    pthread_mutex_lock(&mutex);
+  Status AddEdge(ServerContext* context, const Edge* edge, Ack *ack) {
+    graph_locks.writeLock();
 
     std::cout << "RPC Server " << part << " adding edge: " << edge->node_a().node_id() << ", " << edge->node_b().node_id() << std::endl;
 
-    int status;
+    int status = ERROR;
 
-    // Check if this partition has higher node
-    std::pair<int, bool> result;
-    result = graph->getNode(edge->node_b().node_id());
-    bool in_graph = std::get<1>(result);
+    if (writable_edge(edge)) {
+      // Check if this partition has higher node
+      std::pair<int, bool> result;
+      result = graph->getNode(edge->node_b().node_id());
+      bool in_graph = std::get<1>(result);
 
-    // Only add lower node if higher node existed
-    if (in_graph) {
-      graph->addNode(edge->node_a().node_id());
-    }
+      // Only add lower node if higher node existed
+      if (in_graph && graph->addNode(edge->node_a().node_id()) == SUCCESS) {
+        chain_append(ADD_NODE, edge->node_a().node_id(), 0);
+      }
 
-    status = graph->addEdge(edge->node_a().node_id(), edge->node_b().node_id());
+      status = graph->addEdge(edge->node_a().node_id(), edge->node_b().node_id());
+    }
+    if (status == SUCCESS)
+      chain_append(ADD_EDGE, edge->node_a().node_id(), edge->node_b().node_id());
     ack->set_status(status);
 
-    pthread_mutex_unlock(&mutex);
+    graph_locks.unlock();
     return Status::OK;
   }
 
-  Status RemoveEdge(ServerContext* context, const Edge* edge, Ack *ack) override {
-    pthread_mutex_lock(&mutex);
+  Status RemoveEdge(ServerContext* context, const Edge* edge, Ack *ack) {
+    graph_locks.writeLock();
 
     std::cout << "RPC Server " << part << " removing edge: " << edge->node_a().node_id() << ", " << edge->node_b().node_id() << std::endl;
 
-    int status;
+    int status = ERROR;
 
-    status = graph->removeEdge(edge->node_a().node_id(), edge->node_b().node_id());
+    if (writable_edge(edge))
+      status = graph->removeEdge(edge->node_a().node_id(), edge->node_b().node_id());
+    if (status == SUCCESS)
+      chain_append(REMOVE_EDGE, edge->node_a().node_id(), edge->node_b().node_id());
     ack->set_status(status);
 
-    pthread_mutex_unlock(&mutex);
+    graph_locks.unlock();
+    return Status::OK;
+  }
+
+  Status HasNode(ServerContext* context, const Node* node, Ack *ack) {
+    graph_locks.readLock();
+
+    std::pair<int, bool> result;
+    result = graph->getNode(node->node_id());
+    bool in_graph = std::get<1>(result);
+    ack->set_status(in_graph ? SUCCESS : ERROR);
+
+    graph_locks.unlock();
+    return Status::OK;
+  }
+
+  Status ExpandFrontier(ServerContext* context, const Frontier* request, Frontier *reply) {
+    std::vector<Seed> seeds;
+    std::vector<Seed> boundary;
+    for (int i = 0; i < request->seeds_size(); i++) {
+      seeds.push_back(std::make_pair(request->seeds(i).node_id(), request->seeds(i).distance()));
+    }
+
+    graph_locks.readLock();
+
+    std::cout << "RPC Server " << part << " expanding " << seeds.size() << " seeds for search " << request->search_id() << std::endl;
+
+    uint64_t reached = search_sessions.expand(graph, request->search_id(), request->target(),
+                                              request->bound(), seeds, boundary);
+
+    graph_locks.unlock();
+
+    reply->set_search_id(request->search_id());
+    reply->set_target(request->target());
+    reply->set_bound(reached == UINT64_MAX ? 0 : reached);
+    for (size_t i = 0; i < boundary.size(); i++) {
+      replicator::Seed *seed = reply->add_seeds();
+      seed->set_node_id(boundary[i].first);
+      seed->set_distance(boundary[i].second);
+    }
+    return Status::OK;
+  }
+
+  Status EndSearch(ServerContext* context, const Frontier* request, Ack *ack) {
+    search_sessions.end(request->search_id());
+    ack->set_status(SUCCESS);
+    return Status::OK;
+  }
+
+  // Serves a client request another server relayed here. done gets the
+  // reply, once a write has reached the tail of the chain.
+  void Relay(const ClientRequest* request, RelayCallback done, void *arg) {
+    serve_relayed(graph, request->uri().c_str(), request->body().data(),
+                  request->body().size(), done, arg);
+  }
+
+  // Installs a node handed over by its old owner. Merged with whatever is
+  // already here, so a retried migration or a write that beat the node
+  // here does no harm.
+  Status MigrateNode(ServerContext* context, const Adjacency* node, Ack *ack) {
+    uint64_t node_id = node->node_id();
+
+    graph_locks.writeLock();
+    if (graph->addNode(node_id) == SUCCESS)
+      chain_append(ADD_NODE, node_id, 0);
+    graph_locks.unlock();
+
+    for (int i = 0; i < node->neighbors_size(); i++) {
+      uint64_t neighbor = node->neighbors(i);
+      graph_locks.writeLock();
+      if (graph->addNode(neighbor) == SUCCESS)
+        chain_append(ADD_NODE, neighbor, 0);
+      if (graph->addEdge(node_id, neighbor) == SUCCESS)
+        chain_append(ADD_EDGE, node_id, neighbor);
+      graph_locks.unlock();
+    }
+
+    std::cout << "RPC Server " << part << " took over node " << node_id << " with "
+              << node->neighbors_size() << " neighbors" << std::endl;
+
+    ack->set_status(SUCCESS);
+    return Status::OK;
+  }
+
+ private:
+  Graph *graph;
+
+  // Whether a replicated edge write may be applied here: its higher node
+  // must still be owned here and neither node may be migrating, so a peer
+  // routing by a map this partition has moved on from is refused. Caller
+  // holds graph_locks.
+  bool writable_edge(const Edge* edge) {
+    uint64_t node_a_id = edge->node_a().node_id();
+    uint64_t node_b_id = edge->node_b().node_id();
+    return (int) partitioner.owner(node_b_id) == part-1 &&
+           !migration_blocks(graph, ADD_EDGE, node_a_id, node_b_id);
+  }
+};
+
+// One in-progress RPC on a completion queue. The tag it registers
+// comes back from the queue twice: once when a request arrives and once
+// when the reply has been sent.
+//
+// The reply to a write waits, off the queue, until every write applied
+// here so far has reached the tail of this partition's chain, so a peer's
+// write, like a client's, is only acked once a read at the tail would see
+// it. That includes a write that changed nothing, whose 204 may rest on a
+// write still on its way down the chain. Reads reply at once.
+class Call {
+ public:
+  virtual ~Call() {}
+  virtual void Proceed(bool ok) = 0;
+};
+
+template <class Request, class Reply>
+class UnaryCall : public Call {
+ public:
+  typedef void (ReplicatorService::AsyncService::*RequestMethod)(
+      ServerContext*, Request*, ServerAsyncResponseWriter<Reply>*,
+      grpc::CompletionQueue*, ServerCompletionQueue*, void*);
+  typedef Status (ReplicatorImpl::*Handler)(ServerContext*, const Request*, Reply*);
+
+  UnaryCall(ReplicatorService::AsyncService *service, ServerCompletionQueue *cq,
+            ReplicatorImpl *impl, RequestMethod request_method, Handler handler, bool writes)
+      : service_(service), cq_(cq), impl_(impl), request_method_(request_method),
+        handler_(handler), writes_(writes), responder_(&context_), replied_(false) {
+    (service_->*request_method_)(&context_, &request_, &responder_, cq_, cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    if (!ok || replied_) {
+      delete this;
+      return;
+    }
+
+    // Take the next request for this method while handling this one
+    new UnaryCall(service_, cq_, impl_, request_method_, handler_, writes_);
+
+    status_ = (impl_->*handler_)(&context_, &request_, &reply_);
+    if (writes_ && chain_barrier(FinishAfterChain, this) == 0)
+      return;
+    Finish();
+  }
+
+ private:
+  // Completion for chain_barrier, on the chain link's thread
+  static void FinishAfterChain(int status, void *arg) {
+    static_cast<UnaryCall *>(arg)->Finish();
+  }
+
+  void Finish() {
+    replied_ = true;
+    responder_.Finish(reply_, status_, this);
+  }
+
+  ReplicatorService::AsyncService *service_;
+  ServerCompletionQueue *cq_;
+  ReplicatorImpl *impl_;
+  RequestMethod request_method_;
+  Handler handler_;
+  bool writes_;
+  ServerContext context_;
+  Request request_;
+  Reply reply_;
+  Status status_;
+  ServerAsyncResponseWriter<Reply> responder_;
+  bool replied_;
+};
+
+// A client-streaming call such as AddEdges or MigrateNodes. Each message
+// is applied as it is read, by the same handler as the matching unary
+// RPC, and its status added to the reply. Every such call writes, so the
+// reply waits on the chain like a unary write's.
+template <class Request>
+class BatchCall : public Call {
+ public:
+  typedef void (ReplicatorService::AsyncService::*RequestMethod)(
+      ServerContext*, ServerAsyncReader<BatchAck, Request>*,
+      grpc::CompletionQueue*, ServerCompletionQueue*, void*);
+  typedef Status (ReplicatorImpl::*Handler)(ServerContext*, const Request*, Ack*);
+
+  BatchCall(ReplicatorService::AsyncService *service, ServerCompletionQueue *cq,
+                ReplicatorImpl *impl, RequestMethod request_method, Handler handler)
+      : service_(service), cq_(cq), impl_(impl), request_method_(request_method),
+        handler_(handler), reader_(&context_), state_(REQUESTED) {
+    (service_->*request_method_)(&context_, &reader_, cq_, cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    switch (state_) {
+      case REQUESTED:
+        if (!ok) {
+          delete this;
+          return;
+        }
+        new BatchCall(service_, cq_, impl_, request_method_, handler_);
+        state_ = READING;
+        reader_.Read(&request_, this);
+        break;
+      case READING:
+        // ok is false once the client has sent its last message
+        if (ok) {
+          Ack ack;
+          (impl_->*handler_)(&context_, &request_, &ack);
+          reply_.add_statuses(ack.status());
+          reader_.Read(&request_, this);
+        } else {
+          std::cout << "RPC Server " << part << " applied batch of "
+                    << reply_.statuses_size() << std::endl;
+          state_ = FINISHED;
+          if (chain_barrier(FinishAfterChain, this) == SUCCESS)
+            Finish();
+        }
+        break;
+      case FINISHED:
+        delete this;
+        break;
+    }
+  }
+
+ private:
+  enum State { REQUESTED, READING, FINISHED };
+
+  // Completion for chain_barrier, on the chain link's thread
+  static void FinishAfterChain(int status, void *arg) {
+    static_cast<BatchCall *>(arg)->Finish();
+  }
+
+  void Finish() {
+    reader_.Finish(reply_, Status::OK, this);
+  }
+
+  ReplicatorService::AsyncService *service_;
+  ServerCompletionQueue *cq_;
+  ReplicatorImpl *impl_;
+  RequestMethod request_method_;
+  Handler handler_;
+  ServerContext context_;
+  ServerAsyncReader<BatchAck, Request> reader_;
+  Request request_;
+  BatchAck reply_;
+  State state_;
+};
+
+// A Relay call. serve_relayed replies to it from whichever thread the
+// request completes on, and waits on the chain itself for a write, so the
+// completion queue thread never waits on another partition.
+class RelayCall : public Call {
+ public:
+  RelayCall(ReplicatorService::AsyncService *service, ServerCompletionQueue *cq,
+            ReplicatorImpl *impl)
+      : service_(service), cq_(cq), impl_(impl), responder_(&context_), replied_(false) {
+    service_->RequestRelay(&context_, &request_, &responder_, cq_, cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    if (!ok || replied_) {
+      delete this;
+      return;
+    }
+
+    new RelayCall(service_, cq_, impl_);
+    impl_->Relay(&request_, Served, this);
+  }
+
+ private:
+  // Completion for serve_relayed
+  static void Served(int status, const char *body, int body_len, uint64_t lsn, void *arg) {
+    RelayCall *call = static_cast<RelayCall *>(arg);
+
+    call->reply_.set_status(status);
+    if (body != NULL)
+      call->reply_.set_body(body, body_len);
+    call->reply_.set_lsn(lsn);
+    call->replied_ = true;
+    call->responder_.Finish(call->reply_, Status::OK, call);
+  }
+
+  ReplicatorService::AsyncService *service_;
+  ServerCompletionQueue *cq_;
+  ReplicatorImpl *impl_;
+  ServerContext context_;
+  ClientRequest request_;
+  ClientReply reply_;
+  ServerAsyncResponseWriter<ClientReply> responder_;
+  bool replied_;
+};
+
+// A RemoveNode call. The node is reserved without blocking and removed
+// once the reservation is granted, on whichever thread releases the edge
+// it waited for, so the completion queue thread never waits on another
+// partition. The reply then waits on the chain like any unary write's.
+class RemoveNodeCall : public Call {
+ public:
+  RemoveNodeCall(ReplicatorService::AsyncService *service, ServerCompletionQueue *cq,
+                 ReplicatorImpl *impl)
+      : service_(service), cq_(cq), impl_(impl), responder_(&context_), replied_(false) {
+    service_->RequestRemoveNode(&context_, &request_, &responder_, cq_, cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    if (!ok || replied_) {
+      delete this;
+      return;
+    }
+
+    new RemoveNodeCall(service_, cq_, impl_);
+    if (edge_intents.reserveNode(request_.node_id(), Reserved, this))
+      Reserved(this);
+  }
+
+ private:
+  // Completion for reserveNode
+  static void Reserved(void *arg) {
+    RemoveNodeCall *call = static_cast<RemoveNodeCall *>(arg);
+
+    call->status_ = call->impl_->RemoveNode(&call->context_, &call->request_, &call->reply_);
+    edge_intents.releaseNode(call->request_.node_id());
+    if (chain_barrier(FinishAfterChain, call) == SUCCESS)
+      call->Finish();
+  }
+
+  // Completion for chain_barrier, on the chain link's thread
+  static void FinishAfterChain(int status, void *arg) {
+    static_cast<RemoveNodeCall *>(arg)->Finish();
+  }
+
+  void Finish() {
+    replied_ = true;
+    responder_.Finish(reply_, status_, this);
+  }
+
+  ReplicatorService::AsyncService *service_;
+  ServerCompletionQueue *cq_;
+  ReplicatorImpl *impl_;
+  ServerContext context_;
+  Node request_;
+  Ack reply_;
+  Status status_;
+  ServerAsyncResponseWriter<Ack> responder_;
+  bool replied_;
+};
+
+// The upstream end of a Forward stream. Acks are written from the chain
+// link's thread once the next replica has acked, possibly after the
+// stream has ended.
+class Upstream {
+ public:
+  explicit Upstream(ServerReaderWriter<ChainAck, ChainOp> *stream)
+      : stream_(stream), open_(true) {
+    pthread_mutex_init(&lock_, NULL);
+  }
+  ~Upstream() { pthread_mutex_destroy(&lock_); }
+
+  void Ack(const uint64_t seq) {
+    pthread_mutex_lock(&lock_);
+    if (open_) {
+      ChainAck ack;
+      ack.set_seq(seq);
+      stream_->Write(ack);
+    }
+    pthread_mutex_unlock(&lock_);
+  }
+
+  void Close() {
+    pthread_mutex_lock(&lock_);
+    open_ = false;
+    pthread_mutex_unlock(&lock_);
+  }
+
+ private:
+  ServerReaderWriter<ChainAck, ChainOp> *stream_;
+  pthread_mutex_t lock_;
+  bool open_;
+};
+
+struct PendingAck {
+  std::shared_ptr<Upstream> upstream;
+  uint64_t seq;
+};
+
+static void ack_upstream(int status, void *arg) {
+  PendingAck *pending = (PendingAck *) arg;
+  pending->upstream->Ack(pending->seq);
+  delete pending;
+}
+
+// Applies one write from the chain or a Follow stream. Caller holds the
+// graph lock exclusively.
+int apply_write(Graph *graph, const int op, const uint64_t node_a_id, const uint64_t node_b_id) {
+  switch (op) {
+    case ADD_NODE:
+      return graph->addNode(node_a_id);
+    case REMOVE_NODE:
+      return graph->removeNode(node_a_id);
+    case ADD_EDGE:
+      return graph->addEdge(node_a_id, node_b_id);
+    case REMOVE_EDGE:
+      return graph->removeEdge(node_a_id, node_b_id);
+  }
+  return ERROR;
+}
+
+// Most writes a Follow stream takes from the log at once, and how long it
+// waits for one before sending a heartbeat anyway
+#define FOLLOW_BATCH 1024
+#define FOLLOW_HEARTBEAT_MS 50
+
+// Applies the writes coming down the chain, one stream at a time in the
+// order they were sent, and passes each on to the next replica. A write is
+// acked once it has reached the tail. Also feeds read replicas from the
+// write log. Served by gRPC's own sync threads, apart from the replication
+// queues.
+class ChainImpl final : public ChainService::Service {
+ public:
+  explicit ChainImpl(Graph *g) {
+    graph = g;
+  }
+
+  Status Forward(ServerContext* context,
+                 ServerReaderWriter<ChainAck, ChainOp>* stream) override {
+    std::shared_ptr<Upstream> upstream = std::make_shared<Upstream>(stream);
+    ChainOp op;
+
+    std::cout << "Chain replica " << part << " receiving writes" << std::endl;
+
+    while (stream->Read(&op)) {
+      // Writes resent after a broken stream were applied the first time
+      graph_locks.writeLock();
+      if (op.seq() > write_log.lsn()) {
+        apply_write(graph, op.op(), op.node_a(), op.node_b());
+        chain_forward(op.seq(), op.op(), op.node_a(), op.node_b());
+      }
+      graph_locks.unlock();
+
+      PendingAck *pending = new PendingAck();
+      pending->upstream = upstream;
+      pending->seq = op.seq();
+      if (chain_barrier(ack_upstream, pending) == SUCCESS)
+        ack_upstream(SUCCESS, pending);
+    }
+
+    upstream->Close();
+    return Status::OK;
+  }
+
+  // Sends the graph as it stands, then the write log from there on, with
+  // a heartbeat after each run of writes so the read replica knows how
+  // current it is
+  Status Follow(ServerContext* context, const FollowRequest* request,
+                ServerWriter<ChainOp>* writer) override {
+    if (request->partition() != part)
+      return Status(grpc::StatusCode::INVALID_ARGUMENT, "wrong partition");
+
+    graph_locks.readLock();
+    std::vector<uint64_t> nodes = graph->getNodes();
+    std::vector<std::pair<uint64_t, uint64_t> > edges = graph->getEdges();
+    uint64_t after = write_log.lsn();
+    graph_locks.unlock();
+
+    std::cout << "Read replica following partition " << part << " from LSN " << after << std::endl;
+
+    // A sync writer blocks on a buffered write that would carry the
+    // initial metadata, so that goes out first on its own
+    writer->SendInitialMetadata();
+
+    grpc::WriteOptions buffered;
+    buffered.set_buffer_hint();
+    ChainOp op;
+    op.set_seq(after);
+    op.set_op(SNAPSHOT);
+    writer->Write(op, buffered);
+    op.set_op(ADD_NODE);
+    for (size_t i = 0; i < nodes.size(); i++) {
+      op.set_node_a(nodes[i]);
+      writer->Write(op, buffered);
+    }
+    op.set_op(ADD_EDGE);
+    for (size_t i = 0; i < edges.size(); i++) {
+      op.set_node_a(edges[i].first);
+      op.set_node_b(edges[i].second);
+      writer->Write(op, buffered);
+    }
+
+    std::vector<WriteLog::Entry> entries;
+    while (!context->IsCancelled()) {
+      if (write_log.read(after, entries, FOLLOW_BATCH, FOLLOW_HEARTBEAT_MS) != SUCCESS)
+        return Status(grpc::StatusCode::OUT_OF_RANGE, "fell behind the write log");
+
+      for (size_t i = 0; i < entries.size(); i++) {
+        op.set_seq(entries[i].lsn);
+        op.set_op(entries[i].op);
+        op.set_node_a(entries[i].node_a_id);
+        op.set_node_b(entries[i].node_b_id);
+        writer->Write(op, buffered);
+        after = entries[i].lsn;
+      }
+
+      op.Clear();
+      op.set_seq(after);
+      op.set_op(HEARTBEAT);
+      if (!writer->Write(op))
+        break;
+    }
     return Status::OK;
   }
 
@@ -121,18 +656,81 @@ class ReplicatorImpl final : public ReplicatorService::Service {
   Graph *graph;
 };
 
+struct ServerQueue {
+  ReplicatorService::AsyncService *service;
+  ReplicatorImpl *impl;
+  std::unique_ptr<ServerCompletionQueue> cq;
+  pthread_t thread;
+};
+
+static void *ServeQueue(void *v) {
+  ServerQueue *q = (ServerQueue *) v;
+  ReplicatorService::AsyncService *service = q->service;
+  ServerCompletionQueue *cq = q->cq.get();
+  ReplicatorImpl *impl = q->impl;
+
+  new UnaryCall<Node, Ack>(service, cq, impl, &ReplicatorService::AsyncService::RequestAddNode,
+                           &ReplicatorImpl::AddNode, true);
+  new RemoveNodeCall(service, cq, impl);
+  new UnaryCall<Edge, Ack>(service, cq, impl, &ReplicatorService::AsyncService::RequestAddEdge,
+                           &ReplicatorImpl::AddEdge, true);
+  new UnaryCall<Edge, Ack>(service, cq, impl, &ReplicatorService::AsyncService::RequestRemoveEdge,
+                           &ReplicatorImpl::RemoveEdge, true);
+  new BatchCall<Edge>(service, cq, impl, &ReplicatorService::AsyncService::RequestAddEdges,
+                      &ReplicatorImpl::AddEdge);
+  new BatchCall<Edge>(service, cq, impl, &ReplicatorService::AsyncService::RequestRemoveEdges,
+                      &ReplicatorImpl::RemoveEdge);
+  new UnaryCall<Node, Ack>(service, cq, impl, &ReplicatorService::AsyncService::RequestHasNode,
+                           &ReplicatorImpl::HasNode, false);
+  new UnaryCall<Frontier, Frontier>(service, cq, impl, &ReplicatorService::AsyncService::RequestExpandFrontier,
+                                    &ReplicatorImpl::ExpandFrontier, false);
+  new UnaryCall<Frontier, Ack>(service, cq, impl, &ReplicatorService::AsyncService::RequestEndSearch,
+                               &ReplicatorImpl::EndSearch, false);
+  new BatchCall<Adjacency>(service, cq, impl, &ReplicatorService::AsyncService::RequestMigrateNodes,
+                           &ReplicatorImpl::MigrateNode);
+  new RelayCall(service, cq, impl);
+
+  void *tag;
+  bool ok;
+  while (cq->Next(&tag, &ok)) {
+    static_cast<Call *>(tag)->Proceed(ok);
+  }
+  return NULL;
+}
+
 void *RunServer(void *v) {
   char str[80];
   strcpy(str, "0.0.0.0");
   strcat(str, rpc_port);
 
   std::string server_address(str);
-  ReplicatorImpl service((Graph *) v);
+  ReplicatorImpl impl((Graph *) v);
+  ReplicatorService::AsyncService service;
+  ChainImpl chain((Graph *) v);
+
+  int num_queues = rpc_threads > 0 ? rpc_threads : 1;
+  std::vector<ServerQueue> queues(num_queues);
 
   ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
   builder.RegisterService(&service);
+  builder.RegisterService(&chain);
+  for (int i = 0; i < num_queues; i++) {
+    queues[i].service = &service;
+    queues[i].impl = &impl;
+    queues[i].cq = builder.AddCompletionQueue();
+  }
   std::unique_ptr<Server> server(builder.BuildAndStart());
-  std::cout << "RPC Server " << part << " listening on " << server_address << std::endl;
-  server->Wait();
-}
\ No newline at end of file
+  std::cout << "RPC Server " << part << " listening on " << server_address
+            << " with " << num_queues << " threads" << std::endl;
+
+  // One thread per completion queue; this thread serves the first
+  for (int i = 1; i < num_queues; i++) {
+    pthread_create(&queues[i].thread, NULL, ServeQueue, &queues[i]);
+  }
+  ServeQueue(&queues[0]);
+  for (int i = 1; i < num_queues; i++) {
+    pthread_join(queues[i].thread, NULL);
+  }
+  return NULL;
+}